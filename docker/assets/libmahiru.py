@@ -1,27 +1,241 @@
 #!/usr/bin/env python3
-"""Simple dummy support library for Mahiru compute assets.
+"""Simple support library for Mahiru compute assets.
 
-This API is just a placeholder so we can get some simple tests running.
-My dreams of the future suggest that one day there may be multiple
-steps in a container, and the data access API will be quite a bit more
+This API is still fairly simple, but it gets some tests running. My
+dreams of the future suggest that one day there may be multiple steps
+in a container, and the data access API will be quite a bit more
 powerful. That's foreshadowed a tiny bit here by the register_step()
 function and the separate run() call.
+
+There are two ways of accessing data. A step registered using
+register_step() gets local files, with the inputs downloaded before
+it is called and the outputs uploaded after it returns. A step
+registered using register_streaming_step() instead gets Input and
+Output objects, which read from and write to the data containers
+directly as the step runs. That way, processing can start as soon as
+the first data arrives, and inputs and outputs need not fit on the
+local disk.
 """
 
+import io
 import json
 from pathlib import Path
 import os
-from os import system
+from queue import Queue
+from threading import Thread
 import requests
-from typing import Any, Callable, Dict, Optional
+from typing import (
+        Any, BinaryIO, Callable, Dict, Iterable, Iterator, Optional, Union,
+        cast)
 
 
 # Directory for storing input and output files
 _BASE_PATH = Path('/srv/mahiru')
 
+# Size of the pieces in which data is transferred
+_CHUNK_SIZE = 1024 * 1024
+
+# Maximum number of written chunks waiting to be uploaded
+_MAX_PENDING_CHUNKS = 8
+
+
+class Input:
+    """Gives streaming access to a step input.
+
+    The data is read directly from the data container serving the
+    input, over the network, and is not stored locally.
+    """
+    def __init__(self, endpoint: str) -> None:
+        """Create an Input.
+
+        Args:
+            endpoint: URL of the data container serving the input.
+        """
+        self._url = '{}/data.json'.format(endpoint)
+
+    def open(self) -> BinaryIO:
+        """Open the input for reading.
+
+        Data is received as it is read from the returned file object,
+        so it can be processed as it comes in. Close the file when
+        done.
+
+        Return:
+            A binary file object to read the data from.
+        """
+        r = requests.get(self._url, stream=True)
+        r.raise_for_status()
+        r.raw.decode_content = True
+        return cast(BinaryIO, r.raw)
+
+    def chunks(self, chunk_size: int = _CHUNK_SIZE) -> Iterator[bytes]:
+        """Read the input in chunks.
+
+        Args:
+            chunk_size: Size of the chunks in bytes. The last one may
+                    be smaller.
+
+        Yields:
+            Consecutive chunks of data.
+        """
+        with requests.get(self._url, stream=True) as r:
+            r.raise_for_status()
+            for chunk in r.iter_content(chunk_size):
+                yield chunk
+
+    def size(self) -> int:
+        """Return the size of the input in bytes."""
+        r = requests.head(self._url)
+        r.raise_for_status()
+        return int(r.headers['Content-Length'])
+
+    def read_range(self, offset: int, length: int) -> bytes:
+        """Read a part of the input.
+
+        Args:
+            offset: Position of the first byte to read.
+            length: The number of bytes to read.
+
+        Return:
+            The requested data, which will be shorter than length if
+            the input ends before offset + length.
+        """
+        if length <= 0:
+            return b''
+
+        headers = {'Range': 'bytes={}-{}'.format(offset, offset + length - 1)}
+        r = requests.get(self._url, headers=headers)
+        if r.status_code == 416:
+            return b''
+        r.raise_for_status()
+        if r.status_code != 206:
+            # server ignored the range, so cut it out ourselves
+            return r.content[offset:offset + length]
+        return r.content
+
+
+class _OutputStream(io.RawIOBase):
+    """A file object which uploads what is written to it.
+
+    The data is sent using a chunked HTTP PUT request on a background
+    thread, so that the step can continue computing while the data is
+    being sent. Closing the stream completes the upload.
+    """
+    def __init__(self, url: str) -> None:
+        """Create an _OutputStream and start uploading.
+
+        Args:
+            url: URL to upload to.
+        """
+        super().__init__()
+        self._pending = Queue(_MAX_PENDING_CHUNKS)  # type: Queue[bytes]
+        self._error = None      # type: Optional[Exception]
+        self._thread = Thread(target=self._upload, args=(url,))
+        self._thread.start()
+
+    def writable(self) -> bool:
+        """Return whether the stream can be written to."""
+        return True
+
+    def write(self, data: Any) -> int:
+        """Write data to the stream.
+
+        Args:
+            data: A bytes-like object with the data to write.
+
+        Return:
+            The number of bytes written.
+        """
+        if self.closed:
+            raise ValueError('Write to closed output')
+        if self._error is not None:
+            raise RuntimeError('Upload failed') from self._error
+        data = bytes(data)
+        if data:
+            self._pending.put(data)
+        return len(data)
+
+    def close(self) -> None:
+        """Complete the upload and close the stream.
+
+        Raises:
+            RuntimeError: If the upload failed.
+        """
+        if self.closed:
+            return
+        super().close()
+        self._pending.put(b'')
+        self._thread.join()
+        if self._error is not None:
+            raise RuntimeError('Upload failed') from self._error
+
+    def _chunks(self) -> Iterator[bytes]:
+        """Yield written chunks until the stream is closed."""
+        while True:
+            chunk = self._pending.get()
+            if not chunk:
+                return
+            yield chunk
+
+    def _upload(self, url: str) -> None:
+        """Send the data. Runs on the background thread."""
+        chunks = self._chunks()
+        try:
+            r = requests.put(url, data=chunks)
+            r.raise_for_status()
+        except Exception as e:
+            self._error = e
+            # drain, so that writers don't block on a full queue
+            for _ in chunks:
+                pass
+
+
+class Output:
+    """Gives streaming access to a step output.
+
+    The data is sent directly to the data container that will hold the
+    output as it is written, and is not stored locally.
+    """
+    def __init__(self, endpoint: str) -> None:
+        """Create an Output.
+
+        Args:
+            endpoint: URL of the data container to write the output
+                    to.
+        """
+        self._url = '{}/data.json'.format(endpoint)
+
+    def open(self) -> BinaryIO:
+        """Open the output for writing.
+
+        The returned file object must be closed to complete the upload.
+        Writing blocks if the network doesn't keep up.
+
+        Return:
+            A binary file object to write the data to.
+        """
+        return cast(BinaryIO, io.BufferedWriter(
+                _OutputStream(self._url), _CHUNK_SIZE))
+
+    def write_chunks(self, chunks: Iterable[bytes]) -> None:
+        """Upload the output from an iterable of chunks.
+
+        Chunks are sent as they are produced, so this can be used
+        with a generator to overlap computation and uploading.
+
+        Args:
+            chunks: The data to write.
+        """
+        r = requests.put(self._url, data=iter(chunks))
+        r.raise_for_status()
+
 
 StepFunction = Callable[[Dict[str, Path]], None]
 
+StreamingStepFunction = Callable[[Dict[str, Input], Dict[str, Output]], None]
+
+_AnyStepFunction = Union[StepFunction, StreamingStepFunction]
+
 
 def register_step(step_function: StepFunction) -> None:
     """Register a step with Mahiru.
@@ -30,29 +244,57 @@ def register_step(step_function: StepFunction) -> None:
     day we'll have more than one step in a container, but for now
     there's only one, so we don't have to name it.
 
+    The step function is passed a dictionary mapping input and output
+    names to local files to read from or write to.
+
+    Args:
+        step_function: Step function to call.
+    """
+    global _step_function, _streaming
+    _step_function = step_function
+    _streaming = False
+
+
+def register_streaming_step(step_function: StreamingStepFunction) -> None:
+    """Register a streaming step with Mahiru.
+
+    Like register_step(), but the step function is passed two
+    dictionaries, one mapping input names to Input objects and one
+    mapping output names to Output objects.
+
     Args:
         step_function: Step function to call.
     """
-    global _step_function
+    global _step_function, _streaming
     _step_function = step_function
+    _streaming = True
 
 
 def run() -> None:
     """Run the step."""
     config = _get_step_config()
 
-    in_out = _download_inputs(config['inputs'])
-    in_out.update(_output_paths(config['outputs']))
-
     if _step_function is None:
         raise RuntimeError('Cannot run because no step was registered')
-    _step_function(in_out)
 
-    _upload_outputs(config['outputs'])
+    if _streaming:
+        inputs = {
+                name: Input(endpoint)
+                for name, endpoint in config['inputs'].items()}
+        outputs = {
+                name: Output(endpoint)
+                for name, endpoint in config['outputs'].items()}
+        cast(StreamingStepFunction, _step_function)(inputs, outputs)
+    else:
+        in_out = _download_inputs(config['inputs'])
+        in_out.update(_output_paths(config['outputs']))
+        cast(StepFunction, _step_function)(in_out)
+        _upload_outputs(config['outputs'])
 
 
-# Yuck! A global!
-_step_function = None   # type: Optional[StepFunction]
+# Yuck! Globals!
+_step_function = None   # type: Optional[_AnyStepFunction]
+_streaming = False
 
 
 def _get_step_config() -> Dict[str, Any]:
@@ -85,9 +327,9 @@ def _download_inputs(inputs: Dict[str, str]) -> Dict[str, Path]:
         target_dir = _BASE_PATH / name
         target_dir.mkdir()
         target_file = target_dir / 'data.json'
-        r = requests.get('{}/data.json'.format(endpoint))
         with target_file.open('wb') as f:
-            f.write(r.content)
+            for chunk in Input(endpoint).chunks():
+                f.write(chunk)
         in_paths[name] = target_file
     return in_paths
 
@@ -119,4 +361,6 @@ def _upload_outputs(outputs: Dict[str, str]) -> None:
         output_file = _BASE_PATH / name / 'data.json'
         target_url = '{}/data.json'.format(endpoint)
         with output_file.open('rb') as f:
-            requests.put(target_url, data=f.read())
+            # passing the file streams it rather than reading it all
+            r = requests.put(target_url, data=f)
+            r.raise_for_status()
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+"""Benchmark application which passes its data through.
+
+This copies input x1 to output y, and reads and discards any other
+inputs. It does no computing to speak of, so that a workflow made of
+these steps measures how fast Mahiru moves data between steps.
+"""
+
+from typing import Dict
+
+import libmahiru
+
+
+def passthrough(
+        inputs: Dict[str, libmahiru.Input],
+        outputs: Dict[str, libmahiru.Output]) -> None:
+    """Copy x1 to y, streaming.
+
+    Args:
+        inputs: The step's inputs, x1 and optionally others.
+        outputs: The step's outputs, just y.
+    """
+    for name, inp in inputs.items():
+        if name != 'x1':
+            for _ in inp.chunks():
+                pass
+
+    outputs['y'].write_chunks(inputs['x1'].chunks())
+
+
+if __name__ == '__main__':
+    libmahiru.register_streaming_step(passthrough)
+    libmahiru.run()
@@ -1,3 +1,7 @@
+import multiprocessing
+
+from mahiru.rest.registry import MAX_LONG_POLLS
+
 # Logging
 accesslog = '-'
 errorlog = '-'
@@ -6,5 +10,14 @@ capture_output = True
 # Listening
 bind = ['0.0.0.0:8000']
 
+# Handling
+# The registry keeps its state in memory, so we need a single process.
+# Sites long poll /updates, which ties up a thread per site while
+# nothing changes. The registry limits their number to MAX_LONG_POLLS,
+# so we add that many threads to the usual two per core.
+worker_class = 'gthread'
+workers = 1
+threads = multiprocessing.cpu_count() * 2 + 1 + MAX_LONG_POLLS
+
 # App
 wsgi_app = 'mahiru.rest.registry:wsgi_app()'
@@ -1,5 +1,7 @@
 import multiprocessing
 
+from mahiru.components.settings import load_settings
+
 # Logging
 accesslog = '-'
 errorlog = '-'
@@ -9,12 +11,23 @@ capture_output = True
 bind = ['0.0.0.0:8000']
 
 # Handling
-# We need threads in a single process because we store state in memory in the
-# Python process, and because we make requests to our own site at times. We use
-# three times the number of cores rather than two for that reason.
+# We use threads in a single process, because not all of the site's state
+# can be shared between processes yet. Stored assets and submitted jobs can
+# be kept in a SQLite database by setting a state_dir in the site
+# configuration, but the policy rules, the WireGuard port, net and connection
+# bookkeeping, and the domain administrator's image cache and pilot
+# containers are kept in memory in each process. Several workers would hand
+# out the same ports and nets, and could remove images that another worker
+# is still using, so there is only one.
+#
+# We make requests to our own site at times, so we use three times the number
+# of cores rather than two. On top of that, other sites long poll our policy
+# updates endpoint and wait for assets they need, which ties up a thread for
+# each such request. The site limits their number to max_long_polls from its
+# configuration, so we add that many threads.
 worker_class = 'gthread'
 workers = 1
-threads = multiprocessing.cpu_count() * 3 + 1
+threads = multiprocessing.cpu_count() * 3 + 1 + load_settings().max_long_polls
 
 # App
 wsgi_app = 'mahiru.rest.ddm_site:wsgi_app()'
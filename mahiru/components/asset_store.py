@@ -4,50 +4,83 @@ import logging
 from pathlib import Path
 from shutil import copyfile, move, rmtree
 from tempfile import mkdtemp
-from typing import Dict, Optional
+from threading import Condition
+import time
+from typing import Optional
 
+from mahiru.components.state_store import MemoryStateStore, StateStore
 from mahiru.definitions.assets import Asset, ComputeAsset, DataAsset
 from mahiru.definitions.connections import ConnectionInfo, ConnectionRequest
 from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.interfaces import IAssetStore, IDomainAdministrator
 from mahiru.policy.evaluation import PermissionCalculator, PolicyEvaluator
+from mahiru.util import file_digest
 
 
 logger = logging.getLogger(__name__)
 
 
+# Interval in seconds at which to check for assets stored by other
+# processes sharing our state store, while waiting for one.
+_WAIT_POLL_INTERVAL = 0.5
+
+
 class AssetStore(IAssetStore):
-    """A simple store for assets."""
+    """A simple store for assets.
+
+    Asset records and connection owners are kept in a StateStore. If
+    that is shared between processes, then so is the image directory,
+    and assets stored by one process can be retrieved from any of them.
+
+    The SHA-256 digest of each image is calculated when it's stored,
+    and kept in the StateStore as well, so that serving an image does
+    not require reading it in full first.
+    """
     def __init__(
             self, policy_evaluator: PolicyEvaluator,
             domain_administrator: IDomainAdministrator,
-            image_dir: Optional[Path] = None) -> None:
-        """Create a new empty AssetStore.
+            image_dir: Optional[Path] = None,
+            state: Optional[StateStore] = None) -> None:
+        """Create a new AssetStore.
 
         Args:
             policy_evaluator: Policy evaluator to use for access
                     checks.
             domain_administrator: Domain administrator to use for
                     serving assets over the network.
-            image_dir: Local directory to store image files in.
+            image_dir: Local directory to store image files in. If not
+                    given, a temporary directory is created, which
+                    will be removed on close().
+            state: Store to keep asset records in, defaults to a new
+                    MemoryStateStore.
         """
         self._policy_evaluator = policy_evaluator
         self._domain_administrator = domain_administrator
         self._permission_calculator = PermissionCalculator(policy_evaluator)
 
-        # TODO: lock this
-        self._assets = dict()  # type: Dict[Identifier, Asset]
+        if state is None:
+            state = MemoryStateStore()
+
+        # Notified when an asset is stored by this process
+        self._stored = Condition()
+        self._assets = state.table('assets', Asset)
+        # Hex SHA-256 of the image, by asset id
+        self._image_digests = state.table('image_digests', str)
+
+        self._own_image_dir = image_dir is None
         if image_dir is None:
             # TODO: add mahiru prefix
             image_dir = Path(mkdtemp())
         self._image_dir = image_dir
 
         # Requester per connection
-        self._connection_owners = dict()    # type: Dict[str, Identifier]
+        self._connection_owners = state.table(
+                'connection_owners', Identifier)
 
     def close(self) -> None:
         """Releases resources, call when done."""
-        rmtree(self._image_dir, ignore_errors=True)
+        if self._own_image_dir:
+            rmtree(self._image_dir, ignore_errors=True)
 
     def store(self, asset: Asset, move_image: bool = False) -> None:
         """Stores an asset.
@@ -62,11 +95,12 @@ class AssetStore(IAssetStore):
             KeyError: If there's already an asset with the asset id.
 
         """
-        if asset.id in self._assets:
+        if self._assets.get(asset.id) is not None:
             raise KeyError(f'There is already an asset with id {asset.id}')
 
-        # TODO: ordering, get file first then insert Asset object
-        self._assets[asset.id] = copy(asset)
+        # Get the file in place first, so that anyone waiting for the
+        # asset can get the image as soon as they see the asset.
+        stored_asset = copy(asset)
         if asset.image_location is not None:
             src_path = Path(asset.image_location)
             tgt_path = self._image_dir / f'{asset.id}.tar.gz'
@@ -74,7 +108,15 @@ class AssetStore(IAssetStore):
                 move(str(src_path), str(tgt_path))
             else:
                 copyfile(src_path, tgt_path)
-            self._assets[asset.id].image_location = str(tgt_path)
+            stored_asset.image_location = str(tgt_path)
+            self._image_digests.put(
+                    asset.id, file_digest(tgt_path).hex())
+
+        with self._stored:
+            if not self._assets.insert(asset.id, stored_asset):
+                raise KeyError(
+                        f'There is already an asset with id {asset.id}')
+            self._stored.notify_all()
 
     def store_image(
             self, asset_id: Identifier, image_file: Path,
@@ -89,23 +131,29 @@ class AssetStore(IAssetStore):
             KeyError: If there's no asset with the given ID.
 
         """
-        if asset_id not in self._assets:
+        asset = self._assets.get(asset_id)
+        if asset is None:
             raise KeyError(f'Asset with id {asset_id} not found.')
 
-        asset = self._assets[asset_id]
         tgt_path = self._image_dir / f'{asset_id}.tar.gz'
         if move_image:
             move(str(image_file), str(tgt_path))
         else:
             copyfile(image_file, tgt_path)
+        self._image_digests.put(asset_id, file_digest(tgt_path).hex())
         asset.image_location = str(tgt_path)
+        self._assets.put(asset_id, asset)
 
-    def retrieve(self, asset_id: Identifier, requester: Identifier) -> Asset:
+    def retrieve(
+            self, asset_id: Identifier, requester: Identifier,
+            wait: float = 0.0) -> Asset:
         """Retrieves an asset.
 
         Args:
             asset_id: ID of the asset to retrieve.
             requester: Name of the site making the request.
+            wait: If the asset isn't here yet, wait at most this many
+                    seconds for it to be stored.
 
         Return:
             The asset object with asset_id.
@@ -116,9 +164,32 @@ class AssetStore(IAssetStore):
         """
         logger.info(f'{self}: servicing request from {requester} for data: '
                     f'{asset_id}')
-        self._check_request(asset_id, requester)
+        if wait > 0.0:
+            deadline = time.monotonic() + wait
+            with self._stored:
+                while self._assets.get(asset_id) is None:
+                    remaining = deadline - time.monotonic()
+                    if remaining <= 0.0:
+                        break
+                    self._stored.wait(min(remaining, _WAIT_POLL_INTERVAL))
+        asset = self._check_request(asset_id, requester)
         logger.info(f'{self}: Sending asset {asset_id} to {requester}')
-        return self._assets[asset_id]
+        return asset
+
+    def image_digest(self, asset_id: Identifier) -> bytes:
+        """Returns the SHA-256 digest of an asset's image file.
+
+        Args:
+            asset_id: ID of the asset whose image to get the digest of.
+
+        Raises:
+            KeyError: If there's no image for this asset.
+
+        """
+        digest = self._image_digests.get(asset_id)
+        if digest is None:
+            raise KeyError(f'No image for asset {asset_id}')
+        return bytes.fromhex(digest)
 
     def serve(
             self, asset_id: Identifier, request: ConnectionRequest,
@@ -141,10 +212,15 @@ class AssetStore(IAssetStore):
         """
         logger.info(f'{self}: servicing request from {requester} for'
                     f' connection to {asset_id}')
-        self._check_request(asset_id, requester)
+        asset = self._check_request(asset_id, requester)
+        try:
+            digest = self.image_digest(asset_id)    # type: Optional[bytes]
+        except KeyError:
+            # no image, or stored before we kept digests
+            digest = None
         conn_info = self._domain_administrator.serve_asset(
-                self._assets[asset_id], request)
-        self._connection_owners[conn_info.conn_id] = requester
+                asset, request, digest)
+        self._connection_owners.put(conn_info.conn_id, requester)
         return conn_info
 
     def stop_serving(self, conn_id: str, requester: Identifier) -> None:
@@ -159,36 +235,39 @@ class AssetStore(IAssetStore):
             RuntimeError: If the requester does not have permission to
                     stop this connection.
         """
-        if conn_id not in self._connection_owners:
+        owner = self._connection_owners.get(conn_id)
+        if owner is None:
             raise KeyError('Invalid connection id')
 
-        if self._connection_owners[conn_id] != requester:
+        if owner != requester:
             raise RuntimeError('Permission denied')
 
         self._domain_administrator.stop_serving_asset(conn_id)
-        del self._connection_owners[conn_id]
+        self._connection_owners.delete(conn_id)
 
     def _check_request(
-            self, asset_id: Identifier, requester: Identifier) -> None:
+            self, asset_id: Identifier, requester: Identifier) -> Asset:
         """Check that a request for an asset is allowed.
 
         Args:
             asset_id: The asset being requested.
             requester: The site requesting access to it.
 
+        Return:
+            The requested asset.
+
         Raises:
             KeyError: If we don't have this asset.
             RuntimeError: If the request is not allowed.
         """
-        if asset_id not in self._assets:
+        asset = self._assets.get(asset_id)
+        if asset is None:
             msg = (
                     f'{self}: Asset {asset_id} not found'
                     f' (requester = {requester}).')
             logger.info(msg)
             raise KeyError(msg)
 
-        asset = self._assets[asset_id]
-
         if isinstance(asset, DataAsset):
             perms = self._permission_calculator.calculate_permissions(
                     asset.metadata.job)
@@ -200,3 +279,5 @@ class AssetStore(IAssetStore):
         if not self._policy_evaluator.may_access(perm, requester):
             raise RuntimeError(f'{self}: Security error, access denied'
                                f'for {requester} to {asset_id}')
+
+        return asset
@@ -9,6 +9,8 @@ from mahiru.components.domain_administrator import PlainDockerDA
 from mahiru.components.network_administrator import WireGuardNA
 from mahiru.components.registry_client import RegistryClient
 from mahiru.components.settings import SiteConfiguration
+from mahiru.components.state_store import (
+        MemoryStateStore, SQLiteStateStore, StateStore)
 from mahiru.components.step_runner import StepRunner
 from mahiru.definitions.assets import Asset
 from mahiru.definitions.identifier import Identifier
@@ -62,27 +64,40 @@ class Site:
 
         self._policy_client = PolicyClient(
                 self._registry_client, config.trust_store,
-                config.client_creds())
+                config.client_creds(), config.replication_long_poll)
         self._policy_evaluator = PolicyEvaluator(self._policy_client)
 
+        # Shared state
+        image_dir = None
+        if config.state_dir is not None:
+            image_dir = config.state_dir / 'images'
+            image_dir.mkdir(parents=True, exist_ok=True)
+            self._state = SQLiteStateStore(
+                    config.state_dir / 'state.db')  # type: StateStore
+        else:
+            self._state = MemoryStateStore()
+
         # Server side
         self._network_administrator = WireGuardNA(
                 config.network_settings, self._site_rest_client)
 
         self._domain_administrator = PlainDockerDA(
-                self._network_administrator, self._site_rest_client)
+                self._network_administrator, self._site_rest_client,
+                config.image_cache_size,
+                pilot_pool_size=config.pilot_pool_size, state=self._state)
 
         self.store = AssetStore(
-                self._policy_evaluator, self._domain_administrator)
+                self._policy_evaluator, self._domain_administrator,
+                image_dir, self._state)
 
         self.runner = StepRunner(
                 self.id, self._site_rest_client, self._policy_evaluator,
-                self._domain_administrator, self.store)
+                self._domain_administrator, self.store, config.step_slots)
 
         # Client side
         self.orchestrator = WorkflowOrchestrator(
                 self._policy_evaluator, self._registry_client,
-                self._site_rest_client)
+                self._site_rest_client, self._state)
 
         # Insert data
         for asset in stored_data:
@@ -90,7 +105,11 @@ class Site:
 
     def close(self) -> None:
         """Release resources."""
+        self._policy_client.close()
         self.store.close()
+        self._domain_administrator.close()
+        self._network_administrator.close()
+        self._state.close()
 
     def __repr__(self) -> str:
         """Return a string representation of this object."""
@@ -1,17 +1,21 @@
 """Components that manage local container-based execution."""
-import gzip
+from collections import deque, OrderedDict
+from concurrent.futures import ThreadPoolExecutor
+from hashlib import sha256
 import json
 import logging
 from shutil import rmtree
-from threading import Lock
+from threading import Condition, Lock, Thread
 from tempfile import mkdtemp, TemporaryDirectory
 from pathlib import Path
-from typing import Dict, Iterable, List, Optional, Tuple
+from typing import Any, Deque, Dict, Iterable, List, Optional, Tuple
 
 import docker
 from docker.models.images import Image
 from docker.models.containers import Container
 
+from mahiru.components.image_codec import ImageCodec, ParallelGzipCodec
+from mahiru.components.state_store import MemoryStateStore, StateStore
 from mahiru.definitions.assets import (
         Asset, ComputeAsset, DataAsset, DataMetadata)
 from mahiru.definitions.connections import (
@@ -20,12 +24,60 @@ from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.interfaces import (
         IDomainAdministrator, INetworkAdministrator, IStepResult)
 from mahiru.definitions.workflows import Job, WorkflowStep
+from mahiru.metrics import REGISTRY
 from mahiru.rest.site_client import SiteRestClient
 
 
 logger = logging.getLogger(__name__)
 
 
+_PILOT_IMAGE = 'mahiru-pilot:latest'
+
+_PILOT_IMAGE_FILE = Path(__file__).parents[1] / 'data' / 'pilot.tar.gz'
+
+# Docker repository under which cached images are tagged
+_IMAGE_CACHE_REPOSITORY = 'mahiru-image-cache'
+
+# Time to wait before retrying if a pool pilot container fails to start
+_PILOT_POOL_RETRY_INTERVAL = 5.0
+
+
+_image_cache_requests = REGISTRY.counter(
+        'mahiru_image_cache_requests_total',
+        'Asset images needed by a step, by whether they were cached',
+        ['result'])
+
+_image_cache_evictions = REGISTRY.counter(
+        'mahiru_image_cache_evictions_total',
+        'Asset images removed from the cache to make space')
+
+_image_cache_bytes = REGISTRY.gauge(
+        'mahiru_image_cache_bytes',
+        'Total size of the unused asset images kept in the cache')
+
+_pilot_pool_requests = REGISTRY.counter(
+        'mahiru_pilot_pool_requests_total',
+        'Pilot containers needed by a step, by whether one was ready',
+        ['result'])
+
+_image_load_seconds = REGISTRY.histogram(
+        'mahiru_image_load_seconds',
+        'Time taken to load an asset image into Docker')
+
+_loaded_images_gauge = REGISTRY.gauge(
+        'mahiru_loaded_images',
+        'Number of asset images loaded into Docker and in use')
+
+_container_seconds = REGISTRY.histogram(
+        'mahiru_container_seconds',
+        'Time taken by container operations for a step, by operation',
+        ['operation'])
+
+_served_assets_gauge = REGISTRY.gauge(
+        'mahiru_served_assets',
+        'Number of asset containers being served to other sites')
+
+
 class StepResult(IStepResult):
     """Contains and manages the outputs of a step.
 
@@ -63,32 +115,86 @@ class PlainDockerDA(IDomainAdministrator):
     installation to run steps. It's intended to be a baseline
     implementation which doesn't offer much in the way of security
     or performance.
+
+    Asset images that are no longer in use are kept loaded in Docker,
+    up to a configurable total size, so that they needn't be
+    downloaded and loaded again if they're used again soon. When the
+    cache is full, the least recently used images are removed. Cached
+    images are tagged in Docker with a hash of their asset id, so that
+    the cache survives restarts.
+
+    Output images are compressed using a pluggable codec, by default
+    gzip on all available cores.
+
+    Optionally, a pool of started pilot containers is kept ready, so
+    that a step doesn't have to wait for one to start. Pilots are used
+    for a single step only, and a background thread starts a new one
+    whenever one is taken from the pool. Data containers for a step
+    are started in parallel, and their addresses are obtained using a
+    single query to the Docker daemon.
     """
     def __init__(
             self, network_administrator: INetworkAdministrator,
-            site_rest_client: SiteRestClient) -> None:
+            site_rest_client: SiteRestClient,
+            image_cache_size: int = 4 * 1024**3,
+            output_codec: Optional[ImageCodec] = None,
+            pilot_pool_size: int = 0,
+            state: Optional[StateStore] = None) -> None:
         """Create a PlainDockerDA.
 
         Args:
             network_administrator: Network administrator to use.
             site_rest_client: Client to use for downloading images.
+            image_cache_size: Maximum total size in bytes of unused
+                    images to keep, 0 disables caching.
+            output_codec: Codec to compress output images with,
+                    defaults to a ParallelGzipCodec.
+            pilot_pool_size: Number of started pilot containers to
+                    keep ready, 0 disables the pool.
+            state: Store to allocate job ids from, defaults to a new
+                    MemoryStateStore. Processes sharing a Docker daemon
+                    must share this too, to avoid name collisions.
         """
         self._network_administrator = network_administrator
         self._site_rest_client = site_rest_client
         self._dcli = docker.from_env()
+        if output_codec is None:
+            output_codec = ParallelGzipCodec()
+        self._output_codec = output_codec
 
         # Note: this is a unique ID per executed step, it is unrelated
         # to Job objects, which represent an entire submitted workflow.
         # It is used to avoid name collisions among Docker containers
         # and images inside the local docker repository.
-        self._next_job_id = 1
-        self._job_id_lock = Lock()
+        if state is None:
+            state = MemoryStateStore()
+        self._state = state
 
         # Images currently loaded into Docker, indexed by asset id,
         # and a reference count.
         self._loaded_images_lock = Lock()
         self._loaded_images = dict()            # type: Dict[str, Identifier]
         self._loaded_images_ref_count = dict()  # type: Dict[str, int]
+        # Cache keys of the loaded images, None if not to be cached
+        self._loaded_image_keys = dict()    # type: Dict[str, Optional[str]]
+
+        # Images not currently in use, but kept loaded into Docker.
+        # These are indexed by cache key, and contain the image id and
+        # size, in least-recently-used-first order. Protected by the
+        # loaded images lock.
+        self._image_cache_size = image_cache_size
+        self._image_cache = OrderedDict()   # type: Dict[str, Tuple[str, int]]
+        self._image_cache_total = 0
+        if image_cache_size > 0:
+            self._find_cached_images()
+
+        # Load the pilot image once now, rather than for every job
+        try:
+            self._ensure_pilot_image()
+        except Exception as e:
+            logger.warning(
+                    f'Could not load pilot image, will retry when'
+                    f' needed: {e}')
 
         # These are indexed by connection id, which is the stringified
         # job id of the serving job.
@@ -96,6 +202,38 @@ class PlainDockerDA(IDomainAdministrator):
         self._served_assets = dict()        # type: Dict[str, Identifier]
         self._served_containers = dict()    # type: Dict[str, Container]
 
+        # Started pilot containers waiting to be used, kept filled up
+        # to the pool size by the pool thread.
+        self._pilot_pool_size = pilot_pool_size
+        self._pilot_pool_cond = Condition()     # Protects the below
+        self._pilot_pool = deque()              # type: Deque[Container]
+        self._closing = False
+
+        self._pilot_pool_thread = None  # type: Optional[Thread]
+        if pilot_pool_size > 0:
+            self._pilot_pool_thread = Thread(
+                    target=self._fill_pilot_pool,
+                    name='PilotPoolThread', daemon=True)
+            self._pilot_pool_thread.start()
+
+    def close(self) -> None:
+        """Release resources.
+
+        This stops the pilot pool thread and removes any unused pilot
+        containers.
+        """
+        with self._pilot_pool_cond:
+            self._closing = True
+            self._pilot_pool_cond.notify_all()
+
+        if self._pilot_pool_thread is not None:
+            self._pilot_pool_thread.join()
+
+        with self._pilot_pool_cond:
+            pilots = list(self._pilot_pool)
+            self._pilot_pool.clear()
+        self._remove_containers(pilots)
+
     def execute_step(
             self, step: WorkflowStep, inputs: Dict[str, Asset],
             compute_asset: ComputeAsset, output_bases: Dict[str, Asset],
@@ -144,7 +282,7 @@ class PlainDockerDA(IDomainAdministrator):
         try:
             workdir = Path(wd)
 
-            pilot_container = self._create_pilot_container(job_id)
+            pilot_container = self._take_pilot_container(job_id)
 
             nets, local_inputs = self._network_administrator.connect_to_inputs(
                     job_id, inputs, pilot_container.attrs['State']['Pid'])
@@ -158,11 +296,13 @@ class PlainDockerDA(IDomainAdministrator):
 
             images = self._ensure_images_available(workdir, local_assets)
 
-            input_containers = self._start_input_containers(
-                    job_id, images, local_inputs.keys())
-
-            output_containers = self._start_output_containers(
-                    job_id, images, output_bases.keys())
+            containers = self._start_data_containers(
+                    job_id, images,
+                    list(local_inputs) + list(output_bases))
+            input_containers = {
+                    name: containers[name] for name in local_inputs}
+            output_containers = {
+                    name: containers[name] for name in output_bases}
 
             config = self._create_config_string(
                     workdir, local_inputs, nets, step.outputs.keys(),
@@ -173,8 +313,9 @@ class PlainDockerDA(IDomainAdministrator):
 
             output_files = dict()  # type: Dict[str, Path]
             for name in step.outputs:
-                output_files[name] = self._save_output(
-                        workdir, job_id, name, output_containers[name])
+                with _container_seconds.time(operation='save_output'):
+                    output_files[name] = self._save_output(
+                            workdir, job_id, name, output_containers[name])
 
             return StepResult(output_files, wd)
 
@@ -200,8 +341,8 @@ class PlainDockerDA(IDomainAdministrator):
                     self._free_image(asset.id)
 
     def serve_asset(
-            self, asset: Asset, connection_request: ConnectionRequest
-            ) -> ConnectionInfo:
+            self, asset: Asset, connection_request: ConnectionRequest,
+            image_digest: Optional[bytes] = None) -> ConnectionInfo:
         """Serve an asset as a VPN-reachable service.
 
         The asset's image_location must be a path on the local disk,
@@ -211,6 +352,8 @@ class PlainDockerDA(IDomainAdministrator):
             asset: A local asset to serve.
             connection_request: A description of the remote end of the
                 VPN connection to set up.
+            image_digest: SHA-256 digest of the asset's image file. If
+                not given, the image is not cached.
         """
         if asset.image_location is None:
             raise RuntimeError(
@@ -227,7 +370,8 @@ class PlainDockerDA(IDomainAdministrator):
         image = None
         container = None
         try:
-            image = self._ensure_image_available(asset)
+            image = self._ensure_image_available(
+                    asset, image_digest=image_digest)
 
             container_name = f'mahiru-{job_id}-data-asset-remote'
             container = self._dcli.containers.run(
@@ -239,6 +383,7 @@ class PlainDockerDA(IDomainAdministrator):
             with self._served_lock:
                 self._served_assets[conn_id] = asset.id
                 self._served_containers[conn_id] = container
+                _served_assets_gauge.set(len(self._served_containers))
 
             return self._network_administrator.serve_asset(
                     conn_id, pid, connection_request)
@@ -253,6 +398,7 @@ class PlainDockerDA(IDomainAdministrator):
                 del self._served_assets[conn_id]
             if conn_id in self._served_containers:
                 del self._served_containers[conn_id]
+            _served_assets_gauge.set(len(self._served_containers))
             raise
 
     def stop_serving_asset(self, conn_id: str) -> None:
@@ -273,13 +419,67 @@ class PlainDockerDA(IDomainAdministrator):
             del self._served_containers[conn_id]
             self._free_image(self._served_assets[conn_id])
             del self._served_assets[conn_id]
+            _served_assets_gauge.set(len(self._served_containers))
 
     def _get_job_id(self) -> int:
         """Return a new unique job id."""
-        with self._job_id_lock:
-            job_id = self._next_job_id
-            self._next_job_id += 1
-        return job_id
+        return self._state.next_serial('domain_administrator_jobs')
+
+    def _take_pilot_container(self, job_id: int) -> Container:
+        """Gets a running pilot container for this job.
+
+        This takes one from the pool if there is one, and creates a
+        new one otherwise.
+
+        Args:
+            job_id: Id of this job.
+
+        Return:
+            The running pilot container.
+        """
+        if self._pilot_pool_size > 0:
+            with self._pilot_pool_cond:
+                if self._pilot_pool:
+                    pilot = self._pilot_pool.popleft()
+                    self._pilot_pool_cond.notify_all()
+                    _pilot_pool_requests.inc(result='hit')
+                    logger.debug(
+                            f'Using pilot {pilot.name} for job {job_id}')
+                    return pilot
+            _pilot_pool_requests.inc(result='miss')
+
+        return self._create_pilot_container(job_id)
+
+    def _fill_pilot_pool(self) -> None:
+        """Keeps the pilot pool filled, until we're closed.
+
+        This runs on the pilot pool thread. Pool pilots get a job id
+        of their own, which keeps their names unique.
+        """
+        while True:
+            with self._pilot_pool_cond:
+                while (
+                        not self._closing and
+                        len(self._pilot_pool) >= self._pilot_pool_size):
+                    self._pilot_pool_cond.wait()
+                if self._closing:
+                    return
+
+            try:
+                pilot = self._create_pilot_container(self._get_job_id())
+            except Exception as e:
+                logger.warning(f'Could not start pool pilot container: {e}')
+                with self._pilot_pool_cond:
+                    self._pilot_pool_cond.wait(_PILOT_POOL_RETRY_INTERVAL)
+                continue
+
+            with self._pilot_pool_cond:
+                if not self._closing:
+                    self._pilot_pool.append(pilot)
+                    continue
+
+            self._remove_containers([pilot])
+            return
 
     def _create_pilot_container(self, job_id: int) -> Container:
         """Creates the pilot container for this job.
@@ -295,20 +495,46 @@ class PlainDockerDA(IDomainAdministrator):
         Return:
             The running pilot container.
         """
-        image_file = Path(__file__).parents[1] / 'data' / 'pilot.tar.gz'
-        with image_file.open('rb') as f:
-            self._dcli.images.load(f.read())[0]
-
-        docker_name = f'mahiru-{job_id}-pilot',
-        container = self._dcli.containers.run(
-                'mahiru-pilot:latest', name=docker_name,
-                detach=True, network_mode='bridge')
-        # reload so we can get the PID correctly
-        container.reload()
+        self._ensure_pilot_image()
+
+        docker_name = f'mahiru-{job_id}-pilot'
+        with _container_seconds.time(operation='start_pilot'):
+            container = self._dcli.containers.run(
+                    _PILOT_IMAGE, name=docker_name,
+                    detach=True, network_mode='bridge')
+            # reload so we can get the PID correctly
+            container.reload()
         return container
 
+    def _ensure_pilot_image(self) -> None:
+        """Ensure that the pilot image is loaded into Docker.
+
+        This only loads it if it's not there already, so after the
+        first time this just checks.
+        """
+        try:
+            self._dcli.images.get(_PILOT_IMAGE)
+        except docker.errors.ImageNotFound:
+            self._load_image_file(_PILOT_IMAGE_FILE)
+
+    def _load_image_file(self, image_file: Path) -> Image:
+        """Load an image file into Docker.
+
+        The file is streamed to the Docker daemon rather than read
+        into memory first, so this works for large images too.
+
+        Args:
+            image_file: Path to a (compressed) image tarball.
+
+        Return:
+            The (first) loaded image.
+        """
+        with _image_load_seconds.time(), image_file.open('rb') as f:
+            return self._dcli.images.load(f)[0]
+
     def _ensure_image_available(
-            self, asset: Asset, workdir: Optional[Path] = None) -> Image:
+            self, asset: Asset, workdir: Optional[Path] = None,
+            image_digest: Optional[bytes] = None) -> Image:
         """Ensures the asset's image is available in Docker.
 
         This will download it from another site if necessary, then
@@ -321,6 +547,10 @@ class PlainDockerDA(IDomainAdministrator):
             workdir: Directory to download files into. May be omitted
                     or None if the asset is local and its
                     .image_location points to a file rather than a URL.
+            image_digest: SHA-256 digest of the image file of a local
+                    asset, as kept by the asset store. Local images
+                    without one are not cached. Remote stores are
+                    asked for the digest instead.
 
         Return:
             The loaded Docker Image.
@@ -330,11 +560,24 @@ class PlainDockerDA(IDomainAdministrator):
                 self._loaded_images_ref_count[asset.id] += 1
                 image_id = self._loaded_images[asset.id]
                 image = self._dcli.images.get(image_id)
+                return image
+
+            if asset.image_location is None:
+                raise RuntimeError(f'Asset {asset} does not have an image.')
+
+            key = None
+            cached_image = None
+            if self._image_cache_size > 0:
+                key = self._image_cache_key(
+                        asset.id, asset.image_location, image_digest)
+                if key is not None:
+                    cached_image = self._take_cached_image(key)
+
+            if cached_image is not None:
+                _image_cache_requests.inc(result='hit')
+                image = cached_image
             else:
-                if asset.image_location is None:
-                    raise RuntimeError(
-                            f'Asset {asset} does not have an image.')
-
+                _image_cache_requests.inc(result='miss')
                 if (
                         asset.image_location.startswith('http:') or
                         asset.image_location.startswith('https:')):
@@ -348,23 +591,27 @@ class PlainDockerDA(IDomainAdministrator):
                 else:
                     image_file = Path(asset.image_location)
 
-                with image_file.open('rb') as f:
-                    image = self._dcli.images.load(f.read())[0]
+                image = self._load_image_file(image_file)
 
-                self._loaded_images[asset.id] = image.id
-                self._loaded_images_ref_count[asset.id] = 1
+                if key is not None:
+                    image.tag(_IMAGE_CACHE_REPOSITORY, key)
                 # TODO: could delete the file here to save disk space,
                 # but only if it's a remote image and the file is in
                 # the workdir! If it's local, we'll delete it from
                 # the asset store!
 
+            self._loaded_images[asset.id] = image.id
+            self._loaded_images_ref_count[asset.id] = 1
+            self._loaded_image_keys[asset.id] = key
+            _loaded_images_gauge.set(len(self._loaded_images))
             return image
 
     def _free_image(self, asset_id: str) -> None:
         """Decrements the use count on the asset image.
 
-        If this was the last user, the image is removed from Docker,
-        and will be re-downloaded next time it is needed.
+        If this was the last user, the image is moved to the cache,
+        or removed from Docker if caching is disabled, in which case it
+        will be re-downloaded next time it is needed.
 
         Args:
             asset_id: The id of the asset that's no longer needed by
@@ -377,6 +624,13 @@ class PlainDockerDA(IDomainAdministrator):
             self._loaded_images_ref_count[asset_id] -= 1
             if self._loaded_images_ref_count[asset_id] == 0:
                 image_id = self._loaded_images[asset_id]
+                key = self._loaded_image_keys.pop(asset_id)
+                if key is not None:
+                    del self._loaded_images[asset_id]
+                    _loaded_images_gauge.set(len(self._loaded_images))
+                    self._cache_image(key, image_id)
+                    return
+
                 try:
                     self._dcli.images.remove(image_id)
                 except docker.errors.ImageNotFound:
@@ -388,6 +642,134 @@ class PlainDockerDA(IDomainAdministrator):
                     self._dcli.images.remove(image_id, force=True)
                 finally:
                     del self._loaded_images[asset_id]
+                    _loaded_images_gauge.set(len(self._loaded_images))
+
+    def _image_cache_key(
+            self, asset_id: str, image_location: str,
+            image_digest: Optional[bytes]) -> Optional[str]:
+        """Return the cache key for an asset's image.
+
+        The key is used as a Docker tag. It is derived from the asset
+        id and the digest of the image file, so that an image which
+        is replaced under the same asset id isn't taken from the
+        cache. Remote stores send the digest on request, for local
+        images the caller passes the one the asset store keeps, so
+        that we don't have to read the file.
+
+        Args:
+            asset_id: Id of the asset.
+            image_location: Location of the asset's image.
+            image_digest: Digest of a local image, if known.
+
+        Return:
+            The key, or None if the image's digest is not available,
+            in which case it should not be cached.
+        """
+        digest = image_digest
+        if (
+                image_location.startswith('http:') or
+                image_location.startswith('https:')):
+            digest = self._site_rest_client.retrieve_asset_image_digest(
+                    image_location)
+
+        if digest is None:
+            return None
+        return sha256(asset_id.encode('utf-8') + digest).hexdigest()[:40]
+
+    def _find_cached_images(self) -> None:
+        """Find cached images left in Docker by a previous run."""
+        try:
+            images = self._dcli.images.list(name=_IMAGE_CACHE_REPOSITORY)
+        except Exception as e:
+            logger.warning(f'Could not list cached images: {e}')
+            return
+
+        def tag_time(image: Image) -> str:
+            return str(image.attrs.get('Metadata', {}).get('LastTagTime', ''))
+
+        for image in sorted(images, key=tag_time):
+            for tag in image.tags:
+                repository, _, key = tag.rpartition(':')
+                if repository == _IMAGE_CACHE_REPOSITORY:
+                    size = int(image.attrs.get('Size', 0))
+                    self._image_cache[key] = (image.id, size)
+                    self._image_cache_total += size
+
+        logger.info(f'Found {len(self._image_cache)} cached images')
+        self._evict_images()
+
+    def _take_cached_image(self, key: str) -> Optional[Image]:
+        """Take an image out of the cache, if it's there.
+
+        Must be called with the loaded images lock held.
+
+        Args:
+            key: Cache key of the image, see _image_cache_key().
+
+        Return:
+            The image, or None if it wasn't in the cache.
+        """
+        if key not in self._image_cache:
+            return None
+
+        image_id, size = self._image_cache.pop(key)
+        self._image_cache_total -= size
+        _image_cache_bytes.set(self._image_cache_total)
+        try:
+            return self._dcli.images.get(image_id)
+        except docker.errors.ImageNotFound:
+            # removed behind our back
+            return None
+
+    def _cache_image(self, key: str, image_id: str) -> None:
+        """Put a no longer used image into the cache.
+
+        This evicts other images if the cache becomes too large. Must
+        be called with the loaded images lock held.
+
+        Args:
+            key: Cache key of the image, see _image_cache_key().
+            image_id: Docker id of the image.
+        """
+        try:
+            image = self._dcli.images.get(image_id)
+        except docker.errors.ImageNotFound:
+            # Base output images may already have been deleted
+            return
+
+        size = int(image.attrs.get('Size', 0))
+        self._image_cache[key] = (image_id, size)
+        self._image_cache_total += size
+        self._evict_images()
+
+    def _evict_images(self) -> None:
+        """Remove least recently used images until the cache fits.
+
+        Must be called with the loaded images lock held.
+        """
+        while self._image_cache_total > self._image_cache_size:
+            key = next(iter(self._image_cache))
+            image_id, size = self._image_cache.pop(key)
+            self._image_cache_total -= size
+            _image_cache_evictions.inc()
+            logger.info(f'Evicting image {image_id} from the cache')
+            try:
+                self._dcli.images.remove(f'{_IMAGE_CACHE_REPOSITORY}:{key}')
+                # Other assets may share the image, and then we can't
+                # remove it yet.
+                in_use = (
+                        image_id in self._loaded_images.values() or
+                        any(
+                            cached_id == image_id
+                            for cached_id, _ in self._image_cache.values()))
+                if not in_use:
+                    self._dcli.images.remove(image_id, force=True)
+            except docker.errors.ImageNotFound:
+                pass
+            except Exception as e:
+                logger.warning(f'Failed to remove image {image_id}: {e}')
+
+        _image_cache_bytes.set(self._image_cache_total)
 
     def _ensure_images_available(
             self, workdir: Path, assets: Dict[str, Asset],
@@ -417,63 +799,51 @@ class PlainDockerDA(IDomainAdministrator):
 
         return images
 
-    def _start_input_containers(
+    def _start_data_containers(
             self, job_id: int, images: Dict[str, Image],
-            inputs: Iterable[str]) -> Dict[str, Container]:
-        """Start input data containers.
+            names: Iterable[str]) -> Dict[str, Container]:
+        """Start data containers.
 
-        Creates and starts containers for the inputs of the step.
+        Creates and starts containers for the local inputs and the
+        outputs of the step. These are started in parallel, as most
+        of the time is spent waiting for the Docker daemon.
 
         Args:
             job_id: Id of the step execution job these are for.
             images: Images to use, indexed by input/output name.
-            inputs: The step's inputs' names and Assets.
+            names: Names of the inputs and outputs to start
+                    containers for.
 
         Returns:
             Docker Container objects indexed by input/output name.
         """
-        try:
-            containers = dict()
-            for name in inputs:
-                docker_name = f'mahiru-{job_id}-data-asset-{name}'
-                containers[name] = self._dcli.containers.run(
+        def start(name: str) -> Container:
+            docker_name = f'mahiru-{job_id}-data-asset-{name}'
+            with _container_seconds.time(operation='start_data'):
+                return self._dcli.containers.run(
                         images[name].id, name=docker_name,
                         detach=True, network_mode='bridge')
-            return containers
 
-        except Exception:
-            for container in containers.values():
-                container.remove(force=True)
-            raise
-
-    def _start_output_containers(
-            self, job_id: int, images: Dict[str, Image],
-            outputs: Iterable[str]) -> Dict[str, Container]:
-        """Start output data containers.
-
-        Creates and starts containers for the outputs of the step.
+        names = list(names)
+        if not names:
+            return dict()
 
-        Args:
-            job_id: Id of the step execution job these are for.
-            images: Images to use, indexed by input/output name.
-            outputs: The step's outputs' names and base Assets.
-
-        Returns:
-            Docker Container objects indexed by output name.
-        """
-        try:
-            containers = dict()
-            for name in outputs:
-                docker_name = f'mahiru-{job_id}-data-asset-{name}'
-                containers[name] = self._dcli.containers.run(
-                        images[name].id, name=docker_name,
-                        detach=True, network_mode='bridge')
-            return containers
+        containers = dict()     # type: Dict[str, Container]
+        error = None            # type: Optional[Exception]
+        with ThreadPoolExecutor(len(names)) as pool:
+            futures = {name: pool.submit(start, name) for name in names}
+            for name, future in futures.items():
+                try:
+                    containers[name] = future.result()
+                except Exception as e:
+                    error = e
 
-        except Exception:
+        if error is not None:
             for container in containers.values():
                 container.remove(force=True)
-            raise
+            raise error
+
+        return containers
 
     def _create_config_string(
             self, workdir: Path, local_inputs: Dict[str, Asset],
@@ -487,7 +857,8 @@ class PlainDockerDA(IDomainAdministrator):
         inputs and outputs. It assumes that all connections go through
         HTTP on port 80, and gets the IP addresses from Docker. For that
         to work, the data containers must be running, as IPs are
-        assigned on start-up.
+        assigned on start-up. All containers are inspected using a
+        single request.
 
         Args:
             workdir: Working directory for this step execution job.
@@ -506,21 +877,51 @@ class PlainDockerDA(IDomainAdministrator):
         for name, addr in nets.items():
             config['inputs'][name] = f'http://{addr}'
 
-        for name in list(local_inputs) + list(outputs):
+        output_names = list(outputs)
+        names = list(local_inputs) + output_names
+        states = self._inspect_containers(
+                [containers[name] for name in names])
+
+        for name in names:
+            direction = 'outputs' if name in output_names else 'inputs'
             # IP addresses were added after creation, so we need to
-            # reload data from the Docker daemon to get them.
-            containers[name].reload()
-            if containers[name].status != 'running':
+            # get the current data from the Docker daemon.
+            state = states.get(containers[name].id)
+            if state is None or state['State'] != 'running':
                 raise RuntimeError(
                         f'Container for {name} failed to come up,'
-                        f' attrs: {containers[name].attrs}'
+                        f' state: {state}'
                         f' logs: {containers[name].logs()}')
-            addr = containers[name].attrs['NetworkSettings']['IPAddress']
-            config['inputs'][name] = f'http://{addr}'
+            networks = state['NetworkSettings']['Networks']
+            addr = networks['bridge']['IPAddress']
+            config[direction][name] = f'http://{addr}'
 
         logger.info(f'Running with config {config}')
         return json.dumps(config)
 
+    def _inspect_containers(
+            self, containers: List[Container]) -> Dict[str, Any]:
+        """Get the current state of containers from Docker.
+
+        This uses a single container listing request, rather than one
+        inspect request per container.
+
+        Args:
+            containers: The containers to query.
+
+        Returns:
+            Container summaries as returned by the Docker API, indexed
+            by container id. Containers that no longer exist are
+            missing.
+        """
+        if not containers:
+            return dict()
+
+        ids = [container.id for container in containers]
+        summaries = self._dcli.api.containers(
+                all=True, filters={'id': ids})
+        return {summary['Id']: summary for summary in summaries}
+
     def _run_compute_container(
             self, job_id: int, pilot_container_id: str, compute_image: Image,
             config: str) -> Container:
@@ -542,10 +943,11 @@ class PlainDockerDA(IDomainAdministrator):
         try:
             env = {'MAHIRU_STEP_CONFIG': config}
             docker_name = f'mahiru-{job_id}-compute-asset'
-            self._dcli.containers.run(
-                    compute_image.id, name=docker_name,
-                    network_mode=f'container:{pilot_container_id}',
-                    environment=env)
+            with _container_seconds.time(operation='run_compute'):
+                self._dcli.containers.run(
+                        compute_image.id, name=docker_name,
+                        network_mode=f'container:{pilot_container_id}',
+                        environment=env)
             compute_container = self._dcli.containers.get(docker_name)
             return compute_container
         except Exception:
@@ -579,10 +981,10 @@ class PlainDockerDA(IDomainAdministrator):
             image_name = f'mahiru-{job_id}-data-asset-{output_name}'
             container.commit(image_name)
             image = self._dcli.images.get(image_name)
-            out_path = workdir / f'mahiru-data-asset-{output_name}.tar.gz'
-            with gzip.open(str(out_path), 'wb', 1) as f:
-                for chunk in image.save():
-                    f.write(chunk)
+            out_path = workdir / (
+                    f'mahiru-data-asset-{output_name}'
+                    f'{self._output_codec.extension}')
+            self._output_codec.compress(image.save(), out_path)
             container.remove()
             self._dcli.images.remove(image.id)
             return out_path
@@ -0,0 +1,137 @@
+"""Compression of image files.
+
+Output images are saved to a file by the domain administrator, and are
+then stored and sent to other sites as-is, so they need to be in a
+format that ``docker load`` understands on the receiving side. The
+codecs here all produce gzip streams, but differ in how they get
+there.
+
+ParallelGzipCodec splits the image into blocks and compresses each
+block as a separate gzip member on a thread pool. A sequence of gzip
+members is itself a valid gzip stream, so the result can be read by
+anything that reads gzip, including Docker and Python's gzip module,
+while compression uses all available cores.
+"""
+from collections import deque
+from concurrent.futures import Future, ThreadPoolExecutor
+import gzip
+import os
+from pathlib import Path
+from typing import Deque, Iterable, Optional
+
+
+class ImageCodec:
+    """Writes image data to a compressed file.
+
+    Attributes:
+        format: Name of the file format produced, e.g. gzip.
+        extension: File name extension to use for image files.
+    """
+    format = ''
+    extension = ''
+
+    def compress(self, chunks: Iterable[bytes], out_path: Path) -> None:
+        """Compress a stream of data and write it to a file.
+
+        Args:
+            chunks: The data to compress.
+            out_path: The file to write to.
+        """
+        raise NotImplementedError()
+
+
+class GzipCodec(ImageCodec):
+    """Compresses using gzip on the current thread."""
+    format = 'gzip'
+    extension = '.tar.gz'
+
+    def __init__(self, level: int = 1) -> None:
+        """Create a GzipCodec.
+
+        Args:
+            level: Compression level, 1 (fastest) to 9 (smallest).
+        """
+        self._level = level
+
+    def compress(self, chunks: Iterable[bytes], out_path: Path) -> None:
+        """Compress a stream of data and write it to a file.
+
+        Args:
+            chunks: The data to compress.
+            out_path: The file to write to.
+        """
+        with gzip.open(str(out_path), 'wb', self._level) as f:
+            for chunk in chunks:
+                f.write(chunk)
+
+
+class ParallelGzipCodec(ImageCodec):
+    """Compresses using gzip on multiple threads.
+
+    The data is cut into blocks, which are compressed into separate
+    gzip members in parallel and written out in order. zlib releases
+    the GIL while compressing, so this scales with the number of
+    threads. At most two blocks per thread are kept in memory.
+    """
+    format = 'gzip'
+    extension = '.tar.gz'
+
+    def __init__(
+            self, level: int = 1, threads: Optional[int] = None,
+            block_size: int = 4 * 1024 * 1024) -> None:
+        """Create a ParallelGzipCodec.
+
+        Args:
+            level: Compression level, 1 (fastest) to 9 (smallest).
+            threads: Number of threads to use, defaults to the number
+                    of CPUs.
+            block_size: Size of the uncompressed blocks in bytes.
+        """
+        if threads is None:
+            threads = os.cpu_count() or 1
+        self._level = level
+        self._threads = threads
+        self._block_size = block_size
+
+    def compress(self, chunks: Iterable[bytes], out_path: Path) -> None:
+        """Compress a stream of data and write it to a file.
+
+        Args:
+            chunks: The data to compress.
+            out_path: The file to write to.
+        """
+        max_pending = 2 * self._threads
+        pending = deque()       # type: Deque[Future[bytes]]
+        with ThreadPoolExecutor(self._threads) as pool, \
+                out_path.open('wb') as f:
+            for block in self._blocks(chunks):
+                if len(pending) >= max_pending:
+                    f.write(pending.popleft().result())
+                pending.append(pool.submit(
+                        gzip.compress, block, self._level))
+
+            while pending:
+                f.write(pending.popleft().result())
+
+            if f.tell() == 0:
+                # an empty input still needs a valid gzip stream
+                f.write(gzip.compress(b'', self._level))
+
+    def _blocks(self, chunks: Iterable[bytes]) -> Iterable[bytes]:
+        """Regroup chunks of arbitrary size into blocks.
+
+        Args:
+            chunks: The data to regroup.
+
+        Yields:
+            Blocks of block_size bytes, except for the last one, which
+            may be smaller.
+        """
+        buf = bytearray()
+        for chunk in chunks:
+            buf += chunk
+            while len(buf) >= self._block_size:
+                yield bytes(buf[:self._block_size])
+                del buf[:self._block_size]
+        if buf:
+            yield bytes(buf)
@@ -0,0 +1,611 @@
+"""Access to the net-admin-helper program.
+
+net-admin-helper is a small, privileged C program which performs
+network administration operations on behalf of the (unprivileged)
+Mahiru site. It is distributed as a Docker image, which is built from
+the configuration in net-admin-helper/config.h by install.sh.
+
+There are two ways of running it. The simple one is to start a
+container for every command, wait for it to finish, and read its
+output. This works, but starting a container takes a lot of time. The
+other is to start a single container running net-admin-helper in
+daemon mode, and send commands to it over a Unix domain socket. This
+needs a revision of net-admin-helper which has daemon mode, the one
+built by install.sh only supports the simple way.
+
+Revisions of net-admin-helper which support it can emit a timing
+record for each command, which looks like
+
+    timing cwg_create ns_enter=8120 dev_create=251900 total=300210
+
+and lists the time spent in each phase in nanoseconds. In container
+mode these are written to stderr, in daemon mode they're sent before
+the status line. The functions here collect them, see run_timed().
+
+Not every revision of net-admin-helper has all the commands that Mahiru
+can use. Those that have more than the basic cwg_create, cwg_connect
+and cwg_destroy list their subcommands in response to a capabilities
+command, and supports() uses that to find out what's available.
+"""
+from pathlib import Path
+import logging
+from shutil import rmtree
+import socket
+from tempfile import mkdtemp
+from threading import Lock
+import time
+from typing import (
+        BinaryIO, cast, Dict, FrozenSet, List, Optional, Tuple)
+
+import docker
+from docker.models.containers import Container
+
+
+_NAH_IMAGE = 'net-admin-helper:latest'
+
+_NAH_BINARY = '/usr/local/bin/net-admin-helper'
+
+_NAH_CAPABILITIES = ['NET_ADMIN', 'SYS_ADMIN', 'SYS_PTRACE', 'IPC_LOCK']
+
+# Subcommands which every revision of net-admin-helper has
+BASE_COMMANDS = frozenset(['cwg_create', 'cwg_connect', 'cwg_destroy'])
+
+# Where the net-admin-helper daemon creates its socket
+_DAEMON_SOCKET_DIR = '/run/net-admin-helper'
+
+_DAEMON_SOCKET_NAME = 'net-admin-helper.sock'
+
+# Time to wait for the daemon to create its socket
+_DAEMON_STARTUP_TIMEOUT = 10.0     # seconds
+
+# Subcommands which may safely be sent again if the daemon dies while
+# running them
+_IDEMPOTENT_COMMANDS = frozenset(['capabilities', 'cwg_stats', 'ns_pin'])
+
+
+logger = logging.getLogger(__name__)
+
+
+_TIMING_PREFIX = 'timing '
+
+
+def parse_timing_record(record: str) -> Tuple[str, Dict[str, int]]:
+    """Parse a timing record from net-admin-helper.
+
+    Args:
+        record: A line of the form "timing <command> <phase>=<ns>..."
+
+    Return:
+        The name of the command and a dictionary with the duration of
+        each phase in nanoseconds.
+
+    Raises:
+        RuntimeError: If the record could not be parsed.
+    """
+    fields = record.split()
+    if len(fields) < 2 or fields[0] != _TIMING_PREFIX.strip():
+        raise RuntimeError(f'Invalid timing record {record}')
+
+    phases = dict()     # type: Dict[str, int]
+    for field in fields[2:]:
+        phase, sep, value = field.partition('=')
+        if not sep or not value.isdigit():
+            raise RuntimeError(f'Invalid timing record {record}')
+        phases[phase] = int(value)
+    return fields[1], phases
+
+
+class DeviceStats:
+    """Traffic statistics for a device, as reported by cwg_stats.
+
+    Attributes:
+        net: The net the device is for.
+        host: The host id of the device on that net.
+        rx_bytes: Number of bytes received.
+        tx_bytes: Number of bytes sent.
+        last_handshake: Time of the latest handshake in seconds
+                since the epoch, or None if there hasn't been one or
+                the device is not a WireGuard device.
+        endpoint: Address and port of the remote peer, if known.
+    """
+    def __init__(
+            self, net: int, host: int, rx_bytes: int, tx_bytes: int,
+            last_handshake: Optional[int], endpoint: Optional[str]
+            ) -> None:
+        """Create a DeviceStats object.
+
+        Args:
+            net: The net the device is for.
+            host: The host id of the device on that net.
+            rx_bytes: Number of bytes received.
+            tx_bytes: Number of bytes sent.
+            last_handshake: Time of the latest handshake, if any.
+            endpoint: Address and port of the remote peer, if known.
+        """
+        self.net = net
+        self.host = host
+        self.rx_bytes = rx_bytes
+        self.tx_bytes = tx_bytes
+        self.last_handshake = last_handshake
+        self.endpoint = endpoint
+
+
+def parse_device_stats(output: str) -> List[DeviceStats]:
+    """Parse the output of cwg_stats.
+
+    This has a line per device of the form
+
+        <net>:<host> <rx_bytes> <tx_bytes> <last_handshake> <endpoint>
+
+    where the last two are - if not available.
+
+    Args:
+        output: The output produced by cwg_stats.
+
+    Raises:
+        RuntimeError: If the output could not be parsed.
+    """
+    result = list()     # type: List[DeviceStats]
+    for line in output.splitlines():
+        try:
+            device, rx_bytes, tx_bytes, handshake, endpoint = line.split()
+            net, host = device.split(':')
+            result.append(DeviceStats(
+                    int(net), int(host), int(rx_bytes), int(tx_bytes),
+                    None if handshake in ('-', '0') else int(handshake),
+                    None if endpoint == '-' else endpoint))
+        except ValueError:
+            raise RuntimeError(f'Invalid stats line {line}')
+    return result
+
+
+class NetAdminHelper:
+    """Runs net-admin-helper commands."""
+    def __init__(self) -> None:
+        """Create a NetAdminHelper."""
+        self._commands_lock = Lock()            # protects the below
+        self._commands = None       # type: Optional[FrozenSet[str]]
+
+    def supports(self, subcommand: str) -> bool:
+        """Return whether the helper has a given subcommand.
+
+        The first call asks the helper which subcommands it has, later
+        calls use the result of that.
+
+        Args:
+            subcommand: Name of the subcommand, e.g. cwg_create_batch.
+
+        Raises:
+            Exception: If the helper could not be run at all.
+        """
+        with self._commands_lock:
+            if self._commands is None:
+                try:
+                    output = self.run('capabilities')
+                    self._commands = BASE_COMMANDS.union(output.split())
+                except RuntimeError as e:
+                    logger.info(
+                            f'net-admin-helper does not list its'
+                            f' capabilities, using basic commands only: {e}')
+                    self._commands = BASE_COMMANDS
+                logger.info(
+                        f'net-admin-helper supports'
+                        f' {" ".join(sorted(self._commands))}')
+            return subcommand in self._commands
+
+    def run(self, command: str) -> str:
+        """Run a net-admin-helper command and return its output.
+
+        Args:
+            command: The subcommand to run, including arguments.
+
+        Return:
+            The output of the command, with leading and trailing
+            whitespace removed.
+
+        Raises:
+            RuntimeError: If the command failed.
+        """
+        return self.run_timed(command)[0]
+
+    def run_timed(self, command: str) -> Tuple[str, List[str]]:
+        """Run a command and return its output and timing records.
+
+        Args:
+            command: The subcommand to run, including arguments.
+
+        Return:
+            The output of the command as for run(), and a list of
+            timing records produced by the command, if any, which can
+            be parsed using parse_timing_record().
+
+        Raises:
+            RuntimeError: If the command failed.
+        """
+        raise NotImplementedError()
+
+    def pin_namespace(self, pid: int) -> str:
+        """Get a handle for the network namespace of a process.
+
+        The handle can be passed to cwg commands in place of the PID,
+        and must be released using release_namespace() when done.
+
+        Args:
+            pid: PID of a process in the network namespace.
+
+        Return:
+            A namespace handle. Here, it's just the PID.
+        """
+        return str(pid)
+
+    def release_namespace(self, handle: str) -> None:
+        """Release a handle obtained from pin_namespace().
+
+        Args:
+            handle: The handle to release.
+        """
+        pass
+
+    def close(self) -> None:
+        """Release any resources held."""
+        pass
+
+
+def ensure_net_admin_helper_image(dcli: docker.DockerClient) -> None:
+    """Ensures that the NAH Docker image is loaded into Docker.
+
+    If it's not loaded yet, the image file is streamed to Docker from
+    the mahiru/data directory.
+
+    Args:
+        dcli: The Docker client to use.
+    """
+    try:
+        dcli.images.get(_NAH_IMAGE)
+    except docker.errors.ImageNotFound:
+        image_file = (
+                Path(__file__).parents[1] / 'data' /
+                'net-admin-helper.tar.gz')
+        with image_file.open('rb') as f:
+            dcli.images.load(f)
+
+
+class ContainerNetAdminHelper(NetAdminHelper):
+    """Runs each net-admin-helper command in a new container."""
+    def __init__(self, dcli: docker.DockerClient) -> None:
+        """Create a ContainerNetAdminHelper.
+
+        Args:
+            dcli: The Docker client to use to start containers.
+        """
+        super().__init__()
+        self._dcli = dcli
+
+    def run_timed(self, command: str) -> Tuple[str, List[str]]:
+        """Run net-admin-helper and return its output and timings.
+
+        Args:
+            command: The subcommand to run, including arguments.
+        """
+        logger.debug(f'Running net-admin-helper {command}')
+        ensure_net_admin_helper_image(self._dcli)
+        container = self._dcli.containers.run(
+                _NAH_IMAGE, f'{_NAH_BINARY} {command}',
+                cap_add=_NAH_CAPABILITIES,
+                network_mode='host', pid_mode='host', detach=True)
+
+        result = container.wait()
+
+        if result['StatusCode'] != 0:
+            error = container.logs().decode('utf-8')
+            container.remove(force=True)
+            raise RuntimeError(f'net-admin-helper: {error}')
+
+        logs = cast(bytes, container.logs(stdout=True, stderr=False))
+        errs = cast(bytes, container.logs(stdout=False, stderr=True))
+        container.remove(force=True)
+
+        timings = [
+                line for line in errs.decode('utf-8').splitlines()
+                if line.startswith(_TIMING_PREFIX)]
+        return logs.decode('ascii').strip(), timings
+
+
+class DaemonNetAdminHelper(NetAdminHelper):
+    """Sends commands to a long-running net-admin-helper daemon.
+
+    The daemon runs in a container of its own, which is started on
+    first use and keeps running until close() is called. We talk to it
+    via a Unix domain socket in a directory which is bind-mounted into
+    the container, keeping a single connection open.
+
+    The protocol is line-based. We send the subcommand and its
+    arguments on a single line, exactly as they would be given on the
+    command line. The daemon replies with either "ok <n>" followed by
+    n lines of output, or with "error <message>".
+
+    The daemon can keep a network namespace open across commands,
+    which saves resolving /proc/<pid>/ns/net every time. ns_pin <pid>
+    opens it and returns a handle of the form <pid>.<starttime>, which
+    cwg commands accept in place of a PID. Since the handle contains
+    the process start time, a reused PID will not match it. If the
+    daemon is restarted, it reopens the namespace on first use of the
+    handle after checking the start time, so handles remain valid. If
+    the daemon doesn't have ns_pin, plain PIDs are used as handles.
+    """
+    def __init__(
+            self, dcli: docker.DockerClient,
+            socket_dir: Optional[Path] = None) -> None:
+        """Create a DaemonNetAdminHelper.
+
+        Args:
+            dcli: The Docker client to use to start the daemon.
+            socket_dir: Directory on the Docker host to put the socket
+                    in. If None, a temporary directory is used, which
+                    only works if we're running on the Docker host
+                    ourselves.
+        """
+        super().__init__()
+        self._dcli = dcli
+        self._socket_dir = socket_dir
+        self._owns_socket_dir = False
+
+        self._lock = Lock()                     # protects the below
+        self._container = None                  # type: Optional[Container]
+        self._socket = None                     # type: Optional[socket.socket]
+        self._stream = None                     # type: Optional[BinaryIO]
+
+    def start(self) -> None:
+        """Start the daemon and connect to it.
+
+        This is done automatically on the first call to run(), but
+        may be called explicitly to find out early whether daemon mode
+        works.
+
+        Raises:
+            RuntimeError: If the daemon could not be started.
+        """
+        with self._lock:
+            self._ensure_connected()
+
+    def run_timed(self, command: str) -> Tuple[str, List[str]]:
+        """Run a command on the daemon, return output and timings.
+
+        If the connection turns out to be broken, then the daemon is
+        restarted. The command is then sent again if it cannot have
+        been run yet, or if running it twice is harmless. Otherwise,
+        we cannot tell what it did, and the caller needs to clean up.
+
+        Args:
+            command: The subcommand to run, including arguments.
+
+        Raises:
+            RuntimeError: If the command failed, or if the connection
+                    was lost while running it.
+        """
+        logger.debug(f'Sending to net-admin-helper daemon: {command}')
+        if '\n' in command:
+            raise RuntimeError('Invalid net-admin-helper command')
+
+        with self._lock:
+            self._ensure_connected()
+            try:
+                self._send(command)
+            except OSError as e:
+                # Daemon may have died, it didn't get the command so try
+                # once more with a new one.
+                logger.warning(f'Lost connection to net-admin-helper: {e}')
+                self._disconnect()
+                return self._retry(command)
+
+            try:
+                return self._receive()
+            except (OSError, EOFError) as e:
+                logger.warning(f'Lost connection to net-admin-helper: {e}')
+                self._disconnect()
+                if command.split()[0] not in _IDEMPOTENT_COMMANDS:
+                    raise RuntimeError(
+                            f'Lost connection to net-admin-helper while'
+                            f' running {command}: {e}')
+                return self._retry(command)
+
+    def _retry(self, command: str) -> Tuple[str, List[str]]:
+        """Reconnect and send a command once more.
+
+        Must be called with the lock held, after disconnecting.
+
+        Args:
+            command: The subcommand to run, including arguments.
+
+        Raises:
+            RuntimeError: If the command failed, or if the connection
+                    was lost again.
+        """
+        self._ensure_connected()
+        try:
+            return self._transact(command)
+        except (OSError, EOFError) as e:
+            self._disconnect()
+            raise RuntimeError(
+                    f'Lost connection to net-admin-helper again while'
+                    f' running {command}: {e}')
+
+    def pin_namespace(self, pid: int) -> str:
+        """Open and pin the network namespace of a process.
+
+        Args:
+            pid: PID of a process in the network namespace.
+
+        Return:
+            A handle to pass to cwg commands in place of the PID, or
+            the PID itself if the daemon cannot pin namespaces.
+        """
+        if not self.supports('ns_pin'):
+            return super().pin_namespace(pid)
+        return self.run(f'ns_pin {pid}')
+
+    def release_namespace(self, handle: str) -> None:
+        """Close a network namespace pinned with pin_namespace().
+
+        Args:
+            handle: The handle to release.
+        """
+        if '.' in handle:
+            self.run(f'ns_release {handle}')
+
+    def close(self) -> None:
+        """Shut down the daemon and release resources."""
+        with self._lock:
+            self._disconnect()
+            if self._owns_socket_dir and self._socket_dir is not None:
+                rmtree(self._socket_dir, ignore_errors=True)
+                self._socket_dir = None
+                self._owns_socket_dir = False
+
+    def _transact(self, command: str) -> Tuple[str, List[str]]:
+        """Send a command to the daemon and read the response.
+
+        Must be called with the lock held and while connected.
+
+        Args:
+            command: The command to send.
+
+        Return:
+            The output of the command and any timing records.
+
+        Raises:
+            OSError, EOFError: If communication failed.
+            RuntimeError: If the daemon reported an error.
+        """
+        self._send(command)
+        return self._receive()
+
+    def _send(self, command: str) -> None:
+        """Send a command to the daemon.
+
+        Must be called with the lock held and while connected.
+
+        Args:
+            command: The command to send.
+
+        Raises:
+            OSError: If communication failed.
+        """
+        assert self._stream is not None
+        self._stream.write(command.encode('ascii') + b'\n')
+        self._stream.flush()
+
+    def _receive(self) -> Tuple[str, List[str]]:
+        """Read the response to a command from the daemon.
+
+        Must be called with the lock held and while connected.
+
+        Return:
+            The output of the command and any timing records.
+
+        Raises:
+            OSError, EOFError: If communication failed.
+            RuntimeError: If the daemon reported an error.
+        """
+        timings = list()    # type: List[str]
+        status = self._read_line()
+        while status.startswith(_TIMING_PREFIX):
+            timings.append(status)
+            status = self._read_line()
+
+        if status.startswith('error'):
+            raise RuntimeError(f'net-admin-helper: {status[6:]}')
+
+        if not status.startswith('ok '):
+            raise EOFError(f'Invalid response from daemon: {status}')
+
+        lines = [self._read_line() for _ in range(int(status[3:]))]
+        return '\n'.join(lines).strip(), timings
+
+    def _read_line(self) -> str:
+        """Read a line from the daemon, without the newline."""
+        assert self._stream is not None
+        line = self._stream.readline()
+        if not line.endswith(b'\n'):
+            raise EOFError('Connection to net-admin-helper daemon closed')
+        return line.decode('ascii').rstrip('\n')
+
+    def _ensure_connected(self) -> None:
+        """Ensure the daemon is running and that we are connected.
+
+        Must be called with the lock held.
+        """
+        if self._stream is not None:
+            return
+
+        if self._socket_dir is None:
+            self._socket_dir = Path(mkdtemp(prefix='mahiru-nah-'))
+            self._owns_socket_dir = True
+
+        socket_path = self._socket_dir / _DAEMON_SOCKET_NAME
+        if self._container is None:
+            if socket_path.exists():
+                socket_path.unlink()
+
+            ensure_net_admin_helper_image(self._dcli)
+            self._container = self._dcli.containers.run(
+                    _NAH_IMAGE, f'{_NAH_BINARY} daemon',
+                    cap_add=_NAH_CAPABILITIES,
+                    network_mode='host', pid_mode='host',
+                    volumes={
+                        str(self._socket_dir): {
+                            'bind': _DAEMON_SOCKET_DIR, 'mode': 'rw'}},
+                    detach=True)
+
+        deadline = time.monotonic() + _DAEMON_STARTUP_TIMEOUT
+        while not socket_path.exists():
+            self._container.reload()
+            if self._container.status == 'exited':
+                logs = self._container.logs().decode('utf-8')
+                self._disconnect()
+                raise RuntimeError(
+                        f'net-admin-helper daemon failed to start: {logs}')
+            if time.monotonic() > deadline:
+                self._disconnect()
+                raise RuntimeError(
+                        'Timeout waiting for net-admin-helper daemon')
+            time.sleep(0.05)
+
+        self._socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            self._socket.connect(str(socket_path))
+        except OSError as e:
+            self._disconnect()
+            raise RuntimeError(
+                    f'Could not connect to net-admin-helper daemon: {e}')
+        self._stream = cast(BinaryIO, self._socket.makefile('rwb'))
+        logger.info('Connected to net-admin-helper daemon')
+
+    def _disconnect(self) -> None:
+        """Disconnect from the daemon and stop it.
+
+        Must be called with the lock held.
+        """
+        if self._stream is not None:
+            try:
+                self._stream.close()
+            except OSError:
+                pass
+            self._stream = None
+
+        if self._socket is not None:
+            self._socket.close()
+            self._socket = None
+
+        if self._container is not None:
+            try:
+                self._container.stop()
+            except Exception:
+                # ignore, it may have died already
+                pass
+            try:
+                self._container.remove(force=True)
+            except Exception as e:
+                logger.warning(
+                        f'Could not remove net-admin-helper daemon: {e}')
+            self._container = None
@@ -1,34 +1,106 @@
 """Local network management to support step execution."""
 
+from concurrent.futures import ThreadPoolExecutor
 import docker
 import logging
-from pathlib import Path
-from threading import Lock
-from typing import cast, Dict, Tuple, Optional
+from random import randrange
+from threading import Event, Lock, Thread
+import time
+from typing import Dict, Iterable, List, Optional, Set, Tuple
 
+from mahiru.components.net_admin_helper import (
+        ContainerNetAdminHelper, DaemonNetAdminHelper, NetAdminHelper,
+        ensure_net_admin_helper_image, parse_device_stats,
+        parse_timing_record)
 from mahiru.components.settings import NetworkSettings
 from mahiru.definitions.assets import Asset
 from mahiru.definitions.connections import (
-        ConnectionInfo, ConnectionRequest, WireGuardConnectionInfo,
+        ConnectionRequest, WireGuardConnectionInfo,
         WireGuardConnectionRequest, WireGuardEndpoint)
 from mahiru.definitions.interfaces import INetworkAdministrator
+from mahiru.metrics import REGISTRY
 from mahiru.rest.site_client import SiteRestClient
 
 
 _WG_CLIENT_HOST = 0
 _WG_SERVER_HOST = 1
-_NAH_IMAGE = 'net-admin-helper:latest'
+
+# Number of available nets, see _net_to_addr()
+_NUM_NETS = 1 << 23
+
+# Maximum number of connection requests to other sites in flight
+_MAX_CONCURRENT_REQUESTS = 16
+
+# Role and conn_id of a connection, for statistics
+_Conn = Tuple[str, str]
+
+# Time, rx bytes and tx bytes of a statistics sample
+_Sample = Tuple[float, int, int]
+
+# Net and local port of an endpoint
+_Endpoint = Tuple[int, int]
 
 
 logger = logging.getLogger(__name__)
 
 
+_nah_command_seconds = REGISTRY.histogram(
+        'mahiru_net_admin_helper_command_seconds',
+        'Time taken by net-admin-helper commands, including overhead',
+        ['command'])
+
+_nah_phase_seconds = REGISTRY.histogram(
+        'mahiru_net_admin_helper_phase_seconds',
+        'Time spent in each phase of net-admin-helper commands, as'
+        ' reported by the helper', ['command', 'phase'])
+
+# For these, role is 'client' or 'server', and conn_id is the id
+# assigned by the serving site. Direction is 'rx' or 'tx'.
+_connection_bytes = REGISTRY.gauge(
+        'mahiru_connection_bytes',
+        'Bytes transferred over an asset connection so far',
+        ['role', 'conn_id', 'direction'])
+
+_connection_throughput = REGISTRY.gauge(
+        'mahiru_connection_throughput_bytes_per_second',
+        'Average throughput of an asset connection since the previous'
+        ' sample', ['role', 'conn_id', 'direction'])
+
+_connection_handshake = REGISTRY.gauge(
+        'mahiru_connection_last_handshake_timestamp_seconds',
+        'Time of the latest WireGuard handshake of an asset connection',
+        ['role', 'conn_id'])
+
+_open_connections = REGISTRY.gauge(
+        'mahiru_open_connections',
+        'Number of open asset connections, by role', ['role'])
+
+_free_ports_gauge = REGISTRY.gauge(
+        'mahiru_wireguard_free_ports',
+        'Number of ports in the configured range that are available')
+
+
 class WireGuardNA(INetworkAdministrator):
     """Manages plain WireGuard connections to remote containers.
 
     This uses one overlay network per container pair to set up the
     communication. Requires the net-admin-helper Docker image to be
-    available in the local Docker daemon.
+    available in the local Docker daemon, or in the mahiru/data
+    directory.
+
+    Normally, every connection gets a WireGuard device with its own
+    UDP port in the container's namespace. If multiplexing is enabled
+    in the settings, then all connections go through a single hub
+    device listening on the first port of the range instead, with a
+    peer and a veth pair into the container for each connection. In
+    that case, nets need to be unique per site rather than per
+    container, so they're allocated at random from the whole range.
+    When serving, the hub takes the net the client asked for if it's
+    free, and assigns another one if not, which the client then
+    switches to, see _use_assigned_net().
+
+    Traffic statistics for each connection are sampled periodically
+    and published as metrics, see _sample_stats().
     """
     def __init__(
             self, settings: NetworkSettings, site_rest_client: SiteRestClient
@@ -42,21 +114,89 @@ class WireGuardNA(INetworkAdministrator):
         self._settings = settings
         self._site_rest_client = site_rest_client
 
+        self._ports_lock = Lock()           # protects the below
+        self._all_ports = set()             # type: Set[int]
         if settings.ports is not None:
-            self._available_ports = set(range(
+            self._all_ports = set(range(
                     settings.ports[0], settings.ports[1] + 1))
+        self._available_ports = set(self._all_ports)
+        if settings.multiplex and settings.ports is not None:
+            # reserved for the hub
+            self._available_ports.discard(settings.ports[0])
+        _free_ports_gauge.set(len(self._available_ports))
+
+        self._nets_lock = Lock()            # protects the below
+        self._used_nets = set()             # type: Set[int]
+
+        self._hub_lock = Lock()             # protects the below
+        self._hub = None                    # type: Optional[WireGuardEndpoint]
 
         # conn_id for each job_id, input_name pair
         self._active_connections = dict()   # type: Dict[int, Dict[str, str]]
+        # pinned network namespace handle for each job_id
+        self._job_namespaces = dict()       # type: Dict[int, str]
+        # net and local port of each endpoint, for each job_id
+        self._job_endpoints = dict()    # type: Dict[int, List[_Endpoint]]
 
         self._served_lock = Lock()          # protects the below
         self._served_ports = dict()         # type: Dict[str, int]
         self._served_nets = dict()          # type: Dict[str, int]
+        self._served_namespaces = dict()    # type: Dict[str, str]
 
         # Hardcoded for now, but must be passed in from the DA if we're
         # running containers in another VM.
         self._dcli = docker.from_env()
 
+        self._nah_lock = Lock()             # protects the below
+        self._nah = None                    # type: Optional[NetAdminHelper]
+
+        if settings.enabled:
+            # Load the image now, so it's only checked later.
+            try:
+                ensure_net_admin_helper_image(self._dcli)
+            except Exception as e:
+                logger.warning(
+                        f'Could not load net-admin-helper image, will'
+                        f' retry when needed: {e}')
+
+        self._stats_lock = Lock()           # protects the below
+        # role and conn_id by net, for each monitored namespace
+        self._monitored = dict()    # type: Dict[str, Dict[int, _Conn]]
+        # time of sample, rx and tx bytes, by role and conn_id
+        self._last_stats = dict()   # type: Dict[_Conn, _Sample]
+        self._stats_thread = None           # type: Optional[Thread]
+        self._stop_stats = Event()
+
+        # for talking to other sites concurrently
+        self._request_pool = ThreadPoolExecutor(
+                _MAX_CONCURRENT_REQUESTS,
+                thread_name_prefix='WireGuardNA-requests')
+
+    def close(self) -> None:
+        """Release resources, call when done."""
+        self._stop_stats.set()
+        with self._stats_lock:
+            stats_thread = self._stats_thread
+            self._stats_thread = None
+        if stats_thread is not None:
+            stats_thread.join()
+
+        self._request_pool.shutdown()
+
+        with self._hub_lock:
+            if self._hub is not None:
+                try:
+                    self._run_net_admin_helper(
+                            f'cwg_hub_destroy {self._hub.port}')
+                except Exception as e:
+                    logger.warning(f'Could not remove WireGuard hub: {e}')
+                self._hub = None
+
+        with self._nah_lock:
+            if self._nah is not None:
+                self._nah.close()
+                self._nah = None
+
     def serve_asset(
             self, conn_id: str, network_namespace: int,
             request: ConnectionRequest) -> WireGuardConnectionInfo:
@@ -74,18 +214,34 @@ class WireGuardNA(INetworkAdministrator):
         if not isinstance(request, WireGuardConnectionRequest):
             raise RuntimeError("Request type not supported")
 
-        local_endpoint = self._create_wg_endpoint(
-                network_namespace, request.net, _WG_SERVER_HOST)
-
-        self._connect_wg_endpoint(
-                network_namespace, request.net, _WG_SERVER_HOST,
-                request.endpoint)
+        ns = self._net_admin_helper().pin_namespace(network_namespace)
+        net = request.net
+        try:
+            if self._settings.multiplex:
+                net = self._assign_net(request.net)
+                try:
+                    local_endpoint = self._hub_endpoint()
+                    self._attach_to_hub(
+                            ns, _WG_SERVER_HOST, [(net, request.endpoint)])
+                except Exception:
+                    self._free_nets([net])
+                    raise
+            else:
+                local_endpoint = self._create_connected_wg_endpoint(
+                        ns, net, _WG_SERVER_HOST, request.endpoint)
+        except Exception:
+            self._release_namespace(ns)
+            raise
 
         with self._served_lock:
-            self._served_nets[conn_id] = request.net
+            self._served_nets[conn_id] = net
             self._served_ports[conn_id] = local_endpoint.port
+            self._served_namespaces[conn_id] = ns
+
+        self._monitor(ns, {net: ('server', conn_id)})
 
-        local_conn_info = WireGuardConnectionInfo(conn_id, local_endpoint)
+        local_conn_info = WireGuardConnectionInfo(
+                conn_id, local_endpoint, net)
         return local_conn_info
 
     def stop_serving_asset(
@@ -100,11 +256,17 @@ class WireGuardNA(INetworkAdministrator):
         if not self._settings.enabled:
             raise RuntimeError('Asset connections are disabled')
 
-        self._remove_wg_endpoint(
-                network_namespace, self._served_nets[conn_id], _WG_SERVER_HOST)
-
         with self._served_lock:
-            del self._served_ports[conn_id]
+            ns = self._served_namespaces.pop(conn_id)
+            net = self._served_nets.pop(conn_id)
+            port = self._served_ports.pop(conn_id)
+
+        self._unmonitor(ns)
+        try:
+            self._remove_all_local_endpoints(
+                    ns, _WG_SERVER_HOST, [(net, port)])
+        finally:
+            self._release_namespace(ns)
 
     def connect_to_inputs(
             self, job_id: int, inputs: Dict[str, Asset],
@@ -127,44 +289,102 @@ class WireGuardNA(INetworkAdministrator):
         """
         nets = dict()           # type: Dict[str, str]
         remaining = dict()      # type: Dict[str, Asset]
-        conn_info = None        # type: Optional[ConnectionInfo]
 
         if not self._settings.enabled:
             return nets, inputs
 
         self._active_connections[job_id] = dict()
 
-        for net, (name, asset) in enumerate(inputs.items()):
-            logger.debug(f'Trying to connect for {name} on {net}')
+        # The pilot container keeps its namespace for the whole job, so
+        # we pin it once and use the handle for all commands.
+        try:
+            ns = self._net_admin_helper().pin_namespace(network_namespace)
+        except Exception as e:
+            logger.debug(f'Failed to pin network namespace: {e}')
+            return nets, inputs
+
+        # Set up all local endpoints in a single helper call
+        try:
+            input_nets, endpoints = self._create_local_endpoints(
+                    ns, list(inputs))
+        except Exception as e:
+            logger.debug(f'Failed to create endpoints: {e}')
+            self._release_namespace(ns)
+            return nets, inputs
+
+        # Ask the remote sites to connect to them, all at the same time
+        local_endpoints = dict(zip(inputs, endpoints))
+        futures = {
+                name: self._request_pool.submit(
+                    self._request_connection, name, asset,
+                    WireGuardConnectionRequest(
+                        input_nets[name], local_endpoints[name]))
+                for name, asset in inputs.items()}
+
+        conn_infos = dict()     # type: Dict[str, WireGuardConnectionInfo]
+        for name, future in futures.items():
             try:
-                endpoint = self._create_wg_endpoint(
-                        network_namespace, net, _WG_CLIENT_HOST)
+                conn_infos[name] = future.result()
             except Exception as e:
-                logger.debug(f'Failed to create endpoint: {e}')
-                remaining[name] = asset
-                continue
+                logger.error(f'Error completing connection: {e}')
+                remaining[name] = inputs[name]
 
-            try:
-                request = WireGuardConnectionRequest(net, endpoint)
-                conn_info = self._site_rest_client.connect_to_asset(
-                        asset.id, request)
-                if not isinstance(conn_info, WireGuardConnectionInfo):
-                    raise RuntimeError('Peer incompatible')
-                logger.debug(f'Connection request successful')
-                self._connect_wg_endpoint(
-                        network_namespace, net, _WG_CLIENT_HOST,
-                        conn_info.endpoint)
+        for name, conn_info in list(conn_infos.items()):
+            if conn_info.net not in (None, input_nets[name]):
+                try:
+                    conn_infos[name] = self._use_assigned_net(
+                            ns, name, inputs[name], input_nets,
+                            local_endpoints, conn_info)
+                except Exception as e:
+                    logger.error(f'Could not use assigned net: {e}')
+                    del conn_infos[name]
+                    remaining[name] = inputs[name]
+
+        # Connect the local endpoints to the remote ones in one go
+        try:
+            self._connect_local_endpoints(
+                    ns, [
+                        (input_nets[name], conn_info.endpoint)
+                        for name, conn_info in conn_infos.items()])
+
+            for name, conn_info in conn_infos.items():
                 self._active_connections[job_id][name] = conn_info.conn_id
-                nets[name] = self._net_to_addr(net, _WG_SERVER_HOST)
-                logger.debug(f'Connected')
+                nets[name] = self._net_to_addr(
+                        input_nets[name], _WG_SERVER_HOST)
+            logger.debug(f'Connected')
+        except Exception as e:
+            logger.error(f'Error completing connections: {e}')
+            for name, conn_info in conn_infos.items():
+                self._site_rest_client.disconnect_asset(
+                        inputs[name].id, conn_info.conn_id)
+                remaining[name] = inputs[name]
+
+        if nets:
+            for name in remaining:
+                try:
+                    self._remove_local_endpoint(
+                            ns, input_nets[name], local_endpoints[name])
+                except Exception as e:
+                    logger.warning(
+                            f'Could not remove endpoint for {name}: {e}')
+            self._job_namespaces[job_id] = ns
+            self._job_endpoints[job_id] = [
+                    (input_nets[name], local_endpoints[name].port)
+                    for name in nets]
+            self._monitor(ns, {
+                    input_nets[name]: ('client', conn_id)
+                    for name, conn_id in
+                    self._active_connections[job_id].items()})
+        else:
+            # disconnect_inputs() won't be called, so clean up here
+            try:
+                self._remove_all_local_endpoints(
+                        ns, _WG_CLIENT_HOST, [
+                            (input_nets[name], local_endpoints[name].port)
+                            for name in inputs])
             except Exception as e:
-                logger.error(f'Error completing connection: {e}')
-                if conn_info:
-                    self._site_rest_client.disconnect_asset(
-                            asset.id, conn_info.conn_id)
-                self._remove_wg_endpoint(
-                        network_namespace, net, _WG_CLIENT_HOST)
-                remaining[name] = asset
+                logger.warning(f'Could not remove endpoints: {e}')
+            self._release_namespace(ns)
 
         return nets, remaining
 
@@ -175,110 +395,746 @@ class WireGuardNA(INetworkAdministrator):
             job_id: Job id of job to disconnect.
             inputs: Input assets for this job, indexed by input name.
         """
-        for name, conn_id in self._active_connections[job_id].items():
+        futures = [
+                self._request_pool.submit(
+                    self._site_rest_client.disconnect_asset,
+                    inputs[name].id, conn_id)
+                for name, conn_id in self._active_connections[job_id].items()]
+
+        for future in futures:
             try:
-                self._site_rest_client.disconnect_asset(
-                        inputs[name].id, conn_id)
+                future.result()
             except Exception as e:
-                logger.warning('Could not disconnect input: {e}')
+                logger.warning(f'Could not disconnect input: {e}')
                 # ignore, we tried our best
 
-    def _create_wg_endpoint(
-            self, pid: int, net: int, host: int) -> WireGuardEndpoint:
-        """Create a local WireGuard endpoint.
+        ns = self._job_namespaces.pop(job_id, None)
+        job_endpoints = self._job_endpoints.pop(job_id, list())
+        if ns is not None:
+            self._unmonitor(ns)
+            try:
+                self._remove_all_local_endpoints(
+                        ns, _WG_CLIENT_HOST, job_endpoints)
+            except Exception as e:
+                logger.warning(f'Could not remove endpoints: {e}')
+            self._release_namespace(ns)
+
+    def _request_connection(
+            self, name: str, asset: Asset,
+            request: WireGuardConnectionRequest
+            ) -> WireGuardConnectionInfo:
+        """Ask a remote site to connect an asset to a local endpoint.
+
+        This is run in a worker thread, so that we can talk to several
+        sites at the same time.
+
+        Args:
+            name: Name of the input the asset is for.
+            asset: The asset to connect to.
+            request: The request to send.
+
+        Return:
+            Information on the remote endpoint.
+
+        Raises:
+            RuntimeError: If the connection failed.
+        """
+        logger.debug(f'Trying to connect for {name} on {request.net}')
+        conn_info = self._site_rest_client.connect_to_asset(
+                asset.id, request)
+        if not isinstance(conn_info, WireGuardConnectionInfo):
+            self._site_rest_client.disconnect_asset(
+                    asset.id, conn_info.conn_id)
+            raise RuntimeError('Peer incompatible')
+        logger.debug(f'Connection request for {name} successful')
+        return conn_info
+
+    def _use_assigned_net(
+            self, ns: str, name: str, asset: Asset,
+            input_nets: Dict[str, int],
+            local_endpoints: Dict[str, WireGuardEndpoint],
+            conn_info: WireGuardConnectionInfo
+            ) -> WireGuardConnectionInfo:
+        """Switch an input to the net assigned by the server.
+
+        A multiplexing server will assign a different net than we asked
+        for if ours is already in use on its side. If we multiplex too,
+        then we can just use that net, provided that it's free here.
+        Otherwise, our endpoint has the addresses of the old net, so we
+        replace it with one for the new net and ask again, once.
+
+        Args:
+            ns: Handle of the network namespace to connect.
+            name: Name of the input to switch.
+            asset: The asset to connect to.
+            input_nets: Net for each input, updated by this function.
+            local_endpoints: Local endpoint for each input, updated by
+                    this function.
+            conn_info: The connection info received from the server.
+
+        Return:
+            The connection info for the connection to use.
+
+        Raises:
+            RuntimeError: If we could not switch, in which case the
+                    connection to the server has been closed.
+        """
+        new_net = conn_info.net
+        assert new_net is not None
+        logger.debug(f'Server assigned net {new_net} for {name}')
+
+        if self._settings.multiplex:
+            try:
+                self._reserve_net(new_net)
+            except Exception:
+                self._site_rest_client.disconnect_asset(
+                        asset.id, conn_info.conn_id)
+                raise
+            self._free_nets([input_nets[name]])
+            input_nets[name] = new_net
+            return conn_info
+
+        self._site_rest_client.disconnect_asset(asset.id, conn_info.conn_id)
+        if new_net in input_nets.values():
+            raise RuntimeError(f'Assigned net {new_net} is in use')
+
+        self._remove_local_endpoint(
+                ns, input_nets[name], local_endpoints[name])
+        endpoint, = self._create_wg_endpoints(ns, [new_net], _WG_CLIENT_HOST)
+        input_nets[name] = new_net
+        local_endpoints[name] = endpoint
+
+        new_info = self._request_connection(
+                name, asset, WireGuardConnectionRequest(new_net, endpoint))
+        if new_info.net not in (None, new_net):
+            self._site_rest_client.disconnect_asset(
+                    asset.id, new_info.conn_id)
+            raise RuntimeError(f'Server assigned another net for {name}')
+        return new_info
+
+    def _create_local_endpoints(
+            self, ns: str, names: List[str]
+            ) -> Tuple[Dict[str, int], List[WireGuardEndpoint]]:
+        """Create local client-side endpoints for a set of inputs.
+
+        Args:
+            ns: Handle of the network namespace to connect.
+            names: Names of the inputs to create endpoints for.
+
+        Return:
+            A net for each input, indexed by name, and a list of
+            endpoints in the same order as names, for the remote
+            sides to connect to.
+        """
+        if self._settings.multiplex:
+            nets = self._allocate_nets(len(names))
+            try:
+                endpoints = [self._hub_endpoint()] * len(names)
+            except Exception:
+                self._free_nets(nets)
+                raise
+            return dict(zip(names, nets)), endpoints
+
+        input_nets = {name: net for net, name in enumerate(names)}
+        endpoints = self._create_wg_endpoints(
+                ns, list(input_nets.values()), _WG_CLIENT_HOST)
+        return input_nets, endpoints
+
+    def _connect_local_endpoints(
+            self, ns: str, connections: List[Tuple[int, WireGuardEndpoint]]
+            ) -> None:
+        """Connect client-side endpoints to their remote endpoints.
+
+        Args:
+            ns: Handle of the network namespace the endpoints are for.
+            connections: Pairs of a local net and the remote endpoint
+                    to connect it to.
+        """
+        if self._settings.multiplex:
+            self._attach_to_hub(ns, _WG_CLIENT_HOST, connections)
+        else:
+            self._connect_wg_endpoints(ns, _WG_CLIENT_HOST, connections)
+
+    def _remove_local_endpoint(
+            self, ns: str, net: int, endpoint: WireGuardEndpoint) -> None:
+        """Remove a single client-side endpoint and free its resources.
+
+        Args:
+            ns: Handle of the network namespace the endpoint is in.
+            net: The net of the endpoint.
+            endpoint: The endpoint, as returned by
+                    _create_local_endpoints().
+        """
+        if self._settings.multiplex:
+            self._detach_from_hub(ns, [net])
+        else:
+            self._remove_wg_endpoint(ns, net, _WG_CLIENT_HOST)
+            self._free_ports([endpoint.port])
+
+    def _remove_all_local_endpoints(
+            self, ns: str, host: int, endpoints: List[_Endpoint]) -> None:
+        """Remove all endpoints in a namespace and free resources.
+
+        Args:
+            ns: Handle of the network namespace to clean up.
+            host: The local host id (either _SERVER_HOST or
+                    _CLIENT_HOST)
+            endpoints: Net and local port of the endpoints in this
+                    namespace.
+        """
+        if self._settings.multiplex:
+            self._detach_from_hub(ns, [net for net, _ in endpoints])
+        else:
+            self._remove_all_wg_endpoints(ns, host, endpoints)
+
+    def _hub_endpoint(self) -> WireGuardEndpoint:
+        """Return the endpoint of our hub, creating the hub if needed.
+
+        The hub listens on the first port of the range, which is
+        reserved for it. Only used when multiplexing connections.
+
+        Raises:
+            RuntimeError: If the hub could not be created.
+        """
+        with self._hub_lock:
+            if self._hub is None:
+                if not self._net_admin_helper().supports('cwg_hub_create'):
+                    raise RuntimeError(
+                            'Multiplexing is enabled, but net-admin-helper'
+                            ' does not support it')
+
+                assert self._settings.ports is not None
+                port = self._settings.ports[0]
+                key = self._run_net_admin_helper(f'cwg_hub_create {port}')
+
+                our_ip = self._settings.external_ip
+                assert our_ip is not None
+                self._hub = WireGuardEndpoint(our_ip, port, key)
+
+            return self._hub
+
+    def _attach_to_hub(
+            self, ns: str, host: int,
+            connections: List[Tuple[int, WireGuardEndpoint]]
+            ) -> None:
+        """Connect a namespace to remote endpoints through the hub.
+
+        This adds a peer to the hub for each connection, and connects
+        the namespace to the hub via a veth pair per net.
+
+        Args:
+            ns: Handle of local namespace to connect.
+            host: The local host id (either _SERVER_HOST or
+                    _CLIENT_HOST)
+            connections: Pairs of a net and the remote endpoint to
+                    connect it to.
+        """
+        if not connections:
+            return
+
+        hub = self._hub_endpoint()
+        args = ' '.join([
+                f'{net}:{host}:{endpoint.endpoint()}:{endpoint.key}'
+                for net, endpoint in connections])
+        self._run_net_admin_helper(f'cwg_hub_attach {hub.port} {ns} {args}')
+
+    def _detach_from_hub(self, ns: str, nets: List[int]) -> None:
+        """Disconnect nets in a namespace from the hub.
 
-        This will create an endpoint in the network namespace
-        with the given PID, for the given net and host.
+        This also returns the nets to the pool.
 
         Args:
-            pid: PID of the network namespace (container) to create the
-                endpoint inside of.
+            ns: Handle of the local namespace to disconnect.
+            nets: The nets to disconnect.
+        """
+        if not nets:
+            return
+
+        hub = self._hub_endpoint()
+        args = ' '.join(map(str, nets))
+        try:
+            self._run_net_admin_helper(
+                    f'cwg_hub_detach {hub.port} {ns} {args}')
+        finally:
+            self._free_nets(nets)
+
+    def _allocate_nets(self, count: int) -> List[int]:
+        """Allocate nets which are not in use on this site.
+
+        These are chosen at random, so that nets allocated by different
+        sites are unlikely to clash at the server side.
+
+        Args:
+            count: Number of nets to allocate.
+        """
+        with self._nets_lock:
+            if len(self._used_nets) + count > _NUM_NETS:
+                raise RuntimeError('Insufficient resources')
+
+            nets = list()       # type: List[int]
+            while len(nets) < count:
+                net = randrange(_NUM_NETS)
+                if net not in self._used_nets:
+                    self._used_nets.add(net)
+                    nets.append(net)
+            return nets
+
+    def _assign_net(self, requested: int) -> int:
+        """Assign a net for a connection from a remote site.
+
+        This uses the net the remote site asked for if it's free here,
+        or a random free one otherwise.
+
+        Args:
+            requested: The net the remote site asked for.
+
+        Return:
+            The net to use, which has been reserved.
+        """
+        try:
+            self._reserve_net(requested)
+            return requested
+        except RuntimeError:
+            return self._allocate_nets(1)[0]
+
+    def _reserve_net(self, net: int) -> None:
+        """Reserve a specific net.
+
+        Args:
+            net: The net to reserve.
+
+        Raises:
+            RuntimeError: If the net is invalid or already in use here.
+        """
+        with self._nets_lock:
+            if not 0 <= net < _NUM_NETS:
+                raise RuntimeError(f'Invalid net {net}')
+            if net in self._used_nets:
+                raise RuntimeError(f'Net {net} is already in use')
+            self._used_nets.add(net)
+
+    def _free_nets(self, nets: Iterable[int]) -> None:
+        """Return nets to the pool.
+
+        Args:
+            nets: The nets to return.
+        """
+        with self._nets_lock:
+            self._used_nets.difference_update(nets)
+
+    def _create_connected_wg_endpoint(
+            self, ns: str, net: int, host: int, endpoint: WireGuardEndpoint
+            ) -> WireGuardEndpoint:
+        """Create a local WireGuard endpoint connected to a remote one.
+
+        This will create an endpoint in the given network namespace,
+        for the given net and host, and connect it to the given remote
+        endpoint, using a single helper command if the helper has
+        cwg_create_connect, or cwg_create and cwg_connect if it
+        doesn't.
+
+        Args:
+            ns: Handle of the network namespace (container) to create
+                the endpoint inside of.
             net: Network to create the endpoint for.
             host: Host id, either _SERVER_HOST or _CLIENT_HOST.
+            endpoint: The remote endpoint to connect to.
 
         Return:
             The local endpoint for the remote side to connect to.
         """
+        our_port, = self._allocate_ports(1)
         try:
-            our_port = self._available_ports.pop()
-        except KeyError:
-            raise RuntimeError('Insufficient resources')
-
-        try:
-            our_key = self._run_net_admin_helper(
-                    f'cwg_create {pid} {net} {host} {our_port}')
+            if self._net_admin_helper().supports('cwg_create_connect'):
+                our_key = self._run_net_admin_helper(
+                        f'cwg_create_connect {ns} {net} {host} {our_port}'
+                        f' {endpoint.endpoint()} {endpoint.key}')
+            else:
+                our_key = self._run_net_admin_helper(
+                        f'cwg_create {ns} {net} {host} {our_port}')
+                try:
+                    self._connect_wg_endpoints(ns, host, [(net, endpoint)])
+                except Exception:
+                    self._remove_wg_endpoint(ns, net, host)
+                    raise
         except Exception:
-            self._available_ports.add(our_port)
+            self._free_ports([our_port])
             raise
 
         our_ip = self._settings.external_ip
         assert our_ip is not None
         return WireGuardEndpoint(our_ip, our_port, our_key)
 
-    def _connect_wg_endpoint(
-            self, pid: int, net: int, host: int, endpoint: WireGuardEndpoint
+    def _create_wg_endpoints(
+            self, ns: str, nets: List[int], host: int
+            ) -> List[WireGuardEndpoint]:
+        """Create several local WireGuard endpoints at once.
+
+        This creates an endpoint for each of the given nets in the
+        given network namespace, using a single helper command if the
+        helper has cwg_create_batch, or one cwg_create per endpoint if
+        it doesn't.
+
+        Args:
+            ns: Handle of the network namespace (container) to create
+                the endpoints inside of.
+            nets: Networks to create endpoints for.
+            host: Host id, either _SERVER_HOST or _CLIENT_HOST.
+
+        Return:
+            The local endpoints, in the same order as nets.
+        """
+        if not nets:
+            return list()
+
+        our_ports = self._allocate_ports(len(nets))
+
+        if not self._net_admin_helper().supports('cwg_create_batch'):
+            our_keys = list()       # type: List[str]
+            try:
+                for net, port in zip(nets, our_ports):
+                    our_keys.append(self._run_net_admin_helper(
+                        f'cwg_create {ns} {net} {host} {port}'))
+            except Exception:
+                self._remove_wg_endpoints_quietly(
+                        ns, nets[:len(our_keys)], host)
+                self._free_ports(our_ports)
+                raise
+        else:
+            args = ' '.join([
+                    f'{net}:{host}:{port}'
+                    for net, port in zip(nets, our_ports)])
+            try:
+                output = self._run_net_admin_helper(
+                        f'cwg_create_batch {ns} {args}')
+                our_keys = output.split()
+                if len(our_keys) != len(nets):
+                    raise RuntimeError(
+                            f'Expected {len(nets)} keys from helper, got'
+                            f' {output}')
+            except Exception:
+                # We don't know how far the helper got, so try them all
+                self._remove_wg_endpoints_quietly(ns, nets, host)
+                self._free_ports(our_ports)
+                raise
+
+        our_ip = self._settings.external_ip
+        assert our_ip is not None
+        return [
+                WireGuardEndpoint(our_ip, port, key)
+                for port, key in zip(our_ports, our_keys)]
+
+    def _connect_wg_endpoints(
+            self, ns: str, host: int,
+            connections: List[Tuple[int, WireGuardEndpoint]]
             ) -> None:
-        """Connect a local WireGuard endpoint to a remote one.
+        """Connect several local WireGuard endpoints at once.
+
+        If the helper doesn't have cwg_connect_batch, then this falls
+        back to one cwg_connect per endpoint.
 
         Args:
-            pid: PID of local namespace the endpoint is in.
-            net: The network the local endpoint (and hopefully the
-                    remote one too!) is for.
+            ns: Handle of local namespace the endpoints are in.
             host: The local host id (either _SERVER_HOST or
                     _CLIENT_HOST)
-            endpoint: The remote endpoint to connect to.
+            connections: Pairs of a local net and the remote endpoint
+                    to connect its local endpoint to.
         """
-        self._run_net_admin_helper(
-                f'cwg_connect {pid} {net} {host} {endpoint.endpoint()}'
-                f' {endpoint.key}')
+        if not connections:
+            return
+
+        if not self._net_admin_helper().supports('cwg_connect_batch'):
+            for net, endpoint in connections:
+                self._run_net_admin_helper(
+                        f'cwg_connect {ns} {net} {host} {endpoint.endpoint()}'
+                        f' {endpoint.key}')
+            return
+
+        args = ' '.join([
+                f'{net}:{host}:{endpoint.endpoint()}:{endpoint.key}'
+                for net, endpoint in connections])
+        self._run_net_admin_helper(f'cwg_connect_batch {ns} {args}')
 
     def _remove_wg_endpoint(
-            self, pid: int, net: int, host: int) -> None:
+            self, ns: str, net: int, host: int) -> None:
         """Remove a local WireGuard endpoint.
 
         Args:
-            pid: PID of local namespace the endpoint is in.
+            ns: Handle of local namespace the endpoint is in.
             net: The network the local endpoint is for.
             host: The local host id (either _SERVER_HOST or
                     _CLIENT_HOST)
         """
-        self._run_net_admin_helper(f'cwg_destroy {pid} {net} {host}')
+        self._run_net_admin_helper(f'cwg_destroy {ns} {net} {host}')
+
+    def _remove_wg_endpoints_quietly(
+            self, ns: str, nets: List[int], host: int) -> None:
+        """Remove local WireGuard endpoints while cleaning up.
+
+        Errors are logged rather than raised, so that they don't hide
+        the error that caused the clean-up. This includes errors for
+        endpoints that turn out not to exist.
+
+        Args:
+            ns: Handle of local namespace the endpoints are in.
+            nets: The networks the local endpoints are for.
+            host: The local host id (either _SERVER_HOST or
+                    _CLIENT_HOST)
+        """
+        for net in nets:
+            try:
+                self._remove_wg_endpoint(ns, net, host)
+            except Exception as e:
+                logger.warning(f'Could not remove endpoint: {e}')
+
+    def _remove_all_wg_endpoints(
+            self, ns: str, host: int, endpoints: List[_Endpoint]) -> None:
+        """Remove all local WireGuard endpoints in a namespace.
+
+        This uses a single helper command if the helper has
+        cwg_destroy_all, and returns the ports it reports to the pool.
+        Otherwise, the given endpoints are removed one at a time, and
+        the ports of those that were removed are returned.
+
+        Args:
+            ns: Handle of local namespace to clean up.
+            host: The local host id (either _SERVER_HOST or
+                    _CLIENT_HOST)
+            endpoints: Net and local port of the endpoints in the
+                    namespace.
+
+        Raises:
+            RuntimeError: If an endpoint could not be removed.
+        """
+        if self._net_admin_helper().supports('cwg_destroy_all'):
+            output = self._run_net_admin_helper(f'cwg_destroy_all {ns}')
+            self._free_ports([int(port) for port in output.split()])
+            return
+
+        error = None    # type: Optional[Exception]
+        for net, port in endpoints:
+            try:
+                self._remove_wg_endpoint(ns, net, host)
+                self._free_ports([port])
+            except Exception as e:
+                error = e
+        if error is not None:
+            raise RuntimeError(f'Could not remove all endpoints: {error}')
+
+    def _allocate_ports(self, count: int) -> List[int]:
+        """Take a number of ports from the pool of available ports.
+
+        Args:
+            count: Number of ports to allocate.
+
+        Return:
+            The allocated ports.
+
+        Raises:
+            RuntimeError: If there are not enough ports available.
+        """
+        with self._ports_lock:
+            if len(self._available_ports) < count:
+                raise RuntimeError('Insufficient resources')
+            ports = [self._available_ports.pop() for _ in range(count)]
+            _free_ports_gauge.set(len(self._available_ports))
+            return ports
+
+    def _free_ports(self, ports: Iterable[int]) -> None:
+        """Return ports to the pool of available ports.
+
+        Ports that are not in our configured range are ignored, so
+        that unexpected helper output cannot add to the pool.
+
+        Args:
+            ports: The ports to return.
+        """
+        with self._ports_lock:
+            self._available_ports.update(self._all_ports.intersection(ports))
+            _free_ports_gauge.set(len(self._available_ports))
+
+    def _monitor(self, ns: str, conns: Dict[int, _Conn]) -> None:
+        """Start sampling traffic statistics for a namespace.
+
+        Args:
+            ns: Handle of the namespace to monitor.
+            conns: Role ('client' or 'server') and conn_id of the
+                    connection for each net in the namespace.
+        """
+        with self._stats_lock:
+            self._monitored[ns] = conns
+            self._count_connections()
+            interval = self._settings.stats_interval
+            if self._stats_thread is None and interval > 0.0:
+                self._stats_thread = Thread(
+                        target=self._sample_stats_loop, daemon=True,
+                        name='WireGuardNA-stats')
+                self._stats_thread.start()
+
+    def _unmonitor(self, ns: str) -> None:
+        """Take a final sample and stop monitoring a namespace.
+
+        This also removes the metrics for its connections. If
+        statistics are disabled, no sample is taken.
+
+        Args:
+            ns: Handle of the namespace to stop monitoring.
+        """
+        if self._settings.stats_interval > 0.0:
+            self._sample_stats(ns)
+        with self._stats_lock:
+            conns = self._monitored.pop(ns, dict())
+            self._count_connections()
+            for role, conn_id in conns.values():
+                last = self._last_stats.pop((role, conn_id), None)
+                if last is not None:
+                    logger.info(
+                            f'Connection {conn_id} ({role}) received'
+                            f' {last[1]} bytes and sent {last[2]} bytes')
+                for direction in ('rx', 'tx'):
+                    _connection_bytes.remove(
+                            role=role, conn_id=conn_id, direction=direction)
+                    _connection_throughput.remove(
+                            role=role, conn_id=conn_id, direction=direction)
+                _connection_handshake.remove(role=role, conn_id=conn_id)
+
+    def _count_connections(self) -> None:
+        """Update the number of open connections metric.
+
+        Must be called with the stats lock held.
+        """
+        counts = {'client': 0, 'server': 0}
+        for conns in self._monitored.values():
+            for role, _ in conns.values():
+                counts[role] = counts.get(role, 0) + 1
+        for role, count in counts.items():
+            _open_connections.set(count, role=role)
+
+    def _sample_stats(self, ns: str) -> None:
+        """Sample traffic statistics for a namespace.
+
+        This gets the statistics for all our devices in the namespace
+        using a single cwg_stats command, and updates the metrics of
+        the corresponding connections. Errors are logged and ignored,
+        as these statistics are informational only.
+
+        Args:
+            ns: Handle of the namespace to sample.
+        """
+        with self._stats_lock:
+            conns = self._monitored.get(ns)
+        if not conns:
+            return
 
-    def _ensure_net_admin_helper(self) -> None:
-        """Ensures that the NAH Docker image is loaded into Docker."""
         try:
-            self._dcli.images.get(_NAH_IMAGE)
-        except docker.errors.ImageNotFound:
-            image_file = (
-                    Path(__file__).parents[1] / 'data' /
-                    'net-admin-helper.tar.gz')
-            with image_file.open('rb') as f:
-                image = self._dcli.images.load(f.read())[0]
+            if not self._net_admin_helper().supports('cwg_stats'):
+                return
+            output = self._run_net_admin_helper(f'cwg_stats {ns}')
+            all_stats = parse_device_stats(output)
+        except Exception as e:
+            logger.debug(f'Could not get statistics for {ns}: {e}')
+            return
+
+        now = time.monotonic()
+        with self._stats_lock:
+            if self._monitored.get(ns) is not conns:
+                # stopped monitoring in the mean time
+                return
+
+            for stats in all_stats:
+                if stats.net not in conns:
+                    continue
+                role, conn_id = conns[stats.net]
+                last = self._last_stats.get((role, conn_id))
+                for direction, value in (
+                        ('rx', stats.rx_bytes), ('tx', stats.tx_bytes)):
+                    _connection_bytes.set(
+                            value, role=role, conn_id=conn_id,
+                            direction=direction)
+                    if last is not None and now > last[0]:
+                        prev = last[1] if direction == 'rx' else last[2]
+                        _connection_throughput.set(
+                                max(value - prev, 0) / (now - last[0]),
+                                role=role, conn_id=conn_id,
+                                direction=direction)
+                if stats.last_handshake is not None:
+                    _connection_handshake.set(
+                            stats.last_handshake, role=role, conn_id=conn_id)
+                self._last_stats[(role, conn_id)] = (
+                        now, stats.rx_bytes, stats.tx_bytes)
+
+    def _sample_stats_loop(self) -> None:
+        """Sample statistics for all monitored namespaces periodically.
+
+        Runs in a background thread until close() is called.
+        """
+        while not self._stop_stats.wait(self._settings.stats_interval):
+            with self._stats_lock:
+                namespaces = list(self._monitored)
+            for ns in namespaces:
+                self._sample_stats(ns)
+
+    def _release_namespace(self, ns: str) -> None:
+        """Release a pinned namespace handle, logging any errors.
+
+        Args:
+            ns: The handle to release.
+        """
+        try:
+            self._net_admin_helper().release_namespace(ns)
+        except Exception as e:
+            logger.warning(f'Could not release network namespace {ns}: {e}')
 
     def _run_net_admin_helper(self, command: str) -> str:
         """Run net-admin-helper and return its output.
 
+        This also records the time taken, and any timing records
+        produced by the helper, in the metrics.
+
         Args:
             command: The subcommand to run, including arguments.
         """
-        logger.debug(f'Running net-admin-helper {command}')
-        self._ensure_net_admin_helper()
-        container = self._dcli.containers.run(
-                _NAH_IMAGE, f'/usr/local/bin/net-admin-helper {command}',
-                cap_add=[
-                    'NET_ADMIN', 'SYS_ADMIN', 'SYS_PTRACE', 'IPC_LOCK'],
-                network_mode='host', pid_mode='host', detach=True)
+        subcommand = command.split(maxsplit=1)[0]
+        start = time.perf_counter()
+        output, timings = self._net_admin_helper().run_timed(command)
+        _nah_command_seconds.observe(
+                time.perf_counter() - start, command=subcommand)
+
+        for record in timings:
+            try:
+                name, phases = parse_timing_record(record)
+                for phase, duration in phases.items():
+                    _nah_phase_seconds.observe(
+                            duration * 1e-9, command=name, phase=phase)
+            except RuntimeError as e:
+                logger.warning(str(e))
 
-        result = container.wait()
+        return output
+
+    def _net_admin_helper(self) -> NetAdminHelper:
+        """Return the net-admin-helper to use, starting it if needed.
+
+        If daemon mode is selected but the daemon fails to start, then
+        this falls back to running a container for every command.
+        """
+        with self._nah_lock:
+            if self._nah is None:
+                if self._settings.helper_mode == 'daemon':
+                    daemon = DaemonNetAdminHelper(
+                            self._dcli, self._settings.helper_socket_dir)
+                    try:
+                        daemon.start()
+                        self._nah = daemon
+                    except RuntimeError as e:
+                        logger.warning(
+                                f'Could not start net-admin-helper daemon,'
+                                f' falling back to container mode: {e}')
+                        daemon.close()
 
-        if result['StatusCode'] != 0:
-            error = container.logs().decode('utf-8')
-            container.remove(force=True)
-            raise RuntimeError(f'net-admin-helper: {error}')
+                if self._nah is None:
+                    self._nah = ContainerNetAdminHelper(self._dcli)
 
-        logs = cast(bytes, container.logs(stdout=True, stderr=False))
-        container.remove(force=True)
-        return logs.decode('ascii').strip()
+            return self._nah
 
     def _net_to_addr(self, net: int, host: int) -> str:
         """Return the IP for a given network number and host.
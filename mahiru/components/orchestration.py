@@ -1,10 +1,28 @@
-"""Supports running DDM-wide workflows."""
+"""Supports running DDM-wide workflows.
+
+Planning assigns a site to each step of a workflow. The number of
+possible plans grows exponentially with the number of steps, so rather
+than enumerating all of them, the planner does a depth-first
+branch-and-bound search over the steps in topological order. At each
+step it tries the permitted sites in order of increasing cost, and it
+abandons a partial plan when its cost plus a lower bound for the
+remaining steps is no better than the worst of the best plans found so
+far. Costs are estimated by a pluggable PlanCostModel, and the search
+stops early when its time budget runs out.
+"""
+from collections import deque
+from heapq import heappush, heappushpop
+from itertools import count
 import logging
 from copy import copy
+import math
+import time
 from time import sleep
-from typing import Any, Dict, Generator, List
+from typing import (
+        Any, Callable, Deque, Dict, List, Optional, Tuple)
 
 from mahiru.components.registry_client import RegistryClient
+from mahiru.components.state_store import MemoryStateStore, StateStore
 from mahiru.definitions.assets import Asset
 from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.workflows import (
@@ -17,21 +35,129 @@ from mahiru.rest.site_client import SiteRestClient
 logger = logging.getLogger(__name__)
 
 
+# Plans found by the search: (-cost, -serial number, step sites)
+_PlanEntry = Tuple[float, int, Dict[str, Identifier]]
+
+
+class PlanCostModel:
+    """Estimates the cost of executing workflow steps at sites.
+
+    The cost of a plan is the sum of the costs of its steps. Step costs
+    must not be negative, and may depend on the sites of the steps
+    that the step gets inputs from, which are planned before it.
+    """
+    def step_cost(
+            self, job: Job, step: WorkflowStep, site: Identifier,
+            step_sites: Dict[str, Identifier], submitting_site: Identifier
+            ) -> float:
+        """Estimate the cost of executing a step at a site.
+
+        Args:
+            job: The job being planned.
+            step: The step to estimate for.
+            site: The site it would run at.
+            step_sites: Sites of the steps planned so far, including
+                    all steps that this one depends on.
+            submitting_site: The site the results go to.
+        """
+        raise NotImplementedError()
+
+    def min_step_cost(
+            self, job: Job, step: WorkflowStep, site: Identifier,
+            submitting_site: Identifier) -> float:
+        """Return a lower bound for step_cost().
+
+        This must be at most the cost of executing the step at the site
+        for any placement of the other steps. The closer it is, the
+        more the search can be pruned.
+
+        Args:
+            job: The job being planned.
+            step: The step to estimate for.
+            site: The site it would run at.
+            submitting_site: The site the results go to.
+        """
+        return 0.0
+
+
+class DataTransferCost(PlanCostModel):
+    """Estimates cost as the amount of data sent between sites.
+
+    A step costs the size of each of its inputs that are at a different
+    site, plus the size of each of its outputs that are workflow outputs
+    if it doesn't run at the submitting site. With the default size of
+    1 for every item, this counts transfers, so that plans which run
+    steps where their inputs are come first.
+    """
+    def __init__(
+            self, item_size: Optional[Callable[[str], float]] = None
+            ) -> None:
+        """Create a DataTransferCost model.
+
+        Args:
+            item_size: Returns the estimated size of a workflow item
+                    given its name, e.g. 'x' or 'step1.y'.
+        """
+        self._item_size = item_size or (lambda item: 1.0)
+
+    def step_cost(
+            self, job: Job, step: WorkflowStep, site: Identifier,
+            step_sites: Dict[str, Identifier], submitting_site: Identifier
+            ) -> float:
+        """Estimate the cost of executing a step at a site.
+
+        See PlanCostModel.step_cost().
+        """
+        cost = self.min_step_cost(job, step, site, submitting_site)
+        for ref in step.inputs.values():
+            if '.' in ref and step_sites[ref.split('.')[0]] != site:
+                cost += self._item_size(ref)
+        return cost
+
+    def min_step_cost(
+            self, job: Job, step: WorkflowStep, site: Identifier,
+            submitting_site: Identifier) -> float:
+        """Return the cost that doesn't depend on other steps.
+
+        See PlanCostModel.min_step_cost().
+        """
+        cost = 0.0
+        for ref in step.inputs.values():
+            if '.' not in ref and job.inputs[ref].location() != site:
+                cost += self._item_size(ref)
+
+        if site != submitting_site:
+            for ref in job.workflow.outputs.values():
+                if ref.split('.')[0] == step.name:
+                    cost += self._item_size(ref)
+        return cost
+
+
 class WorkflowPlanner:
     """Plans workflow execution across sites in a DDM."""
     def __init__(
             self, registry_client: RegistryClient,
-            policy_evaluator: PolicyEvaluator
+            policy_evaluator: PolicyEvaluator,
+            cost_model: Optional[PlanCostModel] = None,
+            max_plans: int = 10, time_budget: float = 1.0
             ) -> None:
         """Create a WorkflowOrchestrator.
 
         Args:
             registry_client: RegistryClient to get sites from.
             policy_evaluator: PolicyEvaluator to use for permissions.
+            cost_model: Model to rank plans with, defaults to
+                    DataTransferCost.
+            max_plans: Maximum number of plans to return.
+            time_budget: Time (s) to search for plans for. Once it's
+                    up, the best plans found so far are returned.
         """
         self._registry_client = registry_client
         self._policy_evaluator = policy_evaluator
         self._permission_calculator = PermissionCalculator(policy_evaluator)
+        self._cost_model = cost_model or DataTransferCost()
+        self._max_plans = max_plans
+        self._time_budget = time_budget
 
     def make_plans(
             self, submitting_party: Identifier, submitting_site: Identifier,
@@ -49,7 +175,8 @@ class WorkflowPlanner:
             job: The job to plan.
 
         Returns:
-            A list of plans that will execute the workflow.
+            Up to max_plans plans that will execute the workflow, the
+            cheapest first.
         """
         logger.debug(
                 'Rules:'
@@ -76,54 +203,133 @@ class WorkflowPlanner:
                 job, sites, permissions)
         logger.debug(f'Permitted sites: {permitted_sites}')
 
-        sorted_steps = self._sort_workflow(job.workflow)
-        sorted_step_names = [step.name for step in sorted_steps]
+        for step_name, step_sites in permitted_sites.items():
+            if not step_sites:
+                logger.debug(f'No permitted sites for step {step_name}')
+                return []
 
-        plan = [Identifier('*')] * len(sorted_steps)
+        sorted_steps = self._sort_workflow(job.workflow)
+        plans = self._search(
+                job, submitting_site, sorted_steps, permitted_sites)
+        for cost, plan in plans:
+            logger.debug(f'Plan with cost {cost}: {plan}')
+        return [plan for _, plan in plans]
+
+    def _search(
+            self, job: Job, submitting_site: Identifier,
+            sorted_steps: List[WorkflowStep],
+            permitted_sites: Dict[str, List[Identifier]]
+            ) -> List[Tuple[float, Plan]]:
+        """Find the cheapest plans using branch-and-bound.
 
-        def plan_from(
-                cur_step_idx: int) -> Generator[List[Identifier], None, None]:
-            """Make remaining plan, starting at cur_step.
+        Args:
+            job: The job to plan.
+            submitting_site: The site the results go to.
+            sorted_steps: The job's steps in topological order.
+            permitted_sites: Sites each step may run at, by step name.
 
-            Yields any complete plans found.
-            """
-            cur_step = sorted_steps[cur_step_idx]
-            for site in permitted_sites[cur_step.name]:
-                plan[cur_step_idx] = site
-                if cur_step_idx == len(plan) - 1:
-                    yield plan
+        Return:
+            The best plans found with their costs, cheapest first.
+        """
+        cost_model = self._cost_model
+        deadline = time.monotonic() + self._time_budget
+        num_steps = len(sorted_steps)
+
+        # lower bound on the cost of steps i and up
+        remaining = [0.0] * (num_steps + 1)
+        for i in reversed(range(num_steps)):
+            step = sorted_steps[i]
+            remaining[i] = remaining[i + 1] + min(
+                    cost_model.min_step_cost(
+                        job, step, site, submitting_site)
+                    for site in permitted_sites[step.name])
+
+        # max-heap on cost, then on order found, of the best plans
+        best = list()       # type: List[_PlanEntry]
+        found = count()
+        step_sites = dict()     # type: Dict[str, Identifier]
+        timed_out = False
+
+        def worst_best() -> float:
+            if len(best) < self._max_plans:
+                return math.inf
+            return -best[0][0]
+
+        def search_from(i: int, cost: float) -> None:
+            nonlocal timed_out
+            if i == num_steps:
+                entry = (-cost, -next(found), dict(step_sites))
+                if len(best) < self._max_plans:
+                    heappush(best, entry)
                 else:
-                    yield from plan_from(cur_step_idx + 1)
+                    heappushpop(best, entry)
+                return
+
+            if best and time.monotonic() > deadline:
+                timed_out = True
+                return
+
+            step = sorted_steps[i]
+            options = sorted(
+                    ((cost_model.step_cost(
+                        job, step, site, step_sites, submitting_site), site)
+                     for site in permitted_sites[step.name]),
+                    key=lambda option: option[0])
+
+            for step_cost, site in options:
+                new_cost = cost + step_cost
+                if new_cost + remaining[i + 1] >= worst_best():
+                    break
+                step_sites[step.name] = site
+                search_from(i + 1, new_cost)
+                if timed_out:
+                    break
+            step_sites.pop(step.name, None)
+
+        search_from(0, 0.0)
+        if timed_out:
+            logger.info(
+                    f'Planning time budget exceeded, using the best'
+                    f' {len(best)} plans found')
 
         return [
-                Plan(dict(zip(sorted_step_names, plan)))
-                for plan in plan_from(0)]
+                (-neg_cost, Plan(sites))
+                for neg_cost, _, sites in sorted(best, reverse=True)]
 
     def _sort_workflow(self, workflow: Workflow) -> List[WorkflowStep]:
         """Sorts the workflow's steps topologically.
 
         In the returned list, each step is preceded by the ones it
-        depends on.
+        depends on. This takes time linear in the number of steps and
+        connections between them.
         """
-        # find dependencies for each step
-        deps = dict()       # type: Dict[WorkflowStep, List[WorkflowStep]]
+        # count dependencies for each step, and find dependents
+        num_deps = dict()       # type: Dict[str, int]
+        dependents = dict()     # type: Dict[str, List[str]]
         for step in workflow.steps.values():
-            step_deps = list()   # type: List[WorkflowStep]
-            for name, ref in step.inputs.items():
+            num_deps[step.name] = 0
+            dependents.setdefault(step.name, list())
+            for ref in step.inputs.values():
                 if '.' in ref:
                     dep_name = ref.split('.')[0]
-                    step_deps.append(workflow.steps[dep_name])
-            deps[step] = step_deps
+                    num_deps[step.name] += 1
+                    dependents.setdefault(dep_name, list()).append(step.name)
 
         # sort based on dependencies
+        ready = deque(
+                name for name, n in num_deps.items()
+                if n == 0)      # type: Deque[str]
         result = list()     # type: List[WorkflowStep]
-        while len(result) < len(workflow.steps):
-            for step in workflow.steps.values():
-                if step in result:
-                    continue
-                if all([dep in result for dep in deps[step]]):
-                    result.append(step)
-                    break
+        while ready:
+            name = ready.popleft()
+            result.append(workflow.steps[name])
+            for dependent in dependents[name]:
+                num_deps[dependent] -= 1
+                if num_deps[dependent] == 0:
+                    ready.append(dependent)
+
+        if len(result) < len(workflow.steps):
+            raise RuntimeError('Workflow has a cycle')
         return result
 
 
@@ -206,24 +412,30 @@ class WorkflowExecutor:
 class WorkflowOrchestrator:
     """Plans and runs workflows across sites in DDM.
 
-    Keeps track of jobs by an id, which is a URL-safe string.
+    Keeps track of jobs by an id, which is a URL-safe string. Jobs are
+    kept in a StateStore, so that they can be shared between processes.
 
     """
     def __init__(
             self, policy_evaluator: PolicyEvaluator,
-            registry_client: RegistryClient, site_rest_client: SiteRestClient
-            ) -> None:
+            registry_client: RegistryClient, site_rest_client: SiteRestClient,
+            state: Optional[StateStore] = None) -> None:
         """Create a WorkflowOrchestrator.
 
         Args:
             policy_evaluator: Component that knows about policies.
             registry_client: Client for accessing the registry.
             site_rest_client: Client for accessing other sites.
+            state: Store to keep jobs in, defaults to a new
+                    MemoryStateStore.
         """
+        if state is None:
+            state = MemoryStateStore()
+
         self._planner = WorkflowPlanner(registry_client, policy_evaluator)
         self._executor = WorkflowExecutor(site_rest_client)
-        self._next_id = 1
-        self._jobs = dict()     # type: Dict[str, ExecutionRequest]
+        self._state = state
+        self._jobs = state.table('jobs', ExecutionRequest)
         self._results = dict()  # type: Dict[str, Dict[str, Any]]
 
     def start_job(
@@ -248,13 +460,12 @@ class WorkflowOrchestrator:
                     ' permissions.')
         for i, plan in enumerate(plans):
             logger.info(f'Plan {i}: {plan}')
-        selected_plan = plans[-1]
+        selected_plan = plans[0]
         request = ExecutionRequest(job, selected_plan)
         self._executor.start_workflow(request)
 
-        job_id = str(self._next_id)
-        self._next_id += 1
-        self._jobs[job_id] = request
+        job_id = str(self._state.next_serial('jobs'))
+        self._jobs.put(job_id, request)
         return job_id
 
     def get_submitted_job(self, job_id: str) -> Job:
@@ -270,7 +481,7 @@ class WorkflowOrchestrator:
             KeyError: If no job with this id was found.
 
         """
-        return self._jobs[job_id].job
+        return self._get_request(job_id).job
 
     def get_plan(self, job_id: str) -> Plan:
         """Returns the plan used to execute the given job.
@@ -285,7 +496,7 @@ class WorkflowOrchestrator:
             KeyError: If no job with this id was found.
 
         """
-        return self._jobs[job_id].plan
+        return self._get_request(job_id).plan
 
     def is_done(self, job_id: str) -> bool:
         """Checks whether the given job is done.
@@ -299,7 +510,7 @@ class WorkflowOrchestrator:
         Raises:
             KeyError: If the job id does not exist.
         """
-        return self._executor.is_done(self._jobs[job_id])
+        return self._executor.is_done(self._get_request(job_id))
 
     def get_results(self, job_id: str) -> Dict[str, Asset]:
         """Returns results of a completed job.
@@ -316,4 +527,18 @@ class WorkflowOrchestrator:
         Raises:
             KeyError: If the job id does not exist.
         """
-        return self._executor.get_results(self._jobs[job_id])
+        return self._executor.get_results(self._get_request(job_id))
+
+    def _get_request(self, job_id: str) -> ExecutionRequest:
+        """Returns the execution request for the given job.
+
+        Args:
+            job_id: The id of the job to get the request for.
+
+        Raises:
+            KeyError: If the job id does not exist.
+        """
+        request = self._jobs.get(job_id)
+        if request is None:
+            raise KeyError(f'Job {job_id} not found')
+        return request
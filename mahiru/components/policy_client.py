@@ -7,6 +7,8 @@ from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.interfaces import IPolicyCollection
 from mahiru.definitions.registry import RegisteredObject, SiteDescription
 from mahiru.definitions.policy import Rule
+from mahiru.definitions.signable import SignatureCache
+from mahiru.policy.index import RuleIndex
 from mahiru.policy.replication import RuleValidator
 from mahiru.replication import Replica
 from mahiru.rest.replication import PolicyRestClient
@@ -17,11 +19,13 @@ class PolicyClient(IPolicyCollection):
     def __init__(
             self, registry_client: RegistryClient,
             trust_store: Optional[Path] = None,
-            client_credentials: Optional[Tuple[Path, Path]] = None
-            ) -> None:
+            client_credentials: Optional[Tuple[Path, Path]] = None,
+            long_poll: float = 0.0) -> None:
         """Create a PolicyClient.
 
-        This will automatically keep the replicas up-to-date as needed.
+        This will automatically keep the replicas up-to-date as needed,
+        either by polling when policies are requested, or by long
+        polling the policy servers in the background.
 
         Args:
             registry_client: A RegistryClient to use for getting
@@ -29,12 +33,23 @@ class PolicyClient(IPolicyCollection):
             trust_store: A file with trusted certificates/anchors.
             client_credentials: Paths to PEM files with the HTTPS
                     client certificate and key to use when connecting.
+            long_poll: Time (s) to ask policy servers to wait for
+                    changes, or 0 to only poll when needed.
         """
         self._registry_client = registry_client
         self._trust_store = trust_store
         self._client_credentials = client_credentials
+        self._long_poll = long_poll
 
         self._policy_replicas = dict()  # type: Dict[Identifier, Replica[Rule]]
+
+        # Index of the rules in all replicas, kept up to date via the
+        # replicas' update callbacks.
+        self._rule_index = RuleIndex()
+
+        # Shared by the replicas' validators, so that rules that were
+        # checked before aren't checked again.
+        self._signature_cache = SignatureCache()
         self._registry_client.register_callback(self.on_update)
 
     def policies(self) -> Iterable[Rule]:
@@ -42,9 +57,19 @@ class PolicyClient(IPolicyCollection):
         self._update()
         return [
                 rule
-                for replica in self._policy_replicas.values()
+                for replica in list(self._policy_replicas.values())
                 for rule in replica.objects]
 
+    def rule_index(self) -> RuleIndex:
+        """Returns an up-to-date index of the collected rules."""
+        self._update()
+        return self._rule_index
+
+    def close(self) -> None:
+        """Stop long polling policy servers."""
+        for replica in list(self._policy_replicas.values()):
+            replica.stop_watching()
+
     def on_update(
             self, created: Set[RegisteredObject],
             deleted: Set[RegisteredObject]
@@ -61,7 +86,9 @@ class PolicyClient(IPolicyCollection):
         """
         for o in deleted:
             if isinstance(o, SiteDescription) and o.has_policies:
-                del self._policy_replicas[o.id]
+                replica = self._policy_replicas.pop(o.id)
+                replica.stop_watching()
+                self._rule_index.update(set(), replica.objects)
 
         for o in created:
             if isinstance(o, SiteDescription) and o.has_policies:
@@ -71,14 +98,22 @@ class PolicyClient(IPolicyCollection):
 
                 namespace, key = self._registry_client.get_ns_and_key(
                         o.owner_id)
-                validator = RuleValidator(namespace, key)
-                self._policy_replicas[o.id] = Replica[Rule](
-                        client, validator)
+                validator = RuleValidator(
+                        namespace, key, self._signature_cache)
+                old_replica = self._policy_replicas.get(o.id)
+                if old_replica is not None:
+                    old_replica.stop_watching()
+                    self._rule_index.update(set(), old_replica.objects)
+                replica = Replica[Rule](
+                        client, validator, self._rule_index.update)
+                self._policy_replicas[o.id] = replica
+                if self._long_poll > 0.0:
+                    replica.watch(self._long_poll)
 
     def _update(self) -> None:
         """Ensures policy replicas are up to date."""
         self._registry_client.update()
         # The above calls back on_update(), which adds and removes
         # replicas as needed, so now we just need to update them.
-        for replica in self._policy_replicas.values():
+        for replica in list(self._policy_replicas.values()):
             replica.update()
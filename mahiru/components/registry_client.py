@@ -27,15 +27,23 @@ class RegistryClient:
     utility functions, based on a local replica it keeps.
 
     """
-    def __init__(self, registry: IRegistryService) -> None:
+    def __init__(
+            self, registry: IRegistryService, long_poll: float = 0.0
+            ) -> None:
         """Create a RegistryClient.
 
         Note that this class can use either a Registry object to
         call directly, or a RegistryRestClient to connect to a
         registry via a REST API.
 
+        If long polling is enabled, registered callbacks will be
+        called from a background thread as soon as the registry
+        changes.
+
         Args:
             registry: The registry to connect to.
+            long_poll: Time (s) to ask the registry to wait for
+                    changes, or 0 to only poll when needed.
         """
         self._callbacks = list()    # type: List[RegistryCallback]
         self._registry_replica = _RegistryReplica(
@@ -43,6 +51,12 @@ class RegistryClient:
 
         # Get initial data
         self._registry_replica.update()
+        if long_poll > 0.0:
+            self._registry_replica.watch(long_poll)
+
+    def close(self) -> None:
+        """Stop long polling, if enabled."""
+        self._registry_replica.stop_watching()
 
     def register_callback(self, callback: RegistryCallback) -> None:
         """Register a callback for registry updates.
@@ -132,5 +146,5 @@ class RegistryClient:
             self, created: Set[RegisteredObject],
             deleted: Set[RegisteredObject]) -> None:
         """Calls callbacks when sites are updated."""
-        for callback in self._callbacks:
+        for callback in list(self._callbacks):
             callback(created, deleted)
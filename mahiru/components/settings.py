@@ -16,10 +16,30 @@ class NetworkSettings:
         external_ip: External IPv4 address we are available at.
         ports: Port range to use for serving incoming connections,
             as a length-2 list of the form [min, max].
+        helper_mode: How to run net-admin-helper, either 'container'
+            to start a new container for every command, or 'daemon' to
+            keep a single instance running and send it commands. The
+            latter needs a net-admin-helper built with daemon support.
+        helper_socket_dir: Directory on the Docker host in which to
+            create the net-admin-helper daemon's socket. If not
+            given, a temporary directory is used, which only works if
+            the site runs on the Docker host directly, so this must be
+            set when using daemon mode from inside a container.
+        multiplex: Whether to run all connections through a single
+            WireGuard device listening on the first port of the
+            range, rather than using a port for each connection.
+        stats_interval: Interval in seconds at which to sample traffic
+            statistics for connections, or 0 to not collect them. In
+            container mode, sampling starts a container per
+            connection every time, so it's off unless set.
     """
     def __init__(
             self, enabled: bool = False, external_ip: Optional[str] = None,
-            ports: Optional[List[int]] = None) -> None:
+            ports: Optional[List[int]] = None,
+            helper_mode: str = 'container',
+            helper_socket_dir: Optional[Path] = None,
+            multiplex: bool = False, stats_interval: Optional[float] = None
+            ) -> None:
         """Create a ConnectionSettings object.
 
         Args:
@@ -27,6 +47,15 @@ class NetworkSettings:
             external_ip: External IPv4 address we are available at.
             ports: Port range to use for serving incoming connections,
                 as a length-2 list of the form [min, max].
+            helper_mode: How to run net-admin-helper, either
+                'container' or 'daemon'.
+            helper_socket_dir: Directory on the Docker host in which
+                to create the net-admin-helper daemon's socket.
+            multiplex: Whether to run all connections through a
+                single WireGuard device.
+            stats_interval: Interval in seconds at which to sample
+                traffic statistics for connections. Defaults to 10 in
+                daemon mode and to 0 in container mode.
         """
         if enabled:
             if not external_ip:
@@ -44,9 +73,23 @@ class NetworkSettings:
             if ports[0] > ports[1]:
                 raise RuntimeError('Minimum must be <= maximum')
 
+        if helper_mode not in ('daemon', 'container'):
+            raise RuntimeError(
+                    'Expected helper_mode to be "daemon" or "container"')
+
+        if stats_interval is None:
+            stats_interval = 10.0 if helper_mode == 'daemon' else 0.0
+
+        if stats_interval < 0.0:
+            raise RuntimeError('Statistics interval must not be negative')
+
         self.enabled = enabled
         self.external_ip = external_ip
         self.ports = ports
+        self.helper_mode = helper_mode
+        self.helper_socket_dir = helper_socket_dir
+        self.multiplex = multiplex
+        self.stats_interval = stats_interval
 
 
 class SiteConfiguration:
@@ -65,6 +108,21 @@ class SiteConfiguration:
         client_key: File with the key for client_cert.
         loglevel: Logging level to use, one of 'critical', 'error',
                 'warning', 'info', or 'debug'.
+        image_cache_size: Maximum total size in bytes of currently
+                unused asset images to keep loaded for future use.
+        replication_long_poll: Time in seconds that the registry and
+                policy servers are asked to hold on to a request for
+                updates until there is a change, 0 to poll instead.
+        step_slots: Maximum number of workflow steps to execute at the
+                same time, or None to use the number of CPUs.
+        pilot_pool_size: Number of started pilot containers to keep
+                ready for executing steps.
+        state_dir: Directory to keep the site's state and stored
+                images in, or None to keep them in memory and in a
+                temporary directory.
+        max_long_polls: Maximum number of requests from other sites
+                that may wait for policy updates or assets at the same
+                time. Each of these ties up a server thread.
     """
     def __init__(
             self,
@@ -74,7 +132,13 @@ class SiteConfiguration:
             trust_store: Optional[Path] = None,
             client_cert: Optional[Path] = None,
             client_key: Optional[Path] = None,
-            loglevel: str = 'info'
+            loglevel: str = 'info',
+            image_cache_size: int = 4 * 1024**3,
+            replication_long_poll: float = 25.0,
+            step_slots: Optional[int] = None,
+            pilot_pool_size: int = 0,
+            state_dir: Optional[Path] = None,
+            max_long_polls: int = 64
             ) -> None:
         """Create a SiteConfiguration object.
 
@@ -91,6 +155,19 @@ class SiteConfiguration:
             client_key: File with the key for client_cert.
             loglevel: Logging level to use, one of 'critical', 'error',
                     'warning', 'info', or 'debug'.
+            image_cache_size: Maximum total size in bytes of unused
+                    asset images to keep, 0 disables caching.
+            replication_long_poll: Time (s) for servers to wait for
+                    replication updates, 0 disables long polling.
+            step_slots: Maximum number of steps to execute at the same
+                    time, defaults to the number of CPUs.
+            pilot_pool_size: Number of started pilot containers to
+                    keep ready, 0 disables the pool.
+            state_dir: Directory to keep the site's state in, so that
+                    it can be shared by several server processes and
+                    survives restarts.
+            max_long_polls: Maximum number of requests from other
+                    sites waiting at the same time, 0 disables waiting.
         """
         if owner.kind() != 'party':
             raise ValueError(
@@ -115,6 +192,12 @@ class SiteConfiguration:
         self.client_cert = client_cert
         self.client_key = client_key
         self.loglevel = loglevel
+        self.image_cache_size = image_cache_size
+        self.replication_long_poll = replication_long_poll
+        self.step_slots = step_slots
+        self.pilot_pool_size = pilot_pool_size
+        self.state_dir = state_dir
+        self.max_long_polls = max_long_polls
 
     def client_creds(self) -> Optional[Tuple[Path, Path]]:
         """Get the HTTPS client credentials.
@@ -0,0 +1,323 @@
+"""Storage for site state that outlives a request.
+
+Components that keep track of things across requests, like the assets
+in the asset store or the submitted jobs, keep them in a StateStore
+rather than in plain dictionaries. The default MemoryStateStore keeps
+them in the current process, like a dictionary would. The
+SQLiteStateStore keeps them in an SQLite database in WAL mode instead,
+which can be shared by several server processes on the same machine,
+and which survives restarts.
+
+State is organised in named tables, which map string keys to objects
+of a single type. Objects are stored using the REST API serialisation,
+so any type that can be sent over the API can be stored.
+"""
+import json
+import logging
+from pathlib import Path
+import sqlite3
+from threading import Lock, local
+from typing import Any, Dict, Generic, List, Optional, Type, TypeVar
+
+from mahiru.definitions.identifier import Identifier
+from mahiru.rest.serialization import deserialize, serialize
+
+
+logger = logging.getLogger(__name__)
+
+
+T = TypeVar('T')
+
+
+# Time in seconds to wait for another process to release the database
+_BUSY_TIMEOUT = 30.0
+
+
+class StateTable(Generic[T]):
+    """A table of objects in a StateStore, indexed by key."""
+    def get(self, key: str) -> Optional[T]:
+        """Return the object with the given key, or None."""
+        raise NotImplementedError()
+
+    def insert(self, key: str, value: T) -> bool:
+        """Add an object, unless there already is one with this key.
+
+        Args:
+            key: The key to store the object under.
+            value: The object to store.
+
+        Return:
+            True if it was added, False if the key was already taken.
+        """
+        raise NotImplementedError()
+
+    def put(self, key: str, value: T) -> None:
+        """Store an object, replacing any existing one with this key."""
+        raise NotImplementedError()
+
+    def delete(self, key: str) -> Optional[T]:
+        """Remove an object and return it, or None if it's not there."""
+        raise NotImplementedError()
+
+    def keys(self) -> List[str]:
+        """Return the keys of all objects in the table."""
+        raise NotImplementedError()
+
+
+class StateStore:
+    """Stores tables of objects, and counters."""
+    def table(self, name: str, value_type: Type[T]) -> StateTable[T]:
+        """Return a table of objects.
+
+        Args:
+            name: Name of the table.
+            value_type: Type of the objects in the table, used for
+                    deserialising them.
+        """
+        raise NotImplementedError()
+
+    def next_serial(self, name: str) -> int:
+        """Return the next number from a counter.
+
+        Counters start at 1, and never return the same number twice,
+        also not to different processes sharing a store.
+
+        Args:
+            name: Name of the counter.
+        """
+        raise NotImplementedError()
+
+    def close(self) -> None:
+        """Release resources, call when done."""
+        pass
+
+
+class _MemoryStateTable(StateTable[T]):
+    """A table of objects kept in memory."""
+    def __init__(self) -> None:
+        """Create an empty _MemoryStateTable."""
+        self._lock = Lock()
+        self._objects = dict()      # type: Dict[str, T]
+
+    def get(self, key: str) -> Optional[T]:
+        """Return the object with the given key, or None."""
+        with self._lock:
+            return self._objects.get(key)
+
+    def insert(self, key: str, value: T) -> bool:
+        """Add an object, unless there already is one with this key."""
+        with self._lock:
+            if key in self._objects:
+                return False
+            self._objects[key] = value
+            return True
+
+    def put(self, key: str, value: T) -> None:
+        """Store an object, replacing any existing one with this key."""
+        with self._lock:
+            self._objects[key] = value
+
+    def delete(self, key: str) -> Optional[T]:
+        """Remove an object and return it, or None if it's not there."""
+        with self._lock:
+            return self._objects.pop(key, None)
+
+    def keys(self) -> List[str]:
+        """Return the keys of all objects in the table."""
+        with self._lock:
+            return list(self._objects)
+
+
+class MemoryStateStore(StateStore):
+    """Keeps state in the memory of the current process.
+
+    Objects are stored as-is, so what is retrieved is the same object
+    that was stored.
+    """
+    def __init__(self) -> None:
+        """Create an empty MemoryStateStore."""
+        self._lock = Lock()
+        self._tables = dict()       # type: Dict[str, _MemoryStateTable]
+        self._serials = dict()      # type: Dict[str, int]
+
+    def table(self, name: str, value_type: Type[T]) -> StateTable[T]:
+        """Return a table of objects."""
+        with self._lock:
+            return self._tables.setdefault(name, _MemoryStateTable())
+
+    def next_serial(self, name: str) -> int:
+        """Return the next number from a counter."""
+        with self._lock:
+            serial = self._serials.get(name, 0) + 1
+            self._serials[name] = serial
+            return serial
+
+
+class _SQLiteStateTable(StateTable[T]):
+    """A table of objects kept in an SQLite database."""
+    def __init__(
+            self, store: 'SQLiteStateStore', name: str, value_type: Type[T]
+            ) -> None:
+        """Create a _SQLiteStateTable.
+
+        Args:
+            store: The store containing the table.
+            name: Name of the table.
+            value_type: Type of the objects in the table.
+        """
+        self._store = store
+        self._name = name
+        self._value_type = value_type
+
+    def get(self, key: str) -> Optional[T]:
+        """Return the object with the given key, or None."""
+        row = self._store._connection().execute(
+                'SELECT value FROM objects WHERE tbl = ? AND key = ?',
+                (self._name, key)).fetchone()
+        if row is None:
+            return None
+        return self._decode(row[0])
+
+    def insert(self, key: str, value: T) -> bool:
+        """Add an object, unless there already is one with this key."""
+        cursor = self._store._connection().execute(
+                'INSERT OR IGNORE INTO objects (tbl, key, value)'
+                ' VALUES (?, ?, ?)', (self._name, key, self._encode(value)))
+        return cursor.rowcount == 1
+
+    def put(self, key: str, value: T) -> None:
+        """Store an object, replacing any existing one with this key."""
+        self._store._connection().execute(
+                'INSERT OR REPLACE INTO objects (tbl, key, value)'
+                ' VALUES (?, ?, ?)', (self._name, key, self._encode(value)))
+
+    def delete(self, key: str) -> Optional[T]:
+        """Remove an object and return it, or None if it's not there."""
+        conn = self._store._connection()
+        with self._store._transaction(conn):
+            row = conn.execute(
+                    'SELECT value FROM objects WHERE tbl = ? AND key = ?',
+                    (self._name, key)).fetchone()
+            if row is None:
+                return None
+            conn.execute(
+                    'DELETE FROM objects WHERE tbl = ? AND key = ?',
+                    (self._name, key))
+        return self._decode(row[0])
+
+    def keys(self) -> List[str]:
+        """Return the keys of all objects in the table."""
+        rows = self._store._connection().execute(
+                'SELECT key FROM objects WHERE tbl = ?', (self._name,))
+        return [row[0] for row in rows]
+
+    def _encode(self, value: T) -> str:
+        """Encode an object as a JSON string."""
+        if isinstance(value, str):
+            return json.dumps(value)
+        return json.dumps(serialize(value))
+
+    def _decode(self, value: str) -> T:
+        """Decode an object from a JSON string."""
+        obj_json = json.loads(value)
+        if self._value_type is Identifier:
+            return Identifier(obj_json)     # type: ignore
+        if self._value_type is str:
+            return obj_json     # type: ignore
+        return deserialize(self._value_type, obj_json)
+
+
+class _Transaction:
+    """Context manager for a write transaction."""
+    def __init__(self, conn: sqlite3.Connection) -> None:
+        """Create a _Transaction on the given connection."""
+        self._conn = conn
+
+    def __enter__(self) -> None:
+        """Start the transaction, taking the write lock right away."""
+        self._conn.execute('BEGIN IMMEDIATE')
+
+    def __exit__(self, exc_type: Any, exc_value: Any, tb: Any) -> None:
+        """Commit the transaction, or roll back on an exception."""
+        if exc_type is None:
+            self._conn.execute('COMMIT')
+        else:
+            self._conn.execute('ROLLBACK')
+
+
+class SQLiteStateStore(StateStore):
+    """Keeps state in an SQLite database.
+
+    The database is opened in WAL mode, so that readers in different
+    processes don't block each other or the writer. Each thread gets
+    its own connection, and each operation is a transaction of its own.
+    """
+    def __init__(self, path: Path) -> None:
+        """Create an SQLiteStateStore.
+
+        This creates the database if it doesn't exist yet.
+
+        Args:
+            path: Path of the database file.
+        """
+        self._path = path
+        self._local = local()
+        self._connections_lock = Lock()     # protects the below
+        self._connections = list()          # type: List[sqlite3.Connection]
+
+        conn = self._connection()
+        conn.execute('PRAGMA journal_mode = WAL')
+        with self._transaction(conn):
+            conn.execute(
+                    'CREATE TABLE IF NOT EXISTS objects ('
+                    ' tbl TEXT NOT NULL, key TEXT NOT NULL,'
+                    ' value TEXT NOT NULL, PRIMARY KEY (tbl, key))')
+            conn.execute(
+                    'CREATE TABLE IF NOT EXISTS serials ('
+                    ' name TEXT PRIMARY KEY, value INTEGER NOT NULL)')
+        logger.info(f'Using state database {path}')
+
+    def close(self) -> None:
+        """Close all database connections."""
+        with self._connections_lock:
+            for conn in self._connections:
+                conn.close()
+            self._connections.clear()
+        self._local = local()
+
+    def table(self, name: str, value_type: Type[T]) -> StateTable[T]:
+        """Return a table of objects."""
+        return _SQLiteStateTable(self, name, value_type)
+
+    def next_serial(self, name: str) -> int:
+        """Return the next number from a counter."""
+        conn = self._connection()
+        with self._transaction(conn):
+            conn.execute(
+                    'INSERT OR IGNORE INTO serials (name, value)'
+                    ' VALUES (?, 0)', (name,))
+            conn.execute(
+                    'UPDATE serials SET value = value + 1 WHERE name = ?',
+                    (name,))
+            row = conn.execute(
+                    'SELECT value FROM serials WHERE name = ?',
+                    (name,)).fetchone()
+        return int(row[0])
+
+    def _connection(self) -> sqlite3.Connection:
+        """Return the connection for the current thread."""
+        conn = getattr(self._local, 'conn', None)
+        if conn is None:
+            # isolation_level None means we do transactions ourselves
+            conn = sqlite3.connect(
+                    str(self._path), timeout=_BUSY_TIMEOUT,
+                    isolation_level=None, check_same_thread=False)
+            conn.execute('PRAGMA synchronous = NORMAL')
+            self._local.conn = conn
+            with self._connections_lock:
+                self._connections.append(conn)
+        return conn
+
+    def _transaction(self, conn: sqlite3.Connection) -> _Transaction:
+        """Return a context manager for a write transaction."""
+        return _Transaction(conn)
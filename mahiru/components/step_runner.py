@@ -1,7 +1,20 @@
-"""Components for on-site workflow execution."""
+"""Components for on-site workflow execution.
+
+A JobRun executes the steps of a job that were planned for this site.
+Each step waits in a thread of its own until its inputs are available,
+and then runs as soon as a slot is free. Slots are shared by all jobs
+at the site, so that the number of steps running at the same time is
+limited to what the machine can handle.
+
+Inputs produced by other steps at this site are waited for locally.
+Inputs from other sites are requested from the producing site, which
+holds on to the request until the asset has been stored, so that we
+are notified as soon as it's available rather than having to poll.
+"""
 import logging
-from threading import Thread
-from time import sleep
+import os
+from threading import BoundedSemaphore, Event, Lock, Thread
+import time
 from typing import Any, Dict, List, Optional, Tuple
 
 from mahiru.definitions.identifier import Identifier
@@ -9,6 +22,7 @@ from mahiru.definitions.assets import (
         Asset, ComputeAsset, DataAsset, DataMetadata)
 from mahiru.definitions.interfaces import IDomainAdministrator, IStepRunner
 from mahiru.definitions.workflows import ExecutionRequest, WorkflowStep
+from mahiru.metrics import REGISTRY
 from mahiru.policy.evaluation import (
         PermissionCalculator, PolicyEvaluator)
 from mahiru.rest.site_client import SiteRestClient
@@ -18,6 +32,27 @@ from mahiru.components.asset_store import AssetStore
 logger = logging.getLogger(__name__)
 
 
+# Time (s) the producing site is asked to wait for an input to appear
+_INPUT_WAIT = 25.0
+
+# Time (s) between requests to sites that return without waiting
+_INPUT_POLL_INTERVAL = 0.5
+
+
+_jobs_running = REGISTRY.gauge(
+        'mahiru_jobs_running',
+        'Number of jobs with steps being executed at this site')
+
+_step_wait_seconds = REGISTRY.histogram(
+        'mahiru_step_wait_seconds',
+        'Time steps spent waiting before running, by what they waited'
+        ' for', ['reason'])
+
+_step_seconds = REGISTRY.histogram(
+        'mahiru_step_seconds',
+        'Time taken to execute a step, once its inputs were available')
+
+
 class JobRun(Thread):
     """A run of a job.
 
@@ -30,7 +65,8 @@ class JobRun(Thread):
             domain_administrator: IDomainAdministrator,
             this_site: Identifier,
             request: ExecutionRequest,
-            target_store: AssetStore
+            target_store: AssetStore,
+            slots: Optional[BoundedSemaphore] = None
             ) -> None:
         """Creates a JobRun object.
 
@@ -46,6 +82,8 @@ class JobRun(Thread):
             this_site: The site we're running at.
             request: The job to execute and plan to do it.
             target_store: The asset store to put results into.
+            slots: Limits the number of steps executing at the same
+                    time, no limit if not given.
 
         """
         super().__init__(name='JobAtRunner-{}'.format(this_site))
@@ -59,13 +97,33 @@ class JobRun(Thread):
         self._plan = request.plan
         self._sites = request.plan.step_sites
         self._target_store = target_store
+        self._slots = slots
+
+        # Set when a local step has finished, or the job has failed
+        self._step_done = dict()    # type: Dict[str, Event]
+        self._failed = Event()
+        self._lock = Lock()
+        self._errors = list()       # type: List[str]
 
     def run(self) -> None:
         """Runs the job.
 
-        This executes the steps in the job one at a time, in an order
-        compatible with their dependencies.
+        This executes the steps in the job, running each one as soon as
+        its inputs are available and a slot is free, so that steps that
+        don't depend on each other run concurrently. If a step fails,
+        the steps that are still waiting are abandoned.
+
+        Raises:
+            RuntimeError: If the job is not allowed, or failed.
         """
+        _jobs_running.inc()
+        try:
+            self._run()
+        finally:
+            _jobs_running.dec()
+
+    def _run(self) -> None:
+        """Runs the job, see run()."""
         logger.info('Starting job at {}'.format(self._this_site))
         if not self._permission_calculator.is_legal(self._job, self._plan):
             # for each output we were supposed to produce
@@ -76,65 +134,112 @@ class JobRun(Thread):
 
         id_hashes = self._job.id_hashes()
 
-        steps_to_do = {
+        steps_to_do = [
                 step for step in self._workflow.steps.values()
-                if self._sites[step.name] == self._this_site}
-
-        while len(steps_to_do) > 0:
-            for step in steps_to_do:
-                success = self._try_execute_step(step, id_hashes)
-                if success:
-                    steps_to_do.remove(step)
-                    break
-            else:
-                sleep(0.5)
+                if self._sites[step.name] == self._this_site]
+
+        self._step_done = {step.name: Event() for step in steps_to_do}
+        threads = [
+                Thread(
+                    target=self._run_step_when_ready, args=(step, id_hashes),
+                    name=f'JobStep-{step.name}')
+                for step in steps_to_do]
+
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        if self._failed.is_set():
+            raise RuntimeError(
+                    f'Job at {self._this_site} failed: {self._errors}')
         logger.info('Job at {} done'.format(self._this_site))
 
-    def _try_execute_step(
-            self, step: WorkflowStep, id_hashes: Dict[str, str]
-            ) -> bool:
-        """Try to execute a step, if its inputs are ready.
+    def _run_step_when_ready(
+            self, step: WorkflowStep, id_hashes: Dict[str, str]) -> None:
+        """Wait for a step's inputs and a free slot, then run it.
+
+        Args:
+            step: The step to run.
+            id_hashes: Id hashes for the workflow's items.
+        """
+        try:
+            with _step_wait_seconds.time(reason='inputs'):
+                inputs = self._wait_for_inputs(step, id_hashes)
+            if inputs is None:
+                return
+
+            if self._slots is not None:
+                with _step_wait_seconds.time(reason='slot'):
+                    self._slots.acquire()
+            try:
+                if not self._failed.is_set():
+                    with _step_seconds.time():
+                        self._execute_step(step, inputs, id_hashes)
+            finally:
+                if self._slots is not None:
+                    self._slots.release()
+
+            self._step_done[step.name].set()
+
+        except Exception as e:
+            logger.exception(
+                    f'Job at {self._this_site}: step {step.name} failed')
+            with self._lock:
+                self._errors.append(f'{step.name}: {e}')
+            self._failed.set()
+            # wake up anyone waiting, they'll see that we failed
+            for done in self._step_done.values():
+                done.set()
+
+    def _execute_step(
+            self, step: WorkflowStep, inputs: Dict[str, Asset],
+            id_hashes: Dict[str, str]) -> None:
+        """Execute a step whose inputs are ready.
 
         Supports both container-based and plain steps; if the compute
         asset has an associated image then a container run will be
         attempted, otherwise we'll use the built-in hack.
+
+        Args:
+            step: The step to execute.
+            inputs: Assets for each of the step's inputs.
+            id_hashes: Id hashes for the workflow's items.
         """
-        inputs = self._get_step_inputs(step, id_hashes)
-        if inputs is not None:
-            compute_asset = self._retrieve_compute_asset(step.compute_asset_id)
-            if compute_asset.image_location is not None:
-                logger.info('Job at {} executing container step {}'.format(
-                    self._this_site, step))
-
-                output_bases = self._get_output_bases(step)
-                step_subjob = self._job.subjob(step)
-                result = self._domain_administrator.execute_step(
-                        step, inputs, compute_asset, output_bases, id_hashes,
-                        step_subjob)
-
-                for name, path in result.files.items():
-                    result_item = '{}.{}'.format(step.name, name)
-                    result_id_hash = id_hashes[result_item]
-                    metadata = DataMetadata(step_subjob, result_item)
-                    asset = DataAsset(
-                            Identifier.from_id_hash(result_id_hash),
-                            None, str(path), metadata)
-                    self._target_store.store(asset, True)
-
-                result.cleanup()
-
-            else:
-                self._run_step(step, inputs, compute_asset, id_hashes)
-        return inputs is not None
-
-    def _get_step_inputs(
+        compute_asset = self._retrieve_compute_asset(step.compute_asset_id)
+        if compute_asset.image_location is not None:
+            logger.info('Job at {} executing container step {}'.format(
+                self._this_site, step))
+
+            output_bases = self._get_output_bases(step)
+            step_subjob = self._job.subjob(step)
+            result = self._domain_administrator.execute_step(
+                    step, inputs, compute_asset, output_bases, id_hashes,
+                    step_subjob)
+
+            for name, path in result.files.items():
+                result_item = '{}.{}'.format(step.name, name)
+                result_id_hash = id_hashes[result_item]
+                metadata = DataMetadata(step_subjob, result_item)
+                asset = DataAsset(
+                        Identifier.from_id_hash(result_id_hash),
+                        None, str(path), metadata)
+                self._target_store.store(asset, True)
+
+            result.cleanup()
+
+        else:
+            self._run_step(step, inputs, compute_asset, id_hashes)
+
+    def _wait_for_inputs(
             self, step: WorkflowStep, id_hashes: Dict[str, str]
             ) -> Optional[Dict[str, Asset]]:
-        """Find and obtain inputs for the step.
+        """Wait for the inputs of a step and obtain them.
 
-        If all inputs are available, returns a dictionary mapping their
-        names to their values. If at least one input is not yet
-        available, returns None.
+        Inputs produced by steps at this site are obtained once those
+        steps are done. Other inputs are requested from the site that
+        has them or will produce them, which replies when they are
+        available.
 
         Args:
             step: The step to obtain inputs for.
@@ -142,27 +247,57 @@ class JobRun(Thread):
 
         Return:
             A dictionary keyed by input name with corresponding
-            assets.
+            assets, or None if the job failed while we were waiting.
 
         """
-        step_input_data = dict()
+        step_input_data = dict()    # type: Dict[str, Asset]
         for inp_name, inp_source in step.inputs.items():
+            if '.' in inp_source:
+                local_step_done = self._step_done.get(inp_source.split('.')[0])
+                if local_step_done is not None:
+                    local_step_done.wait()
+
             source_site, source_asset = self._source(inp_source, id_hashes)
             logger.info('Job at {} getting input {} from site {}'.format(
                 self._this_site, source_asset, source_site))
+            asset = self._wait_for_asset(source_site, source_asset)
+            if asset is None:
+                return None
+
+            step_input_data[inp_name] = asset
+            logger.info('Job at {} found input {} available.'.format(
+                self._this_site, source_asset))
+            logger.info('Metadata: {}'.format(asset.metadata))
+
+        return step_input_data
+
+    def _wait_for_asset(
+            self, site: Identifier, asset_id: Identifier) -> Optional[Asset]:
+        """Obtain an asset from a site, waiting until it's available.
+
+        If the site returns straight away rather than waiting for the
+        asset, e.g. because it runs an older version, we fall back to
+        polling.
+
+        Args:
+            site: The site to get the asset from.
+            asset_id: The asset to get.
+
+        Return:
+            The asset, or None if the job failed while we were waiting.
+        """
+        while not self._failed.is_set():
+            start = time.monotonic()
             try:
-                asset = self._site_rest_client.retrieve_asset(
-                        source_site, source_asset)
-                step_input_data[inp_name] = asset
-                logger.info('Job at {} found input {} available.'.format(
-                    self._this_site, source_asset))
-                logger.info('Metadata: {}'.format(asset.metadata))
+                return self._site_rest_client.retrieve_asset(
+                        site, asset_id, _INPUT_WAIT)
             except KeyError:
                 logger.info(f'Job at {self._this_site} found input'
-                            f' {source_asset} not yet available.')
-                return None
+                            f' {asset_id} not yet available.')
 
-        return step_input_data
+            if time.monotonic() - start < _INPUT_WAIT / 2:
+                self._failed.wait(_INPUT_POLL_INTERVAL)
+        return None
 
     def _get_output_bases(self, step: WorkflowStep) -> Dict[str, Asset]:
         """Find and obtain output base assets for the compute asset.
@@ -257,7 +392,8 @@ class StepRunner(IStepRunner):
             site_rest_client: SiteRestClient,
             policy_evaluator: PolicyEvaluator,
             domain_administrator: IDomainAdministrator,
-            target_store: AssetStore) -> None:
+            target_store: AssetStore,
+            step_slots: Optional[int] = None) -> None:
         """Creates a StepRunner.
 
         Args:
@@ -266,12 +402,19 @@ class StepRunner(IStepRunner):
             policy_evaluator: A PolicyEvaluator to use.
             domain_administrator: A domain administrator to use.
             target_store: An AssetStore to store result in.
+            step_slots: Maximum number of steps to execute at the same
+                    time, across all jobs. Defaults to the number of
+                    CPUs.
         """
+        if step_slots is None:
+            step_slots = os.cpu_count() or 1
+
         self._site = site
         self._site_rest_client = site_rest_client
         self._permission_calculator = PermissionCalculator(policy_evaluator)
         self._domain_administrator = domain_administrator
         self._target_store = target_store
+        self._slots = BoundedSemaphore(step_slots)
 
     def execute_request(self, request: ExecutionRequest) -> None:
         """Start a job in a separate thread.
@@ -283,5 +426,5 @@ class StepRunner(IStepRunner):
         run = JobRun(
                 self._site_rest_client, self._permission_calculator,
                 self._domain_administrator, self._site, request,
-                self._target_store)
+                self._target_store, self._slots)
         run.start()
@@ -1,4 +1,5 @@
 """Definitions supporting direct container connections."""
+from typing import Optional
 
 
 class ConnectionRequest:
@@ -74,8 +75,15 @@ class WireGuardConnectionInfo(ConnectionInfo):
     This is the response to a ConnectionRequest. It has a connection
     id, through which the initiator can reference the connection later,
     and the endpoint on the responder/server side.
+
+    It also has the net the server has set up the connection for. This
+    is normally the one in the request, but a server which multiplexes
+    connections needs nets to be unique on its side, and will assign a
+    different one if the requested net is already in use.
     """
-    def __init__(self, conn_id: str, endpoint: WireGuardEndpoint) -> None:
+    def __init__(
+            self, conn_id: str, endpoint: WireGuardEndpoint,
+            net: Optional[int] = None) -> None:
         """Create a ConnectionInfo.
 
         Args:
@@ -83,6 +91,10 @@ class WireGuardConnectionInfo(ConnectionInfo):
                     digits.
             endpoint: The requested-side (server-side) WireGuard
                     endpoint to use.
+            net: The network the server uses for the connection, or
+                    None if it didn't say, in which case it's the one
+                    from the request.
         """
         self.conn_id = conn_id
         self.endpoint = endpoint
+        self.net = net
@@ -1,7 +1,9 @@
 """Widely used interface definitions."""
 from datetime import datetime
 from pathlib import Path
-from typing import Dict, Generic, Iterable, Set, Tuple, Type, TypeVar
+from typing import (
+        Dict, FrozenSet, Generic, Iterable, Optional, Set, Tuple, Type,
+        TypeVar)
 
 from mahiru.definitions.connections import ConnectionInfo, ConnectionRequest
 from mahiru.definitions.identifier import Identifier
@@ -11,6 +13,7 @@ from mahiru.definitions.registry import (
         PartyDescription, RegisteredObject, SiteDescription)
 from mahiru.definitions.workflows import (
         ExecutionRequest, Job, WorkflowStep)
+from mahiru.policy.index import RuleIndex
 
 
 T = TypeVar('T')
@@ -25,6 +28,7 @@ class IReplicaUpdate(Generic[T]):
         valid_until: Time until which the new version is valid.
         created: Set of objects that were created.
         deleted: Set of objects that were deleted.
+        partial: Whether there are more changes after to_version.
     """
     ReplicatedType = None      # type: Type[T]
 
@@ -33,17 +37,25 @@ class IReplicaUpdate(Generic[T]):
     valid_until = None      # type: datetime
     created = None          # type: Set[T]
     deleted = None          # type: Set[T]
+    partial = None          # type: bool
 
 
 class IReplicationService(Generic[T]):
     """Generic interface for replication sources."""
-    def get_updates_since(self, from_version: int) -> IReplicaUpdate[T]:
+    def get_updates_since(
+            self, from_version: int, wait: float = 0.0,
+            limit: Optional[int] = None
+            ) -> IReplicaUpdate[T]:
         """Return a set of objects modified since the given version.
 
         Args:
             from_version: A version received from a previous call to
                     this function, or 0 to get an update for a
                     fresh replica.
+            wait: If there are no changes since from_version, wait at
+                    most this many seconds for one to happen.
+            limit: If given, advance by at most this many versions,
+                    returning a partial update if there are more.
 
         Return:
             An update from the given version to a newer version.
@@ -93,10 +105,30 @@ class IRegistration:
 
 class IPolicyCollection:
     """Provides policies to a PolicyEvaluator."""
+    # Index made by the default rule_index(), and the rules it has
+    _default_index = None   # type: Optional[Tuple[FrozenSet[Rule], RuleIndex]]
+
     def policies(self) -> Iterable[Rule]:
         """Returns an iterable collection of rules."""
         raise NotImplementedError()
 
+    def rule_index(self) -> RuleIndex:
+        """Returns an up-to-date index of the rules.
+
+        This default implementation indexes the result of policies(),
+        and keeps the index until policies() returns different rules,
+        so that results cached for it remain valid. It still compares
+        all the rules on every call, so collections that change over
+        time should keep an index up to date incrementally instead.
+        """
+        rules = list(self.policies())
+        rule_set = frozenset(rules)
+        index = self._default_index
+        if index is None or index[0] != rule_set:
+            index = rule_set, RuleIndex(rules)
+            self._default_index = index
+        return index[1]
+
 
 class IAssetStore:
     """An interface for asset stores."""
@@ -129,13 +161,16 @@ class IAssetStore:
         """
         raise NotImplementedError()
 
-    def retrieve(self, asset_id: Identifier, requester: Identifier
-                 ) -> Asset:
+    def retrieve(
+            self, asset_id: Identifier, requester: Identifier,
+            wait: float = 0.0) -> Asset:
         """Retrieves an asset.
 
         Args:
             asset_id: ID of the asset to retrieve.
             requester: Name of the site making the request.
+            wait: If the asset isn't here yet, wait at most this many
+                    seconds for it to be stored.
 
         Return:
             The asset object with asset_id.
@@ -146,6 +181,20 @@ class IAssetStore:
         """
         raise NotImplementedError()
 
+    def image_digest(self, asset_id: Identifier) -> bytes:
+        """Returns the SHA-256 digest of an asset's image file.
+
+        This does not check permissions, call retrieve() for that.
+
+        Args:
+            asset_id: ID of the asset whose image to get the digest of.
+
+        Raises:
+            KeyError: If there's no image for this asset.
+
+        """
+        raise NotImplementedError()
+
     def serve(
             self, asset_id: Identifier, request: ConnectionRequest,
             requester: Identifier) -> ConnectionInfo:
@@ -254,14 +303,16 @@ class IDomainAdministrator:
         raise NotImplementedError()
 
     def serve_asset(
-            self, asset: Asset, connection_request: ConnectionRequest
-            ) -> ConnectionInfo:
+            self, asset: Asset, connection_request: ConnectionRequest,
+            image_digest: Optional[bytes] = None) -> ConnectionInfo:
         """Serve an asset as a VPN-reachable service.
 
         Args:
             asset: The asset to serve.
             connection_request: A description of the remote end of the
                 VPN connection to set up.
+            image_digest: SHA-256 digest of the asset's image file, if
+                known, see IAssetStore.image_digest().
 
         Return:
             A connection info object describing how to connect to the
@@ -1,9 +1,92 @@
 """Support for cryptographically signed objects."""
+from collections import OrderedDict
+from hashlib import sha256
+from threading import Lock
+from typing import Dict, Optional, Tuple
+
 from cryptography.exceptions import InvalidSignature
 from cryptography.hazmat.primitives import hashes
 from cryptography.hazmat.primitives.asymmetric import padding
 from cryptography.hazmat.primitives.asymmetric.ed25519 import (
         Ed25519PrivateKey, Ed25519PublicKey)
+from cryptography.hazmat.primitives.serialization import (
+        Encoding, PublicFormat)
+
+from mahiru.metrics import REGISTRY
+
+
+_signature_cache_requests = REGISTRY.counter(
+        'mahiru_signature_cache_requests_total',
+        'Signature verifications, by whether they were cached',
+        ['result'])
+
+
+# Raw public key, message digest, signature
+_CacheKey = Tuple[bytes, bytes, bytes]
+
+
+def key_fingerprint(key: Ed25519PublicKey) -> bytes:
+    """Return bytes identifying a public key.
+
+    For Ed25519 keys, this is simply the raw 32-byte public key.
+    """
+    return key.public_bytes(Encoding.Raw, PublicFormat.Raw)
+
+
+class SignatureCache:
+    """Remembers which signatures were found to be valid.
+
+    Only valid signatures are stored, keyed by the key, a digest of the
+    signed message, and the signature itself, so a changed message or
+    signature is never mistaken for one that was verified. If the cache
+    is full, the least recently used entry is removed.
+    """
+    def __init__(self, max_size: int = 100000) -> None:
+        """Create a SignatureCache.
+
+        Args:
+            max_size: Maximum number of signatures to remember.
+        """
+        self._max_size = max_size
+        self._lock = Lock()
+        self._cache = OrderedDict()  # type: Dict[_CacheKey, None]
+
+    def verify(
+            self, key: Ed25519PublicKey, signature: bytes, message: bytes,
+            fingerprint: Optional[bytes] = None) -> bool:
+        """Verify a signature, using the cache if possible.
+
+        Args:
+            key: The public key to use.
+            signature: The signature to check.
+            message: The message that was signed.
+            fingerprint: The key's fingerprint, if already known, to
+                    save recalculating it.
+
+        Return:
+            True iff the signature is valid.
+        """
+        if fingerprint is None:
+            fingerprint = key_fingerprint(key)
+        cache_key = (fingerprint, sha256(message).digest(), signature)
+
+        with self._lock:
+            if cache_key in self._cache:
+                self._cache.move_to_end(cache_key)
+                _signature_cache_requests.inc(result='hit')
+                return True
+
+        _signature_cache_requests.inc(result='miss')
+        try:
+            key.verify(signature, message)
+        except InvalidSignature:
+            return False
+
+        with self._lock:
+            self._cache[cache_key] = None
+            while len(self._cache) > self._max_size:
+                self._cache.popitem(last=False)
+        return True
 
 
 class Signable:
@@ -19,11 +102,17 @@ class Signable:
         message = self.signing_representation()
         self.signature = key.sign(message)
 
-    def has_valid_signature(self, key: Ed25519PublicKey) -> bool:
+    def has_valid_signature(
+            self, key: Ed25519PublicKey,
+            cache: Optional[SignatureCache] = None,
+            fingerprint: Optional[bytes] = None) -> bool:
         """Verify the signature on the object.
 
         Args:
             key: The public key to use.
+            cache: A cache of verified signatures to use, if any.
+            fingerprint: The key's fingerprint, if known and using a
+                    cache.
 
         Return:
             True iff there is a valid signature.
@@ -32,6 +121,9 @@ class Signable:
             return False
 
         message = self.signing_representation()
+        if cache is not None:
+            return cache.verify(key, self.signature, message, fingerprint)
+
         try:
             key.verify(self.signature, message)
             return True
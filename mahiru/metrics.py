@@ -0,0 +1,466 @@
+"""In-process metrics for monitoring and profiling.
+
+This is a small collection of Prometheus-style metrics: counters,
+which only go up, gauges, which can be set to any value, and
+histograms, which count observations in a set of buckets. Each metric
+has a name, a help text, and optionally a set of label names. Values
+are kept separately for each combination of label values.
+
+Metrics are created through a Registry, usually the global one in
+REGISTRY, which returns the existing metric if it has been created
+before, so that modules can simply declare the metrics they use. A
+Registry can render its metrics in the Prometheus text format, for
+scraping by a monitoring system.
+
+Updating a metric takes a lock and a dictionary lookup, so they're
+cheap enough to update on every request.
+"""
+from bisect import bisect_left
+import math
+from threading import Lock
+import time
+from typing import Any, Dict, Iterable, List, Sequence, Tuple
+
+
+LabelValues = Tuple[str, ...]
+
+
+# Media type of the Prometheus text format
+CONTENT_TYPE = 'text/plain; version=0.0.4; charset=utf-8'
+
+
+# Bucket upper bounds for latencies, in seconds
+DEFAULT_BUCKETS = (
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+        0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0)
+
+
+class Metric:
+    """Base class for metrics."""
+    def __init__(
+            self, name: str, help: str, labels: Sequence[str] = ()
+            ) -> None:
+        """Create a Metric.
+
+        Args:
+            name: Name of the metric, e.g. mahiru_requests_total.
+            help: A description of what is being measured.
+            labels: Names of the labels of this metric.
+        """
+        self.name = name
+        self.help = help
+        self.labels = tuple(labels)
+        self._lock = Lock()
+
+    def _label_values(self, labels: Dict[str, str]) -> LabelValues:
+        """Convert a dict of labels to a tuple of values.
+
+        Args:
+            labels: Label values by name, must match our labels.
+
+        Raises:
+            RuntimeError: If the labels do not match.
+        """
+        if set(labels) != set(self.labels):
+            raise RuntimeError(
+                    f'Metric {self.name} has labels {self.labels}, got'
+                    f' {tuple(labels)}')
+        return tuple(str(labels[name]) for name in self.labels)
+
+    def remove(self, **labels: str) -> None:
+        """Remove the values for a set of label values.
+
+        Use this to avoid keeping data for e.g. connections that no
+        longer exist.
+
+        Args:
+            labels: Values for the labels of the data to remove.
+        """
+        key = self._label_values(labels)
+        with self._lock:
+            self._remove(key)
+
+    def _remove(self, key: LabelValues) -> None:
+        """Remove the data for the given label values.
+
+        Must be called with the lock held.
+        """
+        raise NotImplementedError()
+
+    def render(self) -> List[str]:
+        """Return lines describing this metric in Prometheus format."""
+        raise NotImplementedError()
+
+    def _header(self, kind: str) -> List[str]:
+        """Return the HELP and TYPE lines for this metric."""
+        help = self.help.replace('\\', '\\\\').replace('\n', '\\n')
+        return [
+                f'# HELP {self.name} {help}',
+                f'# TYPE {self.name} {kind}']
+
+    def _sample_line(
+            self, name: str, key: LabelValues, value: float,
+            extra: Sequence[Tuple[str, str]] = ()) -> str:
+        """Return a line with a single sample.
+
+        Args:
+            name: Name of the sample, the metric name plus a suffix.
+            key: Values of the metric's labels.
+            value: The value of the sample.
+            extra: Additional labels, e.g. a histogram bucket bound.
+        """
+        labels = list(zip(self.labels, key)) + list(extra)
+        if not labels:
+            return f'{name} {_format_value(value)}'
+        label_str = ','.join(
+                f'{label}="{_escape_label_value(label_value)}"'
+                for label, label_value in labels)
+        return f'{name}{{{label_str}}} {_format_value(value)}'
+
+
+class Counter(Metric):
+    """A value that only goes up."""
+    def __init__(
+            self, name: str, help: str, labels: Sequence[str] = ()
+            ) -> None:
+        """Create a Counter.
+
+        Args:
+            name: Name of the metric, should end in _total.
+            help: A description of what is being counted.
+            labels: Names of the labels of this metric.
+        """
+        super().__init__(name, help, labels)
+        self._values = dict()       # type: Dict[LabelValues, float]
+
+    def inc(self, amount: float = 1.0, **labels: str) -> None:
+        """Increment the counter.
+
+        Args:
+            amount: Amount to increment by, must not be negative.
+            labels: Values for the labels of this counter.
+        """
+        if amount < 0.0:
+            raise RuntimeError('Counters can only be incremented')
+        key = self._label_values(labels)
+        with self._lock:
+            self._values[key] = self._values.get(key, 0.0) + amount
+
+    def value(self, **labels: str) -> float:
+        """Return the current value for the given labels."""
+        key = self._label_values(labels)
+        with self._lock:
+            return self._values.get(key, 0.0)
+
+    def samples(self) -> List[Tuple[LabelValues, float]]:
+        """Return the current values for all label combinations."""
+        with self._lock:
+            return sorted(self._values.items())
+
+    def _remove(self, key: LabelValues) -> None:
+        """Remove the value for the given label values."""
+        self._values.pop(key, None)
+
+    def render(self) -> List[str]:
+        """Return lines describing this metric in Prometheus format."""
+        return self._header('counter') + [
+                self._sample_line(self.name, key, value)
+                for key, value in self.samples()]
+
+
+class Gauge(Metric):
+    """A value that can go up and down."""
+    def __init__(
+            self, name: str, help: str, labels: Sequence[str] = ()
+            ) -> None:
+        """Create a Gauge.
+
+        Args:
+            name: Name of the metric.
+            help: A description of what is being measured.
+            labels: Names of the labels of this metric.
+        """
+        super().__init__(name, help, labels)
+        self._values = dict()       # type: Dict[LabelValues, float]
+
+    def set(self, value: float, **labels: str) -> None:
+        """Set the gauge to a value.
+
+        Args:
+            value: The new value.
+            labels: Values for the labels of this gauge.
+        """
+        key = self._label_values(labels)
+        with self._lock:
+            self._values[key] = value
+
+    def inc(self, amount: float = 1.0, **labels: str) -> None:
+        """Increase the gauge.
+
+        Args:
+            amount: Amount to add, may be negative.
+            labels: Values for the labels of this gauge.
+        """
+        key = self._label_values(labels)
+        with self._lock:
+            self._values[key] = self._values.get(key, 0.0) + amount
+
+    def dec(self, amount: float = 1.0, **labels: str) -> None:
+        """Decrease the gauge.
+
+        Args:
+            amount: Amount to subtract.
+            labels: Values for the labels of this gauge.
+        """
+        self.inc(-amount, **labels)
+
+    def value(self, **labels: str) -> float:
+        """Return the current value for the given labels."""
+        key = self._label_values(labels)
+        with self._lock:
+            return self._values.get(key, 0.0)
+
+    def samples(self) -> List[Tuple[LabelValues, float]]:
+        """Return the current values for all label combinations."""
+        with self._lock:
+            return sorted(self._values.items())
+
+    def _remove(self, key: LabelValues) -> None:
+        """Remove the value for the given label values."""
+        self._values.pop(key, None)
+
+    def render(self) -> List[str]:
+        """Return lines describing this metric in Prometheus format."""
+        return self._header('gauge') + [
+                self._sample_line(self.name, key, value)
+                for key, value in self.samples()]
+
+
+class HistogramData:
+    """Observations of a histogram for one set of label values.
+
+    Attributes:
+        buckets: Number of observations in each bucket, not
+                cumulative, with an extra one at the end for
+                observations larger than the last bound.
+        count: Total number of observations.
+        sum: Sum of all observed values.
+    """
+    def __init__(self, num_buckets: int) -> None:
+        """Create an empty HistogramData.
+
+        Args:
+            num_buckets: Number of bucket bounds of the histogram.
+        """
+        self.buckets = [0] * (num_buckets + 1)
+        self.count = 0
+        self.sum = 0.0
+
+
+class Histogram(Metric):
+    """Counts observations in buckets by value."""
+    def __init__(
+            self, name: str, help: str, labels: Sequence[str] = (),
+            buckets: Iterable[float] = DEFAULT_BUCKETS) -> None:
+        """Create a Histogram.
+
+        Args:
+            name: Name of the metric, e.g. mahiru_latency_seconds.
+            help: A description of what is being measured.
+            labels: Names of the labels of this metric.
+            buckets: Upper bounds of the buckets, in increasing order.
+        """
+        super().__init__(name, help, labels)
+        self.bounds = tuple(sorted(buckets))
+        self._data = dict()         # type: Dict[LabelValues, HistogramData]
+
+    def observe(self, value: float, **labels: str) -> None:
+        """Record an observation.
+
+        Args:
+            value: The observed value.
+            labels: Values for the labels of this histogram.
+        """
+        key = self._label_values(labels)
+        bucket = bisect_left(self.bounds, value)
+        with self._lock:
+            data = self._data.get(key)
+            if data is None:
+                data = HistogramData(len(self.bounds))
+                self._data[key] = data
+            data.buckets[bucket] += 1
+            data.count += 1
+            data.sum += value
+
+    def time(self, **labels: str) -> '_Timer':
+        """Return a context manager that observes its duration.
+
+        Use as ``with histogram.time(): ...`` to record the time taken
+        by the block, in seconds.
+
+        Args:
+            labels: Values for the labels of this histogram.
+        """
+        return _Timer(self, labels)
+
+    def count(self, **labels: str) -> int:
+        """Return the number of observations for the given labels."""
+        key = self._label_values(labels)
+        with self._lock:
+            data = self._data.get(key)
+            return data.count if data is not None else 0
+
+    def samples(self) -> List[Tuple[LabelValues, HistogramData]]:
+        """Return copies of the data for all label combinations."""
+        result = list()     # type: List[Tuple[LabelValues, HistogramData]]
+        with self._lock:
+            for key, data in sorted(self._data.items()):
+                copy = HistogramData(len(self.bounds))
+                copy.buckets = list(data.buckets)
+                copy.count = data.count
+                copy.sum = data.sum
+                result.append((key, copy))
+        return result
+
+    def _remove(self, key: LabelValues) -> None:
+        """Remove the data for the given label values."""
+        self._data.pop(key, None)
+
+    def render(self) -> List[str]:
+        """Return lines describing this metric in Prometheus format."""
+        lines = self._header('histogram')
+        for key, data in self.samples():
+            total = 0
+            for bound, count in zip(self.bounds, data.buckets):
+                total += count
+                lines.append(self._sample_line(
+                        f'{self.name}_bucket', key, total,
+                        [('le', _format_value(bound))]))
+            lines.append(self._sample_line(
+                    f'{self.name}_bucket', key, data.count,
+                    [('le', '+Inf')]))
+            lines.append(self._sample_line(f'{self.name}_sum', key, data.sum))
+            lines.append(self._sample_line(
+                    f'{self.name}_count', key, data.count))
+        return lines
+
+
+class _Timer:
+    """Context manager which observes the time it was active."""
+    def __init__(self, histogram: Histogram, labels: Dict[str, str]) -> None:
+        """Create a _Timer.
+
+        Args:
+            histogram: Histogram to record the duration in.
+            labels: Values for the labels of the histogram.
+        """
+        self._histogram = histogram
+        self._labels = labels
+        self._start = 0.0
+
+    def __enter__(self) -> None:
+        """Start timing."""
+        self._start = time.perf_counter()
+
+    def __exit__(self, exc_type: Any, exc_value: Any, tb: Any) -> None:
+        """Stop timing and record the duration."""
+        self._histogram.observe(
+                time.perf_counter() - self._start, **self._labels)
+
+
+class Registry:
+    """Keeps track of a set of metrics."""
+    def __init__(self) -> None:
+        """Create an empty Registry."""
+        self._lock = Lock()
+        self._metrics = dict()      # type: Dict[str, Metric]
+
+    def counter(
+            self, name: str, help: str, labels: Sequence[str] = ()
+            ) -> Counter:
+        """Get or create a counter.
+
+        Args:
+            name: Name of the counter.
+            help: A description of what is being counted.
+            labels: Names of the labels of the counter.
+        """
+        metric = self._get_or_add(name, Counter(name, help, labels))
+        if not isinstance(metric, Counter):
+            raise RuntimeError(f'Metric {name} is not a Counter')
+        return metric
+
+    def gauge(
+            self, name: str, help: str, labels: Sequence[str] = ()
+            ) -> Gauge:
+        """Get or create a gauge.
+
+        Args:
+            name: Name of the gauge.
+            help: A description of what is being measured.
+            labels: Names of the labels of the gauge.
+        """
+        metric = self._get_or_add(name, Gauge(name, help, labels))
+        if not isinstance(metric, Gauge):
+            raise RuntimeError(f'Metric {name} is not a Gauge')
+        return metric
+
+    def histogram(
+            self, name: str, help: str, labels: Sequence[str] = (),
+            buckets: Iterable[float] = DEFAULT_BUCKETS) -> Histogram:
+        """Get or create a histogram.
+
+        Args:
+            name: Name of the histogram.
+            help: A description of what is being measured.
+            labels: Names of the labels of the histogram.
+            buckets: Upper bounds of the buckets, in increasing order.
+        """
+        metric = self._get_or_add(
+                name, Histogram(name, help, labels, buckets))
+        if not isinstance(metric, Histogram):
+            raise RuntimeError(f'Metric {name} is not a Histogram')
+        return metric
+
+    def metrics(self) -> List[Metric]:
+        """Return all registered metrics, sorted by name."""
+        with self._lock:
+            return [self._metrics[name] for name in sorted(self._metrics)]
+
+    def render(self) -> str:
+        """Return all metrics in the Prometheus text format."""
+        lines = list()      # type: List[str]
+        for metric in self.metrics():
+            lines.extend(metric.render())
+        return '\n'.join(lines) + '\n'
+
+    def _get_or_add(self, name: str, metric: Metric) -> Metric:
+        """Return the metric with the given name, adding it if needed.
+
+        Args:
+            name: Name of the metric.
+            metric: Metric to add if there isn't one by this name.
+        """
+        with self._lock:
+            if name not in self._metrics:
+                self._metrics[name] = metric
+            return self._metrics[name]
+
+
+def _format_value(value: float) -> str:
+    """Format a sample value for the Prometheus text format."""
+    if math.isnan(value):
+        return 'NaN'
+    if math.isinf(value):
+        return '+Inf' if value > 0.0 else '-Inf'
+    return repr(float(value))
+
+
+def _escape_label_value(value: str) -> str:
+    """Escape a label value for the Prometheus text format."""
+    return (
+            value.replace('\\', '\\\\').replace('"', '\\"')
+            .replace('\n', '\\n'))
+
+
+REGISTRY = Registry()
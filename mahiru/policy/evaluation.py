@@ -1,20 +1,40 @@
 """Components for evaluating workflow permissions."""
+from collections import OrderedDict
+from hashlib import sha256
+from threading import Lock
+import time
 from typing import (
-        Callable, Dict, Iterable, List, Optional, Set, Union, Tuple, Type,
-        TypeVar)
+        Callable, Dict, Hashable, Iterable, List, Optional, Set, Union, Tuple,
+        Type, TypeVar)
 
 from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.interfaces import IPolicyCollection
 from mahiru.definitions.workflows import Job, Plan, Workflow, WorkflowStep
+from mahiru.metrics import REGISTRY
+from mahiru.policy.index import RuleIndex
 from mahiru.policy.rules import (
         GroupingRule, InAssetCategory, InAssetCollection, InPartyCategory,
-        InSiteCategory, MayAccess, MayUse, ResultOfIn, ResultOfDataIn,
-        ResultOfComputeIn)
+        InSiteCategory)
 
 
 _GroupingRule = TypeVar('_GroupingRule', bound=GroupingRule)
 
 
+_permission_cache_requests = REGISTRY.counter(
+        'mahiru_permission_cache_requests_total',
+        'Job permission calculations, by whether they were cached',
+        ['result'])
+
+_permission_cache_invalidations = REGISTRY.counter(
+        'mahiru_permission_cache_invalidations_total',
+        'Times the permission cache was cleared due to a policy change')
+
+_policy_evaluation_seconds = REGISTRY.histogram(
+        'mahiru_policy_evaluation_seconds',
+        'Time taken to evaluate policies for a job, by operation',
+        ['operation'])
+
+
 class Permissions:
     """Represents permissions for an asset."""
     def __init__(self, sets: Optional[List[Set[Identifier]]] = None) -> None:
@@ -33,15 +53,119 @@ class Permissions:
         return 'Permissions({})'.format(repr(self._sets))
 
 
+class PermissionCache:
+    """Keeps calculated permissions of recently seen jobs.
+
+    Entries are valid for a single version of the policies. When a
+    different version is seen, the cache is cleared. If the cache is
+    full, the least recently used entry is removed.
+    """
+    def __init__(self, max_size: int) -> None:
+        """Create a PermissionCache.
+
+        Args:
+            max_size: Maximum number of jobs to keep permissions for,
+                    0 disables caching.
+        """
+        self._max_size = max_size
+        self._lock = Lock()
+        self._version = None    # type: Optional[Hashable]
+        self._cache = OrderedDict()  # type: Dict[str, Dict[str, Permissions]]
+
+    def get(
+            self, key: str, version: Hashable
+            ) -> Optional[Dict[str, Permissions]]:
+        """Look up permissions for a job.
+
+        Args:
+            key: Key of the job, see job_key().
+            version: Current version of the policies.
+
+        Return:
+            A copy of the cached permissions, or None if not found.
+        """
+        with self._lock:
+            if version != self._version:
+                if self._cache:
+                    _permission_cache_invalidations.inc()
+                self._cache.clear()
+                self._version = version
+
+            permissions = self._cache.pop(key, None)
+            if permissions is None:
+                _permission_cache_requests.inc(result='miss')
+                return None
+
+            _permission_cache_requests.inc(result='hit')
+            self._cache[key] = permissions
+            return dict(permissions)
+
+    def put(
+            self, key: str, version: Hashable,
+            permissions: Dict[str, Permissions]) -> None:
+        """Store permissions for a job.
+
+        Args:
+            key: Key of the job, see job_key().
+            version: Version of the policies used to calculate them.
+            permissions: The permissions to store.
+        """
+        with self._lock:
+            if version != self._version or self._max_size <= 0:
+                return
+
+            self._cache[key] = dict(permissions)
+            while len(self._cache) > self._max_size:
+                del self._cache[next(iter(self._cache))]
+
+    @staticmethod
+    def job_key(job: Job) -> str:
+        """Return a key identifying a job for permission purposes.
+
+        This covers everything the permissions depend on, i.e. the
+        workflow structure, inputs, compute assets and output bases,
+        but not the submitter.
+
+        Args:
+            job: The job to calculate a key for.
+        """
+        key = sha256()
+        for item, id_hash in sorted(job.id_hashes().items()):
+            key.update(f'{item}={id_hash};'.encode('utf-8'))
+
+        for name, step in sorted(job.workflow.steps.items()):
+            key.update(f'{name}:{step.compute_asset_id};'.encode('utf-8'))
+            for output, base in sorted(step.outputs.items()):
+                key.update(f'{name}.@{output}={base};'.encode('utf-8'))
+        return key.hexdigest()
+
+
 class PolicyEvaluator:
-    """Interprets policies to support planning and execution."""
-    def __init__(self, policy_collection: IPolicyCollection) -> None:
+    """Interprets policies to support planning and execution.
+
+    Attributes:
+        permission_cache: Cache for job permissions, shared by all the
+                PermissionCalculators using this evaluator.
+    """
+    def __init__(
+            self, policy_collection: IPolicyCollection,
+            permission_cache_size: int = 1024) -> None:
         """Create a PolicyEvaluator.
 
         Args:
             policy_collection: A collections of policies to evaluate.
+            permission_cache_size: Number of jobs to cache
+                    permissions for.
         """
         self._policy_collection = policy_collection
+        self.permission_cache = PermissionCache(permission_cache_size)
+
+    def policy_version(self) -> Hashable:
+        """Return the current version of the policies.
+
+        This changes whenever the policies do.
+        """
+        return self._policy_collection.rule_index().version()
 
     def permissions_for_asset(self, asset: Identifier) -> Permissions:
         """Returns permissions for the given asset.
@@ -52,9 +176,10 @@ class PolicyEvaluator:
         Args:
             asset: The asset to get permissions for.
         """
+        index = self._policy_collection.rule_index()
         result = Permissions()
         result._sets = [self._equivalent_objects(
-            InAssetCollection, 'up', asset)]
+            index, InAssetCollection, 'up', asset)]
         return result
 
     def propagate_permissions(
@@ -79,11 +204,12 @@ class PolicyEvaluator:
         Returns:
             The access permissions of the results.
         """
+        index = self._policy_collection.rule_index()
         result = Permissions()
         for input_perms in input_permissions:
             for asset_set in input_perms._sets:
                 data_coll, compute_coll = self._resultofin_collections(
-                        asset_set, compute_asset, output)
+                        index, asset_set, compute_asset, output)
                 result._sets.append(data_coll)
                 result._sets.append(compute_coll)
 
@@ -109,17 +235,16 @@ class PolicyEvaluator:
                 equiv_sites has access to.
             """
             equiv_assets = self._equivalent_objects(
-                    InAssetCollection, 'up', asset_set)
+                    index, InAssetCollection, 'up', asset_set)
             for asset in equiv_assets:
-                for rule in self._policy_collection.policies():
-                    if isinstance(rule, MayAccess):
-                        if rule.asset == asset and rule.site in equiv_sites:
-                            return True
-                        if rule.asset == asset and rule.site == '*':
-                            return True
+                for rule in index.may_access(asset):
+                    if rule.site in equiv_sites or rule.site == '*':
+                        return True
             return False
 
-        equiv_sites = self._equivalent_objects(InSiteCategory, 'up', site)
+        index = self._policy_collection.rule_index()
+        equiv_sites = self._equivalent_objects(
+                index, InSiteCategory, 'up', site)
         return all([matches_one(asset_set, equiv_sites)
                     for asset_set in permissions._sets])
 
@@ -143,28 +268,28 @@ class PolicyEvaluator:
                 equiv_parties may use.
             """
             equiv_assets = self._equivalent_objects(
-                    InAssetCollection, 'up', asset_set)
+                    index, InAssetCollection, 'up', asset_set)
             for asset in equiv_assets:
-                for rule in self._policy_collection.policies():
-                    if isinstance(rule, MayUse):
-                        if rule.asset == asset and rule.party in equiv_parties:
-                            return True
-                        if rule.asset == asset and rule.party == '*':
-                            return True
+                for rule in index.may_use(asset):
+                    if rule.party in equiv_parties or rule.party == '*':
+                        return True
             return False
 
-        equiv_parties = self._equivalent_objects(InPartyCategory, 'up', party)
+        index = self._policy_collection.rule_index()
+        equiv_parties = self._equivalent_objects(
+                index, InPartyCategory, 'up', party)
         return all([matches_one(asset_set, equiv_parties)
                     for asset_set in permissions._sets])
 
     def _equivalent_objects(
-            self, rule_type: Type[_GroupingRule],
+            self, index: RuleIndex, rule_type: Type[_GroupingRule],
             direction: str,
             obj: Union[Identifier, Set[Identifier]]
             ) -> Set[Identifier]:
         """Return objects reachable by traversing grouping rules.
 
         Args:
+            index: Index of the rules to use.
             rule_type: Type of rule to follow, e.g. InAssetCategory.
             direction: Either 'up' or 'down'.
             obj: The objects or object categories to find equivalents
@@ -172,27 +297,10 @@ class PolicyEvaluator:
         """
         if not isinstance(obj, set):
             obj = {obj}
-
-        if direction == 'up':
-            near_end, far_end = rule_type.grouped, rule_type.group
-        else:
-            near_end, far_end = rule_type.group, rule_type.grouped
-
-        cur_objects = set()      # type: Set[Identifier]
-        new_objects = obj
-        while new_objects:
-            cur_objects |= new_objects
-            new_objects = set()
-            for o in cur_objects:
-                for rule in self._policy_collection.policies():
-                    if isinstance(rule, rule_type):
-                        if near_end(rule) == o:
-                            if far_end(rule) not in cur_objects:
-                                new_objects.add(far_end(rule))
-        return cur_objects
+        return index.equivalent_objects(rule_type, direction, obj)
 
     def _resultofin_collections(
-            self, input_assets: Set[Identifier],
+            self, index: RuleIndex, input_assets: Set[Identifier],
             compute_asset: Identifier, output: str,
             ) -> Tuple[Set[Identifier], Set[Identifier]]:
         """Returns collections these assets propagate to.
@@ -203,42 +311,42 @@ class PolicyEvaluator:
         rules and the second one for ResultOfComputein rules.
 
         Args:
+            index: Index of the rules to use.
             input_assets: Set of data assets to match rules to.
             compute_asset: Compute asset to match rules to.
             output: Output to match rules to.
         """
         data_collections, compute_collections = set(), set()
 
-        input_assets_colls = {
-                a for input_asset in input_assets
-                for a in self._equivalent_objects(
-                    InAssetCollection, 'up', input_asset)}
+        input_assets_colls = self._equivalent_objects(
+                index, InAssetCollection, 'up', input_assets)
         compute_asset_colls = self._equivalent_objects(
-                InAssetCollection, 'up', compute_asset)
+                index, InAssetCollection, 'up', compute_asset)
 
-        for rule in self._policy_collection.policies():
-            if isinstance(rule, ResultOfIn):
-                if rule.output != '*' and rule.output != output:
+        for data_asset in input_assets_colls:
+            for data_rule in index.result_of_data_in(data_asset):
+                if data_rule.output not in ('*', output):
+                    continue
+                if data_rule.compute_asset == '*':
+                    data_collections.add(data_rule.collection)
+                elif compute_asset in self._equivalent_objects(
+                        index, InAssetCategory, 'down',
+                        data_rule.compute_asset):
+                    data_collections.add(data_rule.collection)
+
+        for compute_coll in compute_asset_colls:
+            for compute_rule in index.result_of_compute_in(compute_coll):
+                if compute_rule.output not in ('*', output):
+                    continue
+                if compute_rule.data_asset == '*':
+                    compute_collections.add(compute_rule.collection)
                     continue
 
-            if isinstance(rule, ResultOfDataIn):
-                if rule.data_asset in input_assets_colls:
-                    if rule.compute_asset == '*':
-                        data_collections.add(rule.collection)
-                    elif compute_asset in self._equivalent_objects(
-                            InAssetCategory, 'down', rule.compute_asset):
-                        data_collections.add(rule.collection)
-
-            elif isinstance(rule, ResultOfComputeIn):
-                if rule.compute_asset in compute_asset_colls:
-                    if rule.data_asset == '*':
-                        compute_collections.add(rule.collection)
-                        continue
-
-                    equiv_data_assets = self._equivalent_objects(
-                            InAssetCategory, 'down', rule.data_asset)
-                    if not input_assets.isdisjoint(equiv_data_assets):
-                        compute_collections.add(rule.collection)
+                equiv_data_assets = self._equivalent_objects(
+                        index, InAssetCategory, 'down',
+                        compute_rule.data_asset)
+                if not input_assets.isdisjoint(equiv_data_assets):
+                    compute_collections.add(compute_rule.collection)
 
         return data_collections, compute_collections
 
@@ -262,12 +370,35 @@ class PermissionCalculator:
         step, and step output. Workflow inputs are keyed by their
         name, step inputs and outputs by <step>.<name>.
 
+        Results are cached by the policy evaluator until the policies
+        change.
+
         Args:
             job: The job to evaluate.
 
         Returns:
             A dictionary with permissions per workflow value.
         """
+        cache = self._policy_evaluator.permission_cache
+        key = cache.job_key(job)
+        version = self._policy_evaluator.policy_version()
+        permissions = cache.get(key, version)
+        if permissions is None:
+            with _policy_evaluation_seconds.time(
+                    operation='calculate_permissions'):
+                permissions = self._calculate_permissions(job)
+            cache.put(key, version, permissions)
+        return permissions
+
+    def _calculate_permissions(
+            self, job: Job) -> Dict[str, Permissions]:
+        """Calculates permissions without caching.
+
+        See calculate_permissions().
+
+        Args:
+            job: The job to evaluate.
+        """
         def set_input_assets_permissions(
                 permissions: Dict[str, Permissions],
                 job: Job) -> None:
@@ -405,6 +536,7 @@ class PermissionCalculator:
         if permissions is None:
             permissions = self.calculate_permissions(job)
 
+        start = time.perf_counter()
         result = dict()
         for step in job.workflow.steps.values():
             allowed_sites = list()
@@ -442,6 +574,8 @@ class PermissionCalculator:
 
             result[step.name] = allowed_sites
 
+        _policy_evaluation_seconds.observe(
+                time.perf_counter() - start, operation='permitted_sites')
         return result
 
     def is_legal(self, job: Job, plan: Plan) -> bool:
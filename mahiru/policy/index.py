@@ -0,0 +1,247 @@
+"""An index of policy rules for fast evaluation."""
+from itertools import count
+from threading import Lock
+from typing import (
+        Dict, FrozenSet, Iterable, List, Optional, Set, Tuple, Type, TypeVar,
+        cast)
+
+from mahiru.definitions.identifier import Identifier
+from mahiru.definitions.policy import Rule
+from mahiru.policy.rules import (
+        GroupingRule, MayAccess, MayUse, ResultOfDataIn, ResultOfComputeIn)
+
+
+_R = TypeVar('_R', bound=Rule)
+
+# Serial numbers for RuleIndex objects
+_index_serials = count()
+
+# Closures by (direction, start object), per type of grouping rule
+_Closures = Dict[
+        Type[Rule], Dict[Tuple[str, Identifier], FrozenSet[Identifier]]]
+
+# Rules by the object they refer to, per index key
+_RuleMaps = Dict[object, Dict[Identifier, Set[Rule]]]
+
+
+class RuleIndex:
+    """Indexes rules by type and by the objects they refer to.
+
+    Grouping rules are stored as adjacency maps in both directions,
+    from grouped object to group ('up') and back ('down'), and the
+    other rules by the asset they are about. Transitive closures over
+    the grouping rules are computed when first needed and kept until
+    a grouping rule of the same type is added or removed.
+
+    The index is updated incrementally, using update(), which has the
+    signature of a Replica's on_update callback. Rules that are added
+    more than once, e.g. because they're in two replicas, need to be
+    removed as many times before they disappear.
+
+    Every change to the index gives it a new version, which can be used
+    to tell when results derived from the rules need recalculating.
+    """
+    def __init__(self, rules: Iterable[Rule] = ()) -> None:
+        """Create a RuleIndex.
+
+        Args:
+            rules: Rules to put in the index initially.
+        """
+        self._lock = Lock()
+        self._serial = next(_index_serials)
+        self._changes = 0
+
+        # Number of times each rule was added
+        self._counts = dict()   # type: Dict[Rule, int]
+
+        # Grouping rules by (type, direction), then by near end
+        self._grouping = dict()     # type: _RuleMaps
+
+        # Other rules by type, then by the asset they apply to
+        self._by_asset = dict()     # type: _RuleMaps
+
+        self._closures = dict()     # type: _Closures
+
+        self.update(set(rules), set())
+
+    def update(self, created: Set[Rule], deleted: Set[Rule]) -> None:
+        """Add and remove rules.
+
+        Args:
+            created: Rules to add.
+            deleted: Rules to remove.
+        """
+        if not created and not deleted:
+            return
+
+        with self._lock:
+            self._changes += 1
+            for rule in deleted:
+                count = self._counts.get(rule, 0)
+                if count == 1:
+                    del self._counts[rule]
+                    self._unindex(rule)
+                elif count > 1:
+                    self._counts[rule] = count - 1
+
+            for rule in created:
+                count = self._counts.get(rule, 0)
+                self._counts[rule] = count + 1
+                if count == 0:
+                    self._index(rule)
+
+    def version(self) -> Tuple[int, int]:
+        """Return the current version of the index.
+
+        Versions are unique across all RuleIndex objects, so that a
+        new index never has the version of an older one.
+        """
+        with self._lock:
+            return self._serial, self._changes
+
+    def rules(self) -> List[Rule]:
+        """Return all rules in the index."""
+        with self._lock:
+            return list(self._counts)
+
+    def equivalent_objects(
+            self, rule_type: Type[GroupingRule], direction: str,
+            objs: Iterable[Identifier]) -> Set[Identifier]:
+        """Return objects reachable by traversing grouping rules.
+
+        Args:
+            rule_type: Type of rule to follow, e.g. InAssetCategory.
+            direction: Either 'up' or 'down'.
+            objs: The objects or object categories to start from.
+
+        Return:
+            The given objects, and all objects reachable from them.
+        """
+        result = set()      # type: Set[Identifier]
+        with self._lock:
+            for obj in objs:
+                result |= self._closure(rule_type, direction, obj)
+        return result
+
+    def may_access(self, asset: Identifier) -> Set[MayAccess]:
+        """Return the MayAccess rules for the given asset."""
+        return self._lookup(MayAccess, asset)
+
+    def may_use(self, asset: Identifier) -> Set[MayUse]:
+        """Return the MayUse rules for the given asset."""
+        return self._lookup(MayUse, asset)
+
+    def result_of_data_in(self, data_asset: Identifier) -> Set[ResultOfDataIn]:
+        """Return the ResultOfDataIn rules for the given data asset."""
+        return self._lookup(ResultOfDataIn, data_asset)
+
+    def result_of_compute_in(
+            self, compute_asset: Identifier) -> Set[ResultOfComputeIn]:
+        """Return the ResultOfComputeIn rules for a compute asset."""
+        return self._lookup(ResultOfComputeIn, compute_asset)
+
+    def _lookup(self, rule_type: Type[_R], asset: Identifier) -> Set[_R]:
+        """Return rules of the given type about the given asset."""
+        with self._lock:
+            rules = self._by_asset.get(rule_type, dict()).get(asset, set())
+            return cast(Set[_R], set(rules))
+
+    def _index(self, rule: Rule) -> None:
+        """Add a rule to the indexes.
+
+        Must be called with the lock held.
+        """
+        if isinstance(rule, GroupingRule):
+            rule_type = type(rule)
+            self._add(self._grouping, (rule_type, 'up'), rule.grouped(), rule)
+            self._add(self._grouping, (rule_type, 'down'), rule.group(), rule)
+            self._invalidate(rule_type)
+        else:
+            key = self._asset_of(rule)
+            if key is not None:
+                self._add(self._by_asset, type(rule), key, rule)
+
+    def _unindex(self, rule: Rule) -> None:
+        """Remove a rule from the indexes.
+
+        Must be called with the lock held.
+        """
+        if isinstance(rule, GroupingRule):
+            rule_type = type(rule)
+            self._discard(
+                    self._grouping, (rule_type, 'up'), rule.grouped(), rule)
+            self._discard(
+                    self._grouping, (rule_type, 'down'), rule.group(), rule)
+            self._invalidate(rule_type)
+        else:
+            key = self._asset_of(rule)
+            if key is not None:
+                self._discard(self._by_asset, type(rule), key, rule)
+
+    def _asset_of(self, rule: Rule) -> Optional[Identifier]:
+        """Return the asset to index a non-grouping rule by.
+
+        Returns None for rules we don't index.
+        """
+        if isinstance(rule, (MayAccess, MayUse)):
+            return rule.asset
+        if isinstance(rule, ResultOfDataIn):
+            return rule.data_asset
+        if isinstance(rule, ResultOfComputeIn):
+            return rule.compute_asset
+        return None
+
+    def _add(
+            self, index: _RuleMaps, key: object, obj: Identifier, rule: Rule
+            ) -> None:
+        """Add a rule to an index."""
+        index.setdefault(key, dict()).setdefault(obj, set()).add(rule)
+
+    def _discard(
+            self, index: _RuleMaps, key: object, obj: Identifier, rule: Rule
+            ) -> None:
+        """Remove a rule from an index, dropping empty entries."""
+        by_obj = index.get(key, dict())
+        rules = by_obj.get(obj, set())
+        rules.discard(rule)
+        if not rules:
+            by_obj.pop(obj, None)
+
+    def _invalidate(self, rule_type: Type[Rule]) -> None:
+        """Forget closures over the given type of rule.
+
+        Must be called with the lock held.
+        """
+        self._closures.pop(rule_type, None)
+
+    def _closure(
+            self, rule_type: Type[GroupingRule], direction: str,
+            obj: Identifier) -> FrozenSet[Identifier]:
+        """Return all objects reachable from obj, including itself.
+
+        Must be called with the lock held.
+        """
+        closures = self._closures.setdefault(rule_type, dict())
+        closure = closures.get((direction, obj))
+        if closure is None:
+            adjacency = self._grouping.get((rule_type, direction), dict())
+            if direction == 'up':
+                def far_end(rule: GroupingRule) -> Identifier:
+                    return rule.group()
+            else:
+                def far_end(rule: GroupingRule) -> Identifier:
+                    return rule.grouped()
+
+            reached = {obj}
+            frontier = [obj]
+            while frontier:
+                cur = frontier.pop()
+                for rule in adjacency.get(cur, ()):
+                    nxt = far_end(rule)
+                    if nxt not in reached:
+                        reached.add(nxt)
+                        frontier.append(nxt)
+
+            closure = frozenset(reached)
+            closures[(direction, obj)] = closure
+        return closure
@@ -1,7 +1,9 @@
 """Support for replication of policies."""
 import logging
+from typing import Optional
 
 from mahiru.definitions.policy import Rule
+from mahiru.definitions.signable import key_fingerprint, SignatureCache
 from mahiru.policy.definitions import PolicyUpdate
 from mahiru.replication import CanonicalStore, ObjectValidator
 
@@ -12,8 +14,15 @@ logger = logging.getLogger(__name__)
 
 
 class RuleValidator(ObjectValidator[Rule]):
-    """Validates incoming policy rules by checking signatures."""
-    def __init__(self, namespace: str, key: Ed25519PublicKey) -> None:
+    """Validates incoming policy rules by checking signatures.
+
+    If given a SignatureCache, rules whose signatures have been
+    verified before, e.g. in an earlier update or by another replica,
+    are not verified again.
+    """
+    def __init__(
+            self, namespace: str, key: Ed25519PublicKey,
+            cache: Optional[SignatureCache] = None) -> None:
         """Create a RuleValidator.
 
         Checks that rules apply to the given namespace, and that they
@@ -22,9 +31,12 @@ class RuleValidator(ObjectValidator[Rule]):
         Args:
             namespace: The namespace to expect rules for.
             key: The key to validate the rules with.
+            cache: A cache of verified signatures to use, if any.
         """
         self._namespace = namespace
         self._key = key
+        self._fingerprint = key_fingerprint(key)
+        self._cache = cache
 
     def is_valid(self, rule: Rule) -> bool:
         """Return True iff the rule is properly signed."""
@@ -34,7 +46,8 @@ class RuleValidator(ObjectValidator[Rule]):
                     f' we got {rule.signing_namespace()} but expected'
                     f' {self._namespace}')
             return False
-        return rule.has_valid_signature(self._key)
+        return rule.has_valid_signature(
+                self._key, self._cache, self._fingerprint)
 
 
 class PolicyStore(CanonicalStore[Rule]):
@@ -35,18 +35,23 @@ class Registry(IRegistration, IRegistryService):
         self._store = RegistryStore(archive, 0.1)
 
     def get_updates_since(
-            self, from_version: int) -> IReplicaUpdate[RegisteredObject]:
+            self, from_version: int, wait: float = 0.0,
+            limit: Optional[int] = None
+            ) -> IReplicaUpdate[RegisteredObject]:
         """Return a set of objects modified since the given version.
 
         Args:
             from_version: A version received from a previous call to
                     this function, or 0 to get an update for a
                     fresh replica.
+            wait: If there are no changes since from_version, wait at
+                    most this many seconds for one to happen.
+            limit: If given, advance by at most this many versions.
 
         Return:
             An update from the given version to a newer version.
         """
-        return self._store.get_updates_since(from_version)
+        return self._store.get_updates_since(from_version, wait, limit)
 
     def register_party(
             self, description: PartyDescription) -> None:
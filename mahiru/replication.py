@@ -9,12 +9,27 @@ thus be missing from the replica. Likewise for deletion in the past.
 Considering that we'll only replicate low-velocity data such as
 policies and site and asset metadata, just enabling strict
 serialisation is probably the way to go. That's what we do here, using
-the Python GIL.
+a lock around changes and around reading the archive.
+
+Replicas can be kept up to date by polling, in which case they fetch an
+update whenever the previous one has expired, or using long polling. In
+the latter case, a background thread asks the source for changes and
+the source holds on to the request until there are any or a timeout
+expires, so that changes arrive quickly without generating traffic
+while nothing happens.
+
+Updates may be limited to a number of versions, so that a fresh
+replica of a large data set is brought up to date in steps of bounded
+size. Such a partial update brings the replica to an intermediate
+version, and the replica asks for the next one straight away.
 """
+from bisect import bisect_right
 from datetime import datetime, timedelta
 import logging
+from threading import Condition, Event, Lock, Thread
+import time
 from typing import (
-        Callable, Generic, Iterable, Optional, Set, Type,
+        Callable, cast, Dict, Generic, Iterable, List, Optional, Set, Type,
         TypeVar)
 
 from mahiru.definitions.interfaces import IReplicaUpdate, IReplicationService
@@ -26,6 +41,10 @@ logger = logging.getLogger(__name__)
 T = TypeVar('T')
 
 
+# Time (s) to wait before retrying a failed long poll
+_WATCH_RETRY_INTERVAL = 10.0
+
+
 class Replicable(Generic[T]):
     """Wrapper for objects that are to be replicated.
 
@@ -58,16 +77,92 @@ class ReplicableArchive(Generic[T]):
     This contains both existing and deleted objects. It models the raw
     database.
 
+    Records are kept in order of creation, and deleted records also in
+    order of deletion, so that the changes since a given version can
+    be found without looking at older records. Extant objects are
+    indexed by value, so that they can be found quickly for deletion.
+
     Attributes:
         records: The stored records, encoding all versions of the data
-                set.
+                set, in order of creation.
+        deletions: The deleted records, in order of deletion.
+        extant: Records of objects that have not been deleted, by
+                object.
         version: The current (latest) version of the data.
     """
     def __init__(self) -> None:
         """Create an empty archive."""
-        self.records = set()        # type: Set[Replicable[T]]
+        self.records = list()       # type: List[Replicable[T]]
+        self.deletions = list()     # type: List[Replicable[T]]
+        self.extant = dict()        # type: Dict[T, List[Replicable[T]]]
         self.version = 0            # type: int
 
+        # Versions of the above records, for searching
+        self._created = list()      # type: List[int]
+        self._deleted = list()      # type: List[int]
+
+    def add(self, record: Replicable[T]) -> None:
+        """Add a new record.
+
+        Its version must not be lower than that of any existing record.
+
+        Args:
+            record: The record to add.
+        """
+        self.records.append(record)
+        self._created.append(record.created)
+        self.extant.setdefault(record.object, list()).append(record)
+
+    def mark_deleted(self, obj: T, version: int) -> None:
+        """Mark an extant object as deleted.
+
+        Args:
+            obj: The object to delete.
+            version: The first version in which it no longer exists,
+                    must not be lower than that of any earlier change.
+
+        Raises:
+            KeyError: If the object is not present.
+        """
+        records = self.extant[obj]
+        record = records.pop(0)
+        if not records:
+            del self.extant[obj]
+
+        record.deleted = version
+        self.deletions.append(record)
+        self._deleted.append(version)
+
+    def created_since(
+            self, version: int, until: Optional[int] = None
+            ) -> List[Replicable[T]]:
+        """Return the records created after the given version.
+
+        Args:
+            version: Return records created after this version.
+            until: If given, return only records created in or before
+                    this version.
+        """
+        start = bisect_right(self._created, version)
+        if until is None:
+            return self.records[start:]
+        return self.records[start:bisect_right(self._created, until)]
+
+    def deleted_since(
+            self, version: int, until: Optional[int] = None
+            ) -> List[Replicable[T]]:
+        """Return the records deleted after the given version.
+
+        Args:
+            version: Return records deleted after this version.
+            until: If given, return only records deleted in or before
+                    this version.
+        """
+        start = bisect_right(self._deleted, version)
+        if until is None:
+            return self.deletions[start:]
+        return self.deletions[start:bisect_right(self._deleted, until)]
+
 
 class ReplicaUpdate(IReplicaUpdate[T]):
     """Contains an update for a Replica.
@@ -78,12 +173,15 @@ class ReplicaUpdate(IReplicaUpdate[T]):
         valid_until: Time until which the new version is valid.
         created: Set of objects that were created.
         deleted: Set of objects that were deleted.
+        partial: Whether there are more changes after to_version,
+                which should be fetched straight away.
     """
     ReplicatedType = None      # type: Type[T]
 
     def __init__(
             self, from_version: int, to_version: int, valid_until: datetime,
-            created: Set[T], deleted: Set[T]) -> None:
+            created: Set[T], deleted: Set[T], partial: bool = False
+            ) -> None:
         """Create a replica update.
 
         Args:
@@ -93,18 +191,21 @@ class ReplicaUpdate(IReplicaUpdate[T]):
                 valid.
             created: Set of objects that were created.
             deleted: Set of objects that were deleted.
+            partial: Whether there are more changes after to_version.
         """
         self.from_version = from_version
         self.to_version = to_version
         self.valid_until = valid_until
         self.created = created
         self.deleted = deleted
+        self.partial = partial
 
     def __repr__(self) -> str:
         """Return a string representation of the object."""
         return (
             f'ReplicaUpdate({self.from_version} -> {self.to_version},'
-            f' {self.valid_until}, +{self.created}, -{self.deleted})')
+            f' {self.valid_until}, +{self.created}, -{self.deleted},'
+            f' partial={self.partial})')
 
 
 class CanonicalStore(IReplicationService[T]):
@@ -120,12 +221,12 @@ class CanonicalStore(IReplicationService[T]):
         """
         self._archive = archive
         self._max_lag = max_lag
+        self._changed = Condition()
 
     def objects(self) -> Iterable[T]:
         """Iterate through currently extant objects."""
-        return {
-                rec.object for rec in self._archive.records
-                if rec.deleted is None}
+        with self._changed:
+            return set(self._archive.extant)
 
     def insert(self, obj: T) -> None:
         """Insert an object into the collection of objects.
@@ -133,9 +234,11 @@ class CanonicalStore(IReplicationService[T]):
         Args:
             obj: A new object to add.
         """
-        new_version = self._archive.version + 1
-        self._archive.records.add(Replicable(new_version, obj))
-        self._archive.version = new_version
+        with self._changed:
+            new_version = self._archive.version + 1
+            self._archive.add(Replicable(new_version, obj))
+            self._archive.version = new_version
+            self._changed.notify_all()
 
     def delete(self, obj: T) -> None:
         """Delete an object from the collection of objects.
@@ -146,22 +249,36 @@ class CanonicalStore(IReplicationService[T]):
         Raises:
             ValueError: If the object is not present.
         """
-        new_version = self._archive.version + 1
-        for rec in self._archive.records:
-            if rec.object == obj:
-                rec.deleted = new_version
-                break
-        else:
-            raise ValueError('Object not found')
-        self._archive.version = new_version
-
-    def get_updates_since(self, from_version: int) -> ReplicaUpdate[T]:
+        with self._changed:
+            new_version = self._archive.version + 1
+            try:
+                self._archive.mark_deleted(obj, new_version)
+            except KeyError:
+                raise ValueError('Object not found')
+            self._archive.version = new_version
+            self._changed.notify_all()
+
+    def get_updates_since(
+            self, from_version: int, wait: float = 0.0,
+            limit: Optional[int] = None
+            ) -> ReplicaUpdate[T]:
         """Return a set of objects modified since the given version.
 
+        This takes time proportional to the number of changes since
+        from_version, not to the size of the archive.
+
+        If a limit is given and there are more changes, then the update
+        goes to from_version + limit and is marked partial. Its
+        valid_until is set to now, as the replica will be out of date
+        until it has fetched the rest.
+
         Args:
             from_version: A version received from a previous call to
                     this function, or 0 to get an update for a
                     fresh replica.
+            wait: If there are no changes since from_version, wait at
+                    most this many seconds for one to happen.
+            limit: Maximum number of versions to advance by.
 
         Return:
             An update from the given version to a newer version.
@@ -176,29 +293,44 @@ class CanonicalStore(IReplicationService[T]):
                 return False
             return deleted <= version
 
-        cur_time = datetime.now()
-        to_version = self._archive.version
-
-        new_objects = {
-                rec.object for rec in self._archive.records
-                if (from_version < rec.created and
-                    rec.created <= to_version and
-                    deleted_after(to_version, rec.deleted))}
-
-        deleted_objects = {
-                rec.object for rec in self._archive.records
-                if (rec.created <= from_version and
-                    deleted_after(from_version, rec.deleted) and
-                    deleted_before(rec.deleted, to_version))}
+        with self._changed:
+            if wait > 0.0:
+                self._changed.wait_for(
+                        lambda: self._archive.version > from_version, wait)
+
+            cur_time = datetime.now()
+            to_version = self._archive.version
+            partial = limit is not None and to_version - from_version > limit
+            if partial:
+                to_version = from_version + cast(int, limit)
+
+            created = self._archive.created_since(from_version, to_version)
+            deleted = self._archive.deleted_since(from_version, to_version)
+
+            # Records are marked deleted by delete(), so we need to hold
+            # the lock until we're done with them.
+            new_objects = {
+                    rec.object for rec in created
+                    if (from_version < rec.created and
+                        rec.created <= to_version and
+                        deleted_after(to_version, rec.deleted))}
+
+            deleted_objects = {
+                    rec.object for rec in deleted
+                    if (rec.created <= from_version and
+                        deleted_after(from_version, rec.deleted) and
+                        deleted_before(rec.deleted, to_version))}
 
         readded_objects = new_objects.intersection(deleted_objects)
         new_objects -= readded_objects
         deleted_objects -= readded_objects
 
-        valid_until = cur_time + timedelta(seconds=self._max_lag)
+        valid_until = cur_time
+        if not partial:
+            valid_until += timedelta(seconds=self._max_lag)
         return self.UpdateType(
                 from_version, to_version, valid_until,
-                new_objects, deleted_objects)
+                new_objects, deleted_objects, partial)
 
 
 class ObjectValidator(Generic[T]):
@@ -209,7 +341,13 @@ class ObjectValidator(Generic[T]):
 
 
 class Replica(Generic[T]):
-    """Stores a replica of a CanonicalStore."""
+    """Stores a replica of a CanonicalStore.
+
+    Attributes:
+        objects: The replicated objects. This is replaced rather than
+                modified on update, so it's safe to iterate over it
+                while another thread updates the replica.
+    """
     def __init__(
             self, source: IReplicationService[T],
             validator: Optional[ObjectValidator[T]] = None,
@@ -220,7 +358,9 @@ class Replica(Generic[T]):
         The callback function, if specified, will be called by update()
         if there are any changes to the replica. It must be a callable
         object taking a set of newly created T as its first argument,
-        and a set of newly deleted T as its second argument.
+        and a set of newly deleted T as its second argument. If the
+        replica is being watched, the callback is called from the
+        watching thread.
 
         Args:
             source: Source to get replica updates from.
@@ -233,9 +373,14 @@ class Replica(Generic[T]):
         self._validator = validator
         self._on_update = on_update
 
+        self._lock = Lock()
         self._version = 0
         self._valid_until = datetime.fromtimestamp(0.0)
 
+        self._watching = False
+        self._watch_thread = None   # type: Optional[Thread]
+        self._stop_watching = Event()
+
     def is_valid(self) -> bool:
         """Whether the replica is valid or outdated.
 
@@ -246,24 +391,158 @@ class Replica(Generic[T]):
         return datetime.now() < self._valid_until
 
     def update(self) -> None:
-        """Updates the replica, if necessary."""
-        if not self.is_valid():
-            update = self._source.get_updates_since(self._version)
-            if self._validator is not None:
-                for r in update.created:
-                    if not self._validator.is_valid(r):
-                        logger.error(f'Object {r} failed validation.')
-                        return
-                for r in update.deleted:
-                    if not self._validator.is_valid(r):
-                        logger.error(f'Object {r} failed validation.')
-                        return
+        """Updates the replica, if necessary.
+
+        If the replica is being watched, it's already up to date and
+        this does nothing. Partial updates are followed up until the
+        replica is up to date.
+        """
+        if not self._watching and not self.is_valid():
+            while True:
+                with self._lock:
+                    version = self._version
+                update = self._source.get_updates_since(version)
+                if not self._apply(update) or not update.partial:
+                    break
+
+    def watch(self, wait: float) -> None:
+        """Start keeping the replica up to date using long polling.
+
+        This starts a background thread which repeatedly asks the
+        source for changes, waiting for them for at most the given
+        number of seconds. If the source fails, we fall back to
+        polling in update() until the source has recovered. If the
+        source doesn't wait, e.g. because it's an older server, then
+        we fall back to polling permanently.
+
+        Args:
+            wait: Time (s) the source should wait for changes.
+        """
+        if self._watch_thread is not None:
+            return
+        self._stop_watching = Event()
+        self._watch_thread = Thread(
+                target=self._watch, args=(wait, self._stop_watching),
+                name='ReplicaWatcher', daemon=True)
+        self._watch_thread.start()
+
+    def stop_watching(self) -> None:
+        """Stop long polling, and go back to polling in update().
+
+        A long poll that is in progress is abandoned, so this does not
+        wait for it to return.
+        """
+        with self._lock:
+            self._stop_watching.set()
+            self._watching = False
+            self._watch_thread = None
+
+    def _watch(self, wait: float, stop: Event) -> None:
+        """Keeps the replica up to date, in a background thread.
+
+        The first request doesn't wait, so that we're up to date and
+        can stop polling straight away.
+
+        Args:
+            wait: Time (s) the source should wait for changes.
+            stop: Set to make us stop.
+        """
+        cur_wait = 0.0
+        while not stop.is_set():
+            with self._lock:
+                version = self._version
+            start = time.monotonic()
+            try:
+                update = self._source.get_updates_since(version, cur_wait)
+            except Exception as e:
+                logger.warning(
+                        f'Long poll failed, polling until it recovers: {e}')
+                self._set_watching(stop, False)
+                cur_wait = 0.0
+                stop.wait(_WATCH_RETRY_INTERVAL)
+                continue
+
+            if stop.is_set():
+                break
+
+            if (
+                    cur_wait > 0.0 and update.to_version == version and
+                    time.monotonic() - start < cur_wait / 2):
+                logger.info(
+                        'Source does not support long polling, falling'
+                        ' back to polling')
+                self._set_watching(stop, False)
+                break
+
+            if (
+                    not self._apply(update, stop) and
+                    update.from_version == version):
+                # invalid update, don't keep asking for it
+                self._set_watching(stop, False)
+                stop.wait(_WATCH_RETRY_INTERVAL)
+                continue
+
+            if update.partial:
+                # get the rest before waiting for anything new
+                cur_wait = 0.0
+            else:
+                self._set_watching(stop, True)
+                cur_wait = wait
+
+    def _set_watching(self, stop: Event, watching: bool) -> None:
+        """Set whether the watcher is keeping the replica up to date.
+
+        This does nothing if the watcher has been stopped, so that a
+        watcher which is shutting down can't turn off polling in
+        update() after stop_watching() has turned it back on.
+
+        Args:
+            stop: The stop event of the calling watcher.
+            watching: The new value.
+        """
+        with self._lock:
+            if not stop.is_set():
+                self._watching = watching
+
+    def _apply(
+            self, update: IReplicaUpdate[T], stop: Optional[Event] = None
+            ) -> bool:
+        """Apply an update to the replica.
+
+        Updates that don't apply to the current version, because
+        another update got there first, are ignored.
+
+        Args:
+            update: The update to apply.
+            stop: If given and set, ignore the update, because the
+                    watcher fetching it was stopped.
+
+        Return:
+            True iff the update was applied.
+        """
+        if self._validator is not None:
+            for r in update.created:
+                if not self._validator.is_valid(r):
+                    logger.error(f'Object {r} failed validation.')
+                    return False
+            for r in update.deleted:
+                if not self._validator.is_valid(r):
+                    logger.error(f'Object {r} failed validation.')
+                    return False
+
+        with self._lock:
+            if stop is not None and stop.is_set():
+                return False
+            if update.from_version != self._version:
+                return False
 
             # In a database, do this in a single transaction
-            self.objects.difference_update(update.deleted)
-            self.objects.update(update.created)
+            self.objects = (
+                    self.objects.difference(update.deleted) |
+                    update.created)
             self._version = update.to_version
             self._valid_until = update.valid_until
 
             if self._on_update:
                 self._on_update(update.created, update.deleted)
+            return True
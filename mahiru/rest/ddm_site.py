@@ -1,4 +1,5 @@
 """REST-style API for a site."""
+from base64 import b64encode
 from copy import copy
 from enum import Enum
 import logging
@@ -6,7 +7,8 @@ from pathlib import Path
 from socketserver import ThreadingMixIn
 from tempfile import NamedTemporaryFile
 from threading import Thread
-from typing import Dict, List
+import time
+from typing import Any, BinaryIO, Dict, List, Optional, Tuple
 from urllib.parse import quote, unquote_to_bytes
 from wsgiref.simple_server import WSGIRequestHandler, WSGIServer
 
@@ -15,8 +17,8 @@ from cryptography import x509
 from cryptography.x509 import Certificate
 from cryptography.x509.oid import ExtensionOID
 from falcon import (
-        App, HTTP_200, HTTP_201, HTTP_204, HTTP_303, HTTP_400, HTTP_403,
-        HTTP_404, Request, Response)
+        App, HTTP_200, HTTP_201, HTTP_204, HTTP_206, HTTP_303, HTTP_400,
+        HTTP_403, HTTP_404, HTTPRangeNotSatisfiable, Request, Response)
 from jsonschema import ValidationError
 import ruamel.yaml as yaml
 import yatiml
@@ -32,9 +34,10 @@ from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.interfaces import IAssetStore, IStepRunner
 from mahiru.definitions.policy import Rule
 from mahiru.definitions.workflows import ExecutionRequest, Job
+from mahiru.metrics import CONTENT_TYPE, REGISTRY
 from mahiru.policy.replication import PolicyStore
 from mahiru.rest.registry_client import RegistryRestClient
-from mahiru.rest.replication import ReplicationHandler
+from mahiru.rest.replication import LongPollLimiter, ReplicationHandler
 from mahiru.rest.serialization import deserialize, serialize
 from mahiru.rest.validation import validate_json, ValidationError
 
@@ -42,6 +45,16 @@ from mahiru.rest.validation import validate_json, ValidationError
 logger = logging.getLogger(__name__)
 
 
+# Maximum time (s) a client may ask us to wait for an asset to appear
+_MAX_ASSET_WAIT = 30.0
+
+
+_request_seconds = REGISTRY.histogram(
+        'mahiru_site_request_seconds',
+        'Time taken to handle requests to the site API',
+        ['method', 'route', 'status'])
+
+
 def _request_url(request: Request) -> str:
     """Obtain the URL for the current request.
 
@@ -83,6 +96,36 @@ def _request_url(request: Request) -> str:
         return f'{request.prefix}{path}'
 
 
+class _FileRange:
+    """A read-only stream over part of a file.
+
+    The WSGI server will send everything it can read from a stream, so
+    for range requests we need to stop at the end of the range.
+    """
+    def __init__(self, f: BinaryIO, length: int) -> None:
+        """Create a _FileRange.
+
+        Args:
+            f: The file to read from, positioned at the start of the
+                    range. It will be closed when we are closed.
+            length: Number of bytes to read.
+        """
+        self._file = f
+        self._remaining = length
+
+    def read(self, size: int = -1) -> bytes:
+        """Read at most size bytes, or all remaining if negative."""
+        if size < 0 or size > self._remaining:
+            size = self._remaining
+        data = self._file.read(size)
+        self._remaining -= len(data)
+        return data
+
+    def close(self) -> None:
+        """Close the underlying file."""
+        self._file.close()
+
+
 class InternalOperation(Enum):
     """Operation on the internal API.
 
@@ -94,6 +137,7 @@ class InternalOperation(Enum):
     MANAGE_ASSETS = 1
     MANAGE_POLICIES = 2
     SUBMIT_WORKFLOWS = 3
+    VIEW_METRICS = 4
 
 
 class AccessController:
@@ -227,22 +271,31 @@ class AccessController:
 class AssetAccessHandler:
     """A handler for the external /assets endpoint."""
     def __init__(
-            self, access_controller: AccessController, store: IAssetStore
+            self, access_controller: AccessController, store: IAssetStore,
+            limiter: LongPollLimiter
             ) -> None:
         """Create an AssetAccessHandler handler.
 
         Args:
             access_controller: Access controller to use.
             store: The asset store to send requests to.
+            limiter: Limits the number of requests waiting for an
+                    asset. Requests over the limit don't wait.
         """
         self._access_controller = access_controller
         self._store = store
+        self._limiter = limiter
 
     def on_get(
             self, request: Request, response: Response, asset_id: str
             ) -> None:
         """Handle request for an asset.
 
+        If a wait parameter is given and the asset isn't there yet,
+        this waits for at most that many seconds for it to be stored,
+        so that sites waiting for a result get it as soon as it's
+        available.
+
         Args:
             request: The submitted request.
             response: A response object to configure.
@@ -267,8 +320,12 @@ class AssetAccessHandler:
                     self._access_controller.check_requester(
                             requester, client_cert)
 
-                asset = copy(self._store.retrieve(
-                        Identifier(asset_id), request.params['requester']))
+                wait = request.get_param_as_float('wait', min_value=0.0)
+                with self._limiter.wait(
+                        min(wait or 0.0, _MAX_ASSET_WAIT)) as allowed_wait:
+                    asset = copy(self._store.retrieve(
+                            Identifier(asset_id), request.params['requester'],
+                            allowed_wait))
                 # Send URL instead of local file location
                 if asset.image_location is not None:
                     asset.image_location = _request_url(request) + '/image'
@@ -310,6 +367,12 @@ class AssetImageAccessHandler:
             self, request: Request, response: Response, asset_id: str) -> None:
         """Handle request for an asset image.
 
+        This supports requests for a single byte range, so that
+        clients can download in parallel and resume interrupted
+        downloads. The ETag and Digest headers contain the SHA-256 of
+        the whole image. If an If-Range header is sent that doesn't
+        match the ETag, the whole image is sent.
+
         Args:
             request: The submitted request.
             response: A response object to configure.
@@ -337,13 +400,31 @@ class AssetImageAccessHandler:
                         Identifier(asset_id), request.params['requester'])
                 if asset.image_location is None:
                     raise KeyError()
-                response.status = HTTP_200
-                response.content_type = 'application/x-tar'
                 logger.info(f'Reading image from {asset.image_location}')
                 image_path = Path(asset.image_location)
                 image_size = image_path.stat().st_size
+                digest = self._store.image_digest(Identifier(asset_id))
+                etag = f'"{digest.hex()}"'
+
+                response.content_type = 'application/x-tar'
+                response.set_header('Accept-Ranges', 'bytes')
+                response.set_header('ETag', etag)
+                response.set_header(
+                        'Digest', 'sha-256=' + b64encode(digest).decode())
+
+                byte_range = self._requested_range(request, etag, image_size)
                 image_stream = image_path.open('rb')
-                response.set_stream(image_stream, image_size)
+                if byte_range is None:
+                    response.status = HTTP_200
+                    response.set_stream(image_stream, image_size)
+                else:
+                    start, end = byte_range
+                    length = end - start + 1
+                    image_stream.seek(start)
+                    response.status = HTTP_206
+                    response.content_range = (start, end, image_size)
+                    response.set_stream(
+                            _FileRange(image_stream, length), length)
             except KeyError:
                 logger.info(f'Asset {asset_id} not found')
                 response.status = HTTP_404
@@ -358,6 +439,42 @@ class AssetImageAccessHandler:
                 response.status = HTTP_404
                 response.body = 'Asset not found'
 
+    def _requested_range(
+            self, request: Request, etag: str, size: int
+            ) -> Optional[Tuple[int, int]]:
+        """Determine which part of the image to send.
+
+        Args:
+            request: The submitted request.
+            etag: The current ETag of the image.
+            size: Size of the image in bytes.
+
+        Return:
+            The first and last byte to send, or None to send the
+            whole image.
+
+        Raises:
+            HTTPRangeNotSatisfiable: If the range is outside the image.
+        """
+        if request.range is None or request.range_unit != 'bytes':
+            return None
+
+        if_range = request.get_header('If-Range')
+        if if_range is not None and if_range != etag:
+            return None
+
+        first, last = request.range
+        if first < 0:
+            # suffix range, the last -first bytes
+            first = max(0, size + first)
+            last = size - 1
+        elif last < 0 or last >= size:
+            last = size - 1
+
+        if first >= size or first > last:
+            raise HTTPRangeNotSatisfiable(size)
+        return first, last
+
 
 class AssetConnectionAccessHandler:
     """A handler for the /assets/{assetId}/connect endpoints."""
@@ -782,6 +899,72 @@ class WorkflowStatusHandler:
         response.media = serialize(result)
 
 
+class MetricsHandler:
+    """A handler for the internal /metrics endpoint.
+
+    This serves the metrics of all the site's components in the
+    Prometheus text format.
+    """
+    def __init__(self, access_controller: AccessController) -> None:
+        """Create a MetricsHandler.
+
+        Args:
+            access_controller: Access controller to use.
+        """
+        self._access_controller = access_controller
+
+    def on_get(self, request: Request, response: Response) -> None:
+        """Handle request for the current metrics.
+
+        Args:
+            request: The submitted request.
+            response: A response object to configure.
+        """
+        client_cert_header = request.get_header('X-Client-Certificate')
+        if client_cert_header:
+            self._access_controller.check_user_authorization(
+                    unquote_to_bytes(client_cert_header),
+                    InternalOperation.VIEW_METRICS)
+
+        response.status = HTTP_200
+        response.content_type = CONTENT_TYPE
+        response.body = REGISTRY.render()
+
+
+class RequestMetricsMiddleware:
+    """Records the time taken to handle each request.
+
+    Requests are labelled by the route template rather than the path,
+    so that e.g. requests for different assets are counted together.
+    """
+    def process_request(self, request: Request, response: Response) -> None:
+        """Note when we started handling a request.
+
+        Args:
+            request: The request being handled.
+            response: The response being made.
+        """
+        request.context.metrics_start = time.perf_counter()
+
+    def process_response(
+            self, request: Request, response: Response, resource: Any,
+            req_succeeded: bool) -> None:
+        """Record how long it took to handle a request.
+
+        Args:
+            request: The request that was handled.
+            response: The response that was made.
+            resource: The resource that handled it, if any.
+            req_succeeded: Whether no exception was raised.
+        """
+        start = getattr(request.context, 'metrics_start', None)
+        if start is not None:
+            _request_seconds.observe(
+                    time.perf_counter() - start, method=request.method,
+                    route=request.uri_template or 'none',
+                    status=str(response.status).split(' ')[0])
+
+
 class SiteRestApi:
     """The complete Site REST API.
 
@@ -795,7 +978,8 @@ class SiteRestApi:
             policy_store: PolicyStore,
             asset_store: IAssetStore,
             runner: IStepRunner,
-            orchestrator: WorkflowOrchestrator) -> None:
+            orchestrator: WorkflowOrchestrator,
+            max_long_polls: int = 64) -> None:
         """Create a SiteRestApi instance.
 
         Args:
@@ -805,14 +989,19 @@ class SiteRestApi:
             runner: The workflow runner to send requests to.
             orchestrator: The orchestrator to use to orchestrate
                     user job submissions.
+            max_long_polls: Maximum number of requests for policy
+                    updates or assets that may wait at the same time.
 
         """
-        self.app = App()
+        self.app = App(middleware=[RequestMetricsMiddleware()])
 
-        rule_replication = ReplicationHandler[Rule](policy_store)
+        limiter = LongPollLimiter(max_long_polls)
+
+        rule_replication = ReplicationHandler[Rule](policy_store, limiter)
         self.app.add_route('/external/rules/updates', rule_replication)
 
-        asset_access = AssetAccessHandler(access_controller, asset_store)
+        asset_access = AssetAccessHandler(
+                access_controller, asset_store, limiter)
         self.app.add_route('/external/assets/{asset_id}', asset_access)
 
         asset_image_access = AssetImageAccessHandler(
@@ -854,6 +1043,9 @@ class SiteRestApi:
                 access_controller, orchestrator)
         self.app.add_route('/internal/jobs', workflow_submission)
 
+        metrics = MetricsHandler(access_controller)
+        self.app.add_route('/internal/metrics', metrics)
+
 
 class ThreadingWSGIServer (ThreadingMixIn, WSGIServer):
     """Threading version of a simple WSGI server."""
@@ -913,9 +1105,10 @@ def wsgi_app() -> App:
     registry_rest_client = RegistryRestClient(
             settings.registry_endpoint, settings.trust_store,
             settings.client_creds())
-    registry_client = RegistryClient(registry_rest_client)
+    registry_client = RegistryClient(
+            registry_rest_client, settings.replication_long_poll)
     access_controller = AccessController(registry_client, settings.owner)
     site = Site(settings, [], [], registry_client)
     return SiteRestApi(
             access_controller, site.policy_store, site.store, site.runner,
-            site.orchestrator).app
+            site.orchestrator, settings.max_long_polls).app
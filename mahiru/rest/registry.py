@@ -16,7 +16,7 @@ from mahiru.definitions.interfaces import IRegistration
 from mahiru.definitions.registry import (
         PartyDescription, RegisteredObject, SiteDescription)
 from mahiru.registry.registry import Registry
-from mahiru.rest.replication import ReplicationHandler
+from mahiru.rest.replication import LongPollLimiter, ReplicationHandler
 from mahiru.rest.serialization import deserialize
 from mahiru.rest.validation import validate_json
 
@@ -24,6 +24,12 @@ from mahiru.rest.validation import validate_json
 logger = logging.getLogger(__name__)
 
 
+# Maximum number of sites that may long poll for updates at the same
+# time. Each of these ties up a server thread, see
+# registry-gunicorn.conf.py.
+MAX_LONG_POLLS = 96
+
+
 class PartyRegistrationHandler:
     """A handler for the /parties endpoint."""
     def __init__(
@@ -139,11 +145,15 @@ class RegistryRestApi:
         app: The WSGI application object.
 
     """
-    def __init__(self, registry: Registry) -> None:
+    def __init__(
+            self, registry: Registry,
+            max_long_polls: int = MAX_LONG_POLLS) -> None:
         """Create a RegistryRestApi instance.
 
         Args:
             registry: The registry to serve for.
+            max_long_polls: Maximum number of requests for updates
+                    that may wait at the same time.
 
         """
         self.app = App()
@@ -160,7 +170,8 @@ class RegistryRestApi:
         self.app.add_route('/sites', site_registration)
         self.app.add_route('/sites/{id}', site_registration)
 
-        registry_replication = ReplicationHandler[RegisteredObject](registry)
+        registry_replication = ReplicationHandler[RegisteredObject](
+                registry, LongPollLimiter(max_long_polls))
         self.app.add_route('/updates', registry_replication)
 
 
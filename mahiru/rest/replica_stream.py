@@ -0,0 +1,205 @@
+"""A compact, streamable format for replica updates.
+
+The JSON format for replica updates is a single document, which must
+be received and parsed completely before any of it can be validated.
+For a fresh replica of a large data set, that's a lot of memory. This
+format instead encodes an update as a sequence of lines, each of which
+is a JSON document that can be parsed and validated on its own.
+
+The first line is a header (see ReplicaStreamHeader in schemas.yaml),
+then there is a line for each created or deleted object, and the last
+line is a trailer which says how many objects there were, so that a
+truncated stream is detected. Object lines look like
+
+    ["+", ["new string", ...], <object>]
+
+with "-" instead of "+" for deleted objects. Identifiers and other
+strings are repeated a lot across objects, so they are interned: all
+strings in an object are replaced by their index into a string table,
+and each line adds the strings it introduces to the end of the table.
+The replicated objects contain no numbers, which keeps this
+unambiguous. The trailer is
+
+    ["end", <number of objects>]
+
+Streams are usually sent gzip-compressed, using HTTP content encoding.
+"""
+import json
+from typing import Any, Dict, Iterable, Iterator, List, Set, Type, TypeVar
+
+from dateutil import parser as dateparser
+
+from mahiru.definitions.errors import ValidationError
+from mahiru.definitions.interfaces import IReplicaUpdate
+from mahiru.replication import ReplicaUpdate
+from mahiru.rest.serialization import deserialize, serialize
+from mahiru.rest.validation import validate_json
+
+
+STREAM_MEDIA_TYPE = 'application/x-mahiru-replica-stream'
+
+
+AnyReplicaUpdate = TypeVar('AnyReplicaUpdate', bound=ReplicaUpdate)
+
+
+class _Interner:
+    """Replaces strings by indices into a growing string table."""
+    def __init__(self) -> None:
+        """Create an _Interner with an empty table."""
+        self._indices = dict()      # type: Dict[str, int]
+        self._new = list()          # type: List[str]
+
+    def encode(self, value: Any) -> Any:
+        """Encode a JSON value, interning its strings.
+
+        Raises:
+            RuntimeError: If the value contains a number.
+        """
+        if isinstance(value, str):
+            index = self._indices.get(value)
+            if index is None:
+                index = len(self._indices)
+                self._indices[value] = index
+                self._new.append(value)
+            return index
+        if isinstance(value, dict):
+            return {k: self.encode(v) for k, v in value.items()}
+        if isinstance(value, list):
+            return [self.encode(v) for v in value]
+        if isinstance(value, bool) or value is None:
+            return value
+        raise RuntimeError(f'Cannot encode {value} in a replica stream')
+
+    def take_new(self) -> List[str]:
+        """Return strings added since the last call."""
+        new, self._new = self._new, list()
+        return new
+
+
+def _resolve(value: Any, table: List[str]) -> Any:
+    """Decode a JSON value, replacing indices by strings.
+
+    Raises:
+        ValidationError: If an index is out of range.
+    """
+    if isinstance(value, bool) or value is None:
+        return value
+    if isinstance(value, int):
+        if not 0 <= value < len(table):
+            raise ValidationError(f'Invalid string reference {value}')
+        return table[value]
+    if isinstance(value, dict):
+        return {k: _resolve(v, table) for k, v in value.items()}
+    if isinstance(value, list):
+        return [_resolve(v, table) for v in value]
+    raise ValidationError(f'Unexpected value {value} in replica stream')
+
+
+def encode_update(update: IReplicaUpdate[Any]) -> Iterator[bytes]:
+    """Encode a replica update in the stream format.
+
+    Args:
+        update: The update to encode.
+
+    Yields:
+        Lines of the stream, including line endings.
+    """
+    def line(obj: Any) -> bytes:
+        return json.dumps(obj, separators=(',', ':')).encode() + b'\n'
+
+    yield line({
+        'type': type(update).__name__,
+        'from_version': update.from_version,
+        'to_version': update.to_version,
+        'valid_until': update.valid_until.isoformat(),
+        'partial': bool(update.partial)})
+
+    interner = _Interner()
+    count = 0
+    for op, objs in (('+', update.created), ('-', update.deleted)):
+        for obj in objs:
+            encoded = interner.encode(serialize(obj))
+            yield line([op, interner.take_new(), encoded])
+            count += 1
+
+    yield line(['end', count])
+
+
+def decode_update(
+        update_type: Type[AnyReplicaUpdate], lines: Iterable[bytes]
+        ) -> AnyReplicaUpdate:
+    """Decode a replica update from the stream format.
+
+    Lines are parsed and validated as they come in, so that only the
+    decoded objects are kept in memory, and a bad object is detected
+    without reading the rest of the stream.
+
+    Args:
+        update_type: Type of update to decode.
+        lines: Lines of the stream.
+
+    Return:
+        The decoded update.
+
+    Raises:
+        ValidationError: If the stream is invalid or incomplete.
+    """
+    item_schema = update_type.ReplicatedType.__name__
+    it = iter(lines)
+
+    header = _parse_line(next(it, b''))
+    validate_json('ReplicaStreamHeader', header)
+    if header['type'] != update_type.__name__:
+        raise ValidationError(
+                f'Expected a {update_type.__name__}, got {header["type"]}')
+
+    table = list()      # type: List[str]
+    created = set()     # type: Set[Any]
+    deleted = set()     # type: Set[Any]
+    count = 0
+    for raw_line in it:
+        if not raw_line:
+            continue
+        record = _parse_line(raw_line)
+        if not isinstance(record, list) or not record:
+            raise ValidationError(f'Invalid record {record}')
+
+        if record[0] == 'end':
+            if record[1:] != [count]:
+                raise ValidationError(
+                        f'Stream ended after {count} objects, expected'
+                        f' {record[1:]}')
+            return update_type(
+                    header['from_version'], header['to_version'],
+                    dateparser.isoparse(header['valid_until']),
+                    created, deleted, header['partial'])
+
+        if (
+                len(record) != 3 or record[0] not in ('+', '-') or
+                not isinstance(record[1], list) or
+                not all(isinstance(s, str) for s in record[1])):
+            raise ValidationError(f'Invalid record {record}')
+
+        table.extend(record[1])
+        obj_json = _resolve(record[2], table)
+        validate_json(item_schema, obj_json)
+        obj = deserialize(update_type.ReplicatedType, obj_json)
+        if record[0] == '+':
+            created.add(obj)
+        else:
+            deleted.add(obj)
+        count += 1
+
+    raise ValidationError('Replica stream is incomplete')
+
+
+def _parse_line(line: bytes) -> Any:
+    """Parse a line of a stream as JSON.
+
+    Raises:
+        ValidationError: If the line is not valid JSON.
+    """
+    try:
+        return json.loads(line)
+    except ValueError as e:
+        raise ValidationError(f'Invalid line in replica stream: {e}')
@@ -1,9 +1,21 @@
-"""REST API handlers/clients for the replication system."""
+"""REST API handlers/clients for the replication system.
+
+Updates are sent either as a JSON document, or in the more compact
+replica stream format for clients that ask for it in their Accept
+header. The stream is gzip-compressed if the client accepts that, and
+the client asks for updates of limited size, so that replicas of large
+data sets are bootstrapped in steps.
+"""
+from contextlib import contextmanager
 from datetime import datetime, timedelta
 import logging
 from pathlib import Path
 import requests
-from typing import Dict, Generic, Optional, Tuple, Type, TypeVar, Union
+from threading import BoundedSemaphore
+from typing import (
+        Dict, Generic, Iterable, Iterator, Optional, Tuple, Type, TypeVar,
+        Union)
+import zlib
 
 from falcon import Request, Response
 from retrying import retry
@@ -14,6 +26,8 @@ from mahiru.definitions.policy import Rule
 from mahiru.policy.replication import PolicyUpdate
 from mahiru.registry.replication import RegistryUpdate
 from mahiru.replication import ReplicaUpdate
+from mahiru.rest.replica_stream import (
+        decode_update, encode_update, STREAM_MEDIA_TYPE)
 from mahiru.rest.serialization import serialize, deserialize
 from mahiru.rest.validation import validate_json
 
@@ -24,33 +38,154 @@ logger = logging.getLogger(__name__)
 T = TypeVar('T')
 
 
+# Time (s) to wait for a connection to the server
+_CONNECT_TIMEOUT = 10.0
+
+# Maximum time (s) a client may ask us to wait for changes. This needs
+# to be well below the timeouts of any proxies in between.
+_MAX_WAIT = 30.0
+
+# Maximum number of versions a client asks for in one update
+_PAGE_SIZE = 1000
+
+# Size of the chunks to compress and send, and to receive
+_STREAM_CHUNK_SIZE = 64 * 1024
+
+
 def _retry_on_connection_error(exception: BaseException) -> bool:
     """Helper for retrying connections."""
     return isinstance(exception, requests.ConnectionError)
 
 
+def _accepts_stream(request: Request) -> bool:
+    """Whether the client asked for the replica stream format.
+
+    We only send it if it's listed explicitly, so that clients which
+    accept anything get the JSON format they've always got.
+    """
+    accept = request.get_header('Accept') or ''
+    media_types = [t.split(';')[0].strip() for t in accept.split(',')]
+    return STREAM_MEDIA_TYPE in media_types
+
+
+def _gzip(chunks: Iterable[bytes]) -> Iterator[bytes]:
+    """Compress a stream of chunks using gzip.
+
+    Args:
+        chunks: Data to compress.
+
+    Yields:
+        Compressed data, in chunks of around _STREAM_CHUNK_SIZE.
+    """
+    compressor = zlib.compressobj(6, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+    buf = bytearray()
+    for chunk in chunks:
+        buf += compressor.compress(chunk)
+        if len(buf) >= _STREAM_CHUNK_SIZE:
+            yield bytes(buf)
+            buf.clear()
+    buf += compressor.flush()
+    yield bytes(buf)
+
+
+class LongPollLimiter:
+    """Limits the number of requests that wait at the same time.
+
+    Every long poll ties up a server thread while it waits, so their
+    number has to stay below the number of threads, or there won't be
+    any left for other requests. The server's thread pool is sized
+    from the same limit, see site-gunicorn.conf.py and
+    registry-gunicorn.conf.py.
+    """
+    def __init__(self, max_waiting: int) -> None:
+        """Create a LongPollLimiter.
+
+        Args:
+            max_waiting: Maximum number of requests which may wait at
+                    the same time.
+        """
+        self._slots = BoundedSemaphore(max_waiting) if max_waiting else None
+
+    @contextmanager
+    def wait(self, wait: float) -> Iterator[float]:
+        """Take a slot for a request that wants to wait.
+
+        Use as a context manager around handling of the request.
+
+        Args:
+            wait: Time (s) the request asked to wait.
+
+        Yields:
+            The time the request may wait, which is 0 if it didn't ask
+            to wait or if too many requests are waiting already.
+        """
+        if wait <= 0.0 or self._slots is None:
+            yield 0.0
+        elif not self._slots.acquire(blocking=False):
+            logger.warning(f'Too many long polls, not waiting')
+            yield 0.0
+        else:
+            try:
+                yield wait
+            finally:
+                self._slots.release()
+
+
 class ReplicationHandler(Generic[T]):
     """A handler for a /updates REST API endpoint."""
-    def __init__(self, service: IReplicationService[T]) -> None:
+    def __init__(
+            self, service: IReplicationService[T],
+            limiter: Optional[LongPollLimiter] = None) -> None:
         """Create a Replication handler.
 
         Args:
             service: The service to get updates from.
+            limiter: Limits the number of waiting requests. Requests
+                    that would wait over the limit are answered
+                    straight away, so that the client falls back to
+                    polling.
         """
         self._service = service
+        self._limiter = limiter
 
     def on_get(self, request: Request, response: Response) -> None:
         """Handle a registry update request.
 
+        If a wait parameter is given, and there are no updates yet,
+        then this waits for at most that many seconds for one to
+        arrive before replying, so that clients can long poll. If a
+        limit is given, then the update advances by at most that
+        many versions.
+
         Args:
             request: The submitted request.
             response: A response object to configure.
         """
         from_version = request.get_param_as_int(
                 'from_version', required=True)
+        wait = request.get_param_as_float('wait', min_value=0.0) or 0.0
+        limit = request.get_param_as_int('limit', min_value=1)
+
+        wait = min(wait, _MAX_WAIT)
+        if self._limiter is None:
+            updates = self._service.get_updates_since(
+                    from_version, wait, limit)
+        else:
+            with self._limiter.wait(wait) as allowed_wait:
+                updates = self._service.get_updates_since(
+                        from_version, allowed_wait, limit)
 
-        updates = self._service.get_updates_since(from_version)
-        response.media = serialize(updates)
+        response.set_header('Vary', 'Accept, Accept-Encoding')
+        if not _accepts_stream(request):
+            response.media = serialize(updates)
+            return
+
+        response.content_type = STREAM_MEDIA_TYPE
+        stream = encode_update(updates)
+        if 'gzip' in (request.get_header('Accept-Encoding') or ''):
+            response.set_header('Content-Encoding', 'gzip')
+            stream = _gzip(stream)
+        response.stream = stream
 
 
 class ReplicationRestClient(IReplicationService[T]):
@@ -59,8 +194,8 @@ class ReplicationRestClient(IReplicationService[T]):
 
     def __init__(
             self, endpoint: str, trust_store: Optional[Path],
-            client_credentials: Optional[Tuple[Path, Path]] = None
-            ) -> None:
+            client_credentials: Optional[Tuple[Path, Path]] = None,
+            page_size: int = _PAGE_SIZE) -> None:
         """Create a ReplicationRestClient.
 
         Note that UpdateType must be set to ReplicaUpdate[T] with the
@@ -74,8 +209,11 @@ class ReplicationRestClient(IReplicationService[T]):
             client_credentials: Paths to PEM files containing the HTTPS
                     client certificate and key to use for
                     authentication.
+            page_size: Maximum number of versions to ask for in one
+                    request.
         """
         self._endpoint = endpoint
+        self._page_size = page_size
 
         # Convert trust store to argument for verify option of requests
         if trust_store:
@@ -90,30 +228,62 @@ class ReplicationRestClient(IReplicationService[T]):
                     str(client_credentials[0]), str(client_credentials[1]))
 
     def get_updates_since(
-            self, from_version: Optional[int]) -> ReplicaUpdate[T]:
+            self, from_version: Optional[int], wait: float = 0.0,
+            limit: Optional[int] = None
+            ) -> ReplicaUpdate[T]:
         """Get updates since the given version.
 
+        Servers that support it send the update in the replica stream
+        format, which is decoded and validated as it comes in. Older
+        ones send JSON, and may send the whole update at once.
+
         Args:
             from_version: Version to start at, None to get all updates.
+            wait: If there are no changes yet, ask the server to wait
+                    at most this many seconds for one.
+            limit: Maximum number of versions to advance by, defaults
+                    to the page size.
         """
-        params = dict()     # type: Dict[str, int]
+        params = dict()     # type: Dict[str, Union[int, float]]
         if from_version is not None:
             params['from_version'] = from_version
+        if wait > 0.0:
+            params['wait'] = wait
+        params['limit'] = limit if limit is not None else self._page_size
 
-        r = self._retry_http_get(params)
+        with self._retry_http_get(params, wait) as r:
+            if r.status_code != 200:
+                raise RuntimeError(
+                        f'Error getting updates from {self._endpoint}:'
+                        f' {r.status_code} {r.reason}')
 
-        update_json = r.json()
-        validate_json(self.UpdateType.__name__, update_json)
-        return deserialize(self.UpdateType, update_json)
+            content_type = r.headers.get('Content-Type', '')
+            if content_type.split(';')[0].strip() == STREAM_MEDIA_TYPE:
+                return decode_update(
+                        self.UpdateType, r.iter_lines(_STREAM_CHUNK_SIZE))
+
+            update_json = r.json()
+            validate_json(self.UpdateType.__name__, update_json)
+            return deserialize(self.UpdateType, update_json)
 
     @retry(                                             # type: ignore
             stop_max_delay=20000, wait_fixed=500,
             retry_on_exception=_retry_on_connection_error)
-    def _retry_http_get(self, params: Dict[str, int]) -> requests.Response:
-        """Do an HTTP get and retry for a while on failure."""
+    def _retry_http_get(
+            self, params: Dict[str, Union[int, float]], wait: float
+            ) -> requests.Response:
+        """Do an HTTP get and retry for a while on failure.
+
+        Args:
+            params: Query parameters to send.
+            wait: Time (s) the server may wait before replying.
+        """
         return requests.get(
                 self._endpoint, params=params, verify=self._verify,
-                cert=self._cred)
+                cert=self._cred, timeout=(_CONNECT_TIMEOUT, wait + 30.0),
+                headers={
+                    'Accept': f'{STREAM_MEDIA_TYPE}, application/json;q=0.5'},
+                stream=True)
 
 
 class PolicyRestClient(ReplicationRestClient[Rule]):
@@ -405,15 +405,19 @@ def _deserialize_connection_request(user_input: JSON) -> ConnectionRequest:
 
 def _serialize_wireguard_connection_info(
         connection: WireGuardConnectionInfo) -> JSON:
-    return {
-            'conn_id': connection.conn_id,
-            'endpoint': _serialize_wireguard_endpoint(connection.endpoint)}
+    result = dict()     # type: JSON
+    result['conn_id'] = connection.conn_id
+    result['endpoint'] = _serialize_wireguard_endpoint(connection.endpoint)
+    if connection.net is not None:
+        result['net'] = connection.net
+    return result
 
 
 def _deserialize_connection_info(user_input: JSON) -> ConnectionInfo:
     return WireGuardConnectionInfo(
             user_input['conn_id'],
-            _deserialize_wireguard_endpoint(user_input['endpoint']))
+            _deserialize_wireguard_endpoint(user_input['endpoint']),
+            user_input.get('net'))
 
 
 # Results
@@ -451,6 +455,8 @@ def _serialize_replica_update(update: IReplicaUpdate[_SerializableT]) -> JSON:
     result['valid_until'] = update.valid_until.isoformat()
     result['created'] = [serialize(o) for o in update.created]
     result['deleted'] = [serialize(o) for o in update.deleted]
+    if update.partial:
+        result['partial'] = True
     return result
 
 
@@ -468,7 +474,8 @@ def _deserialize_replica_update(
             {deserialize(update_type.ReplicatedType, o)
                 for o in user_input['created']},
             {deserialize(update_type.ReplicatedType, o)
-                for o in user_input['deleted']})
+                for o in user_input['deleted']},
+            user_input.get('partial', False))
 
 
 def _deserialize_policy_update(user_input: JSON) -> PolicyUpdate:
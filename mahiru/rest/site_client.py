@@ -1,16 +1,49 @@
 """Client for external REST APIs."""
+from base64 import b64decode
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor
+import logging
 from pathlib import Path
 import requests
-from typing import Optional, Tuple, Union
+from typing import BinaryIO, Deque, Dict, Optional, Tuple, Union
 from urllib.parse import quote
 
 from mahiru.definitions.assets import Asset
 from mahiru.definitions.connections import ConnectionInfo, ConnectionRequest
 from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.workflows import ExecutionRequest
+from mahiru.metrics import REGISTRY
 from mahiru.rest.serialization import deserialize, serialize
 from mahiru.rest.validation import validate_json
 from mahiru.components.registry_client import RegistryClient
+from mahiru.util import file_digest
+
+
+logger = logging.getLogger(__name__)
+
+
+# Size of the parts that images are downloaded in
+_DOWNLOAD_PART_SIZE = 16 * 1024 * 1024
+
+# Number of times to resume a part after a failed transfer
+_DOWNLOAD_RETRIES = 3
+
+# Time (s) to wait for a connection to a site
+_CONNECT_TIMEOUT = 10.0
+
+
+_request_seconds = REGISTRY.histogram(
+        'mahiru_site_client_request_seconds',
+        'Time taken by requests to other sites, by operation',
+        ['operation'])
+
+_image_download_seconds = REGISTRY.histogram(
+        'mahiru_image_download_seconds',
+        'Time taken to download an asset image from another site')
+
+_image_download_bytes = REGISTRY.counter(
+        'mahiru_image_download_bytes_total',
+        'Amount of asset image data downloaded from other sites')
 
 
 class SiteRestClient:
@@ -18,8 +51,8 @@ class SiteRestClient:
     def __init__(
             self, site: str, registry_client: RegistryClient,
             trust_store: Optional[Path] = None,
-            client_credentials: Optional[Tuple[Path, Path]] = None
-            ) -> None:
+            client_credentials: Optional[Tuple[Path, Path]] = None,
+            download_connections: int = 4) -> None:
         """Create a SiteRestClient.
 
         Args:
@@ -28,8 +61,11 @@ class SiteRestClient:
             trust_store: A file with trusted certificates/anchors.
             client_credentials: An HTTPS client certificate and the
                     corresponding key, as paths to PEM files.
+            download_connections: Maximum number of connections to
+                    download an image over in parallel.
         """
         self._site = site
+        self._download_connections = download_connections
         self._registry_client = registry_client
         if trust_store:
             self._verify = str(trust_store)     # type: Union[str, bool]
@@ -42,9 +78,23 @@ class SiteRestClient:
             self._cred = (
                     str(client_credentials[0]), str(client_credentials[1]))
 
-    def retrieve_asset(self, site_id: Identifier, asset_id: Identifier
-                       ) -> Asset:
-        """Obtains an asset from a store."""
+    def retrieve_asset(
+            self, site_id: Identifier, asset_id: Identifier,
+            wait: float = 0.0) -> Asset:
+        """Obtains an asset from a store.
+
+        Args:
+            site_id: The site whose store to get the asset from.
+            asset_id: The asset to get.
+            wait: If the asset isn't there yet, ask the store to wait
+                    at most this many seconds for it to appear, so
+                    that it's returned as soon as it is stored.
+
+        Raises:
+            KeyError: If the asset was not found.
+            RuntimeError: If the site was not found, or there was an
+                    error.
+        """
         try:
             site = self._registry_client.get_site_by_id(site_id)
         except KeyError:
@@ -52,10 +102,16 @@ class SiteRestClient:
 
         if site.has_store:
             safe_asset_id = quote(asset_id, safe='')
-            r = requests.get(
-                    f'{site.endpoint}/assets/{safe_asset_id}',
-                    params={'requester': self._site},
-                    verify=self._verify, cert=self._cred)
+            params = {'requester': self._site}
+            timeout = None  # type: Optional[Tuple[float, float]]
+            if wait > 0.0:
+                params['wait'] = str(wait)
+                timeout = (_CONNECT_TIMEOUT, wait + 30.0)
+            with _request_seconds.time(operation='retrieve_asset'):
+                r = requests.get(
+                        f'{site.endpoint}/assets/{safe_asset_id}',
+                        params=params, verify=self._verify, cert=self._cred,
+                        timeout=timeout)
             if r.status_code == 404:
                 raise KeyError('Asset not found')
             elif not r.ok:
@@ -73,28 +129,202 @@ class SiteRestClient:
         This downloads the image at the given location into a file at
         the given path.
 
+        If the server supports range requests, then the image is
+        downloaded in parts over several connections in parallel,
+        into a file of the final size that's created up front. Parts
+        whose transfer fails are resumed where they stopped. If the
+        server sends a digest, the file is checked against it.
+
         Args:
             asset_location: URL of the image to download.
             target: Path of the file to save.
+
+        Raises:
+            KeyError: If the image was not found.
+            RuntimeError: If the image could not be downloaded.
         """
-        with requests.get(
-                asset_location,
-                params={'requester': self._site},
-                stream=True, verify=self._verify, cert=self._cred) as r:
-            if r.status_code == 404:
-                raise KeyError('Asset image not found')
-            elif not r.ok:
-                raise RuntimeError('Server error when retrieving asset image')
+        with _image_download_seconds.time():
+            self._retrieve_asset_image(asset_location, target)
 
-            if r.headers.get('Transfer-Encoding', '') == 'chunked':
-                chunk_size = None
-            else:
-                chunk_size = 1024 * 1024
+    def retrieve_asset_image_digest(
+            self, asset_location: str) -> Optional[bytes]:
+        """Obtains the digest of an asset image from a store.
 
-            with target.open('wb') as f:
-                for chunk in r.iter_content(chunk_size):
-                    if chunk:
-                        f.write(chunk)
+        This requests only the first byte of the image, and returns
+        the SHA-256 digest the server sends along with it.
+
+        Args:
+            asset_location: URL of the image.
+
+        Return:
+            The digest, or None if the server didn't send one.
+
+        Raises:
+            KeyError: If the image was not found.
+            RuntimeError: If there was a server error.
+        """
+        with requests.Session() as session:
+            with self._get_image(session, asset_location, 0, 0, None) as r:
+                digest = r.headers.get('Digest')
+
+        if digest is None:
+            return None
+        return _sha256_digest(digest)
+
+    def _retrieve_asset_image(
+            self, asset_location: str, target: Path) -> None:
+        """Obtains an asset image from a store.
+
+        See retrieve_asset_image().
+
+        Args:
+            asset_location: URL of the image to download.
+            target: Path of the file to save.
+        """
+        with requests.Session() as session:
+            with self._get_image(
+                    session, asset_location, 0, _DOWNLOAD_PART_SIZE - 1,
+                    None) as r:
+                digest = r.headers.get('Digest')
+                etag = r.headers.get('ETag')
+                if r.status_code == 416:
+                    # empty image, nothing to download
+                    size = 0
+                    received = 0
+                    target.write_bytes(b'')
+                elif r.status_code == 206:
+                    size = _content_range_size(r.headers['Content-Range'])
+                    with target.open('wb') as f:
+                        f.truncate(size)
+                        try:
+                            received = _write_content(r, f)
+                        except requests.RequestException as e:
+                            # resume below
+                            logger.warning(
+                                    f'Transfer of {asset_location} failed:'
+                                    f' {e}')
+                            received = f.tell()
+                else:
+                    with target.open('wb') as f:
+                        _write_content(r, f)
+                    size = received = 0
+
+        if received < size:
+            self._download_parts(asset_location, target, etag, received, size)
+
+        if digest is not None:
+            _check_digest(target, digest)
+
+    def _download_parts(
+            self, asset_location: str, target: Path, etag: Optional[str],
+            start: int, size: int) -> None:
+        """Download the rest of an image in parallel.
+
+        Args:
+            asset_location: URL of the image to download.
+            target: Path of the file to save to, of the final size.
+            etag: ETag of the image, to detect changes.
+            start: Position to start downloading from.
+            size: Size of the image.
+        """
+        parts = deque()     # type: Deque[Tuple[int, int]]
+        for first in range(start, size, _DOWNLOAD_PART_SIZE):
+            parts.append((first, min(first + _DOWNLOAD_PART_SIZE, size) - 1))
+
+        def download() -> None:
+            with requests.Session() as session, target.open('r+b') as f:
+                while True:
+                    try:
+                        first, last = parts.popleft()
+                    except IndexError:
+                        return
+                    try:
+                        self._download_part(
+                                session, asset_location, f, etag, first,
+                                last)
+                    except Exception:
+                        # don't let the other connections continue
+                        parts.clear()
+                        raise
+
+        num_connections = min(self._download_connections, len(parts))
+        with ThreadPoolExecutor(num_connections) as pool:
+            futures = [pool.submit(download) for _ in range(num_connections)]
+            for future in futures:
+                future.result()
+
+    def _download_part(
+            self, session: requests.Session, asset_location: str,
+            f: BinaryIO, etag: Optional[str], first: int, last: int
+            ) -> None:
+        """Download a part of an image, resuming if it fails.
+
+        Args:
+            session: The session to download with.
+            asset_location: URL of the image to download.
+            f: The file to write to.
+            etag: ETag of the image, to detect changes.
+            first: First byte to download.
+            last: Last byte to download.
+        """
+        position = first
+        retries = 0
+        while position <= last:
+            f.seek(position)
+            try:
+                with self._get_image(
+                        session, asset_location, position, last, etag) as r:
+                    if r.status_code != 206:
+                        raise RuntimeError(
+                                'Image changed or range requests no'
+                                ' longer supported during download')
+                    position += _write_content(r, f)
+            except requests.RequestException as e:
+                logger.warning(
+                        f'Transfer of {asset_location} failed at byte'
+                        f' {position}: {e}')
+
+            if position <= last:
+                retries += 1
+                if retries > _DOWNLOAD_RETRIES:
+                    raise RuntimeError(
+                            f'Could not download {asset_location}')
+
+    def _get_image(
+            self, session: requests.Session, asset_location: str,
+            first: int, last: int, etag: Optional[str]
+            ) -> requests.Response:
+        """Request part of an image.
+
+        Args:
+            session: The session to make the request with.
+            asset_location: URL of the image.
+            first: First byte of the range to request.
+            last: Last byte of the range to request.
+            etag: If given, get the whole image if it doesn't match.
+
+        Return:
+            A streaming response.
+
+        Raises:
+            KeyError: If the image was not found.
+            RuntimeError: If there was a server error.
+        """
+        headers = {'Range': f'bytes={first}-{last}'}
+        if etag is not None:
+            headers['If-Range'] = etag
+
+        r = session.get(
+                asset_location, params={'requester': self._site},
+                headers=headers, stream=True, verify=self._verify,
+                cert=self._cred)
+        if r.status_code == 404:
+            r.close()
+            raise KeyError('Asset image not found')
+        elif not r.ok and r.status_code != 416:
+            r.close()
+            raise RuntimeError('Server error when retrieving asset image')
+        return r
 
     def connect_to_asset(
             self, asset_id: Identifier, request: ConnectionRequest
@@ -121,10 +351,12 @@ class SiteRestClient:
 
         if site.has_store:
             safe_asset_id = quote(asset_id, safe='')
-            r = requests.post(
-                    f'{site.endpoint}/assets/{safe_asset_id}/connect',
-                    params={'requester': self._site}, json=serialize(request),
-                    verify=self._verify, cert=self._cred)
+            with _request_seconds.time(operation='connect_to_asset'):
+                r = requests.post(
+                        f'{site.endpoint}/assets/{safe_asset_id}/connect',
+                        params={'requester': self._site},
+                        json=serialize(request), verify=self._verify,
+                        cert=self._cred)
             if not r.ok:
                 raise RuntimeError('Could not connect to asset')
 
@@ -151,10 +383,11 @@ class SiteRestClient:
         except KeyError:
             raise RuntimeError(f'Site or store at site {site_id} not found')
 
-        r = requests.delete(
-                f'{site.endpoint}/connections/{conn_id}',
-                params={'requester': self._site}, verify=self._verify,
-                cert=self._cred)
+        with _request_seconds.time(operation='disconnect_asset'):
+            r = requests.delete(
+                    f'{site.endpoint}/connections/{conn_id}',
+                    params={'requester': self._site}, verify=self._verify,
+                    cert=self._cred)
         if not r.ok:
             raise RuntimeError('Could not disconnect asset')
 
@@ -173,8 +406,90 @@ class SiteRestClient:
             raise RuntimeError(f'Site or runner at site {site_id} not found')
 
         if site.has_runner:
-            requests.post(
-                    f'{site.endpoint}/jobs', json=serialize(request),
-                    verify=self._verify, cert=self._cred)
+            with _request_seconds.time(operation='submit_request'):
+                requests.post(
+                        f'{site.endpoint}/jobs', json=serialize(request),
+                        verify=self._verify, cert=self._cred)
         else:
             raise ValueError(f'Site {site_id} does not have a runner')
+
+
+def _write_content(r: requests.Response, f: BinaryIO) -> int:
+    """Write the body of a streaming response to a file.
+
+    Args:
+        r: The response to read from.
+        f: The file to write to, at the current position.
+
+    Return:
+        The number of bytes written.
+    """
+    if r.headers.get('Transfer-Encoding', '') == 'chunked':
+        chunk_size = None
+    else:
+        chunk_size = 1024 * 1024
+
+    written = 0
+    try:
+        for chunk in r.iter_content(chunk_size):
+            if chunk:
+                f.write(chunk)
+                written += len(chunk)
+    finally:
+        _image_download_bytes.inc(written)
+    return written
+
+
+def _content_range_size(content_range: str) -> int:
+    """Get the total size from a Content-Range header.
+
+    Args:
+        content_range: Value of the header, e.g. bytes 0-9/100.
+
+    Raises:
+        RuntimeError: If the header is invalid.
+    """
+    try:
+        return int(content_range.split('/')[1])
+    except (IndexError, ValueError):
+        raise RuntimeError(f'Invalid Content-Range {content_range}')
+
+
+def _sha256_digest(digest_header: str) -> Optional[bytes]:
+    """Extract the SHA-256 digest from a Digest header.
+
+    Args:
+        digest_header: Value of the Digest header.
+
+    Return:
+        The digest, or None if the header doesn't have a valid
+        SHA-256 one.
+    """
+    digests = dict()    # type: Dict[str, str]
+    for item in digest_header.split(','):
+        algorithm, _, value = item.strip().partition('=')
+        digests[algorithm.lower()] = value
+
+    if 'sha-256' not in digests:
+        return None
+    try:
+        return b64decode(digests['sha-256'], validate=True)
+    except ValueError:
+        return None
+
+
+def _check_digest(target: Path, digest_header: str) -> None:
+    """Check a downloaded file against a Digest header.
+
+    Only SHA-256 digests are checked, others are ignored.
+
+    Args:
+        target: The file to check.
+        digest_header: Value of the Digest header.
+
+    Raises:
+        RuntimeError: If the file doesn't match.
+    """
+    digest = _sha256_digest(digest_header)
+    if digest is not None and file_digest(target) != digest:
+        raise RuntimeError(f'Downloaded image {target} is corrupt')
@@ -1,4 +1,6 @@
 """Small generic utilities."""
+from hashlib import sha256
+from pathlib import Path
 from typing import Any
 
 
@@ -17,3 +19,19 @@ class ComparesByValue:
         """Return a hash value for this object."""
         sorted_items = sorted(self.__dict__.items())
         return hash((self.__class__.__name__, tuple(sorted_items)))
+
+
+def file_digest(path: Path) -> bytes:
+    """Return the SHA-256 digest of a file.
+
+    The file is read in blocks, so that large files don't need to fit
+    into memory.
+
+    Args:
+        path: The file to hash.
+    """
+    hasher = sha256()
+    with path.open('rb') as f:
+        for block in iter(lambda: f.read(1024 * 1024), b''):
+            hasher.update(block)
+    return hasher.digest()
@@ -0,0 +1,20 @@
+# Benchmark WireGuard connection setup and teardown.
+#
+# This needs to run as root (or with sudo), with Docker available, and with
+# the net-admin-helper and pilot images built (see install.sh and the main
+# Makefile). Any arguments are passed on to pytest. The sweep can be changed
+# by setting these variables, which take comma-separated lists:
+#
+#   MAHIRU_BENCHMARK_CONCURRENCY   number of jobs in parallel (1,10,100)
+#   MAHIRU_BENCHMARK_INPUTS        number of inputs per job (1,4)
+#   MAHIRU_BENCHMARK_HELPER_MODES  net-admin-helper modes (container,daemon)
+#
+# The results are written to benchmark.json, or to MAHIRU_BENCHMARK_REPORT.
+
+cd "$(dirname "$0")/.."
+
+export MAHIRU_BENCHMARK=1
+export MAHIRU_BENCHMARK_REPORT="${MAHIRU_BENCHMARK_REPORT:-benchmark.json}"
+
+python3 -m pytest -p no:cacheprovider --no-cov -o log_cli=true \
+    tests/test_network_benchmark.py "$@"
@@ -0,0 +1,33 @@
+# Benchmark complete workflows on a set of local sites.
+#
+# This needs Docker, the pilot image and the test asset images (use
+# 'make scenario_benchmark' to build them and run this). Any arguments are
+# passed on to pytest. The sweep can be changed by setting these variables,
+# which take comma-separated lists:
+#
+#   MAHIRU_BENCHMARK_STEP_MODES   how steps are run (plain,container)
+#   MAHIRU_BENCHMARK_SITES        number of sites (2,4)
+#   MAHIRU_BENCHMARK_SUBMITTERS   number of concurrent submitters (1,4)
+#   MAHIRU_BENCHMARK_WIDTHS       number of parallel steps per layer (2)
+#   MAHIRU_BENCHMARK_DEPTHS       number of layers of steps (2)
+#   MAHIRU_BENCHMARK_DATA_SIZES   input data size in MiB, container mode (1,64)
+#   MAHIRU_BENCHMARK_RULES        number of extra rules per site (0,1000)
+#
+# The sites are configured using these, which take a single value:
+#
+#   MAHIRU_BENCHMARK_PILOT_POOL_SIZE   warm pilot containers per site (0)
+#   MAHIRU_BENCHMARK_STEP_SLOTS        concurrent steps per site (number of CPUs)
+#   MAHIRU_BENCHMARK_IMAGE_CACHE_SIZE  image cache size in bytes (default)
+#   MAHIRU_BENCHMARK_STATE             memory or sqlite (memory)
+#
+# The results are written to scenario_benchmark.json, or to
+# MAHIRU_BENCHMARK_REPORT, together with MAHIRU_BENCHMARK_LABEL if set. Use
+# compare.py to compare a report to a baseline.
+
+cd "$(dirname "$0")/../.."
+
+export MAHIRU_BENCHMARK=1
+export MAHIRU_BENCHMARK_REPORT="${MAHIRU_BENCHMARK_REPORT:-scenario_benchmark.json}"
+
+python3 -m pytest -p no:cacheprovider --no-cov -o log_cli=true \
+    tests/test_scenario_benchmark.py "$@"
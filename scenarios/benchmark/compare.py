@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Compare two scenario benchmark reports.
+
+Usage: compare.py <baseline.json> <new.json>
+
+Runs with the same parameters are paired up, and for each pair the
+throughput and latencies are printed, with the ratio of the new value
+to the baseline. Runs that are in only one of the reports are skipped.
+"""
+import json
+import sys
+from typing import Any, Dict, Optional, Tuple
+
+
+PARAMS = (
+        'step_mode', 'sites', 'submitters', 'width', 'depth', 'data_size',
+        'rules')
+
+STATISTICS = (
+        'jobs_per_second', 'job_latency_p50', 'job_latency_p99',
+        'step_start_latency_mean', 'bytes_transferred')
+
+
+def load_runs(path: str) -> Dict[Tuple[Any, ...], Dict[str, Any]]:
+    """Load a report and index its runs by their parameters."""
+    with open(path, 'r') as f:
+        report = json.load(f)
+
+    print(f'{path}: {report["label"] or "(no label)"}, {report["settings"]}')
+    return {
+            tuple(run[param] for param in PARAMS): run
+            for run in report['runs']}
+
+
+def fmt(value: Optional[float]) -> str:
+    """Format a statistic."""
+    if value is None:
+        return '-'
+    return f'{value:.4g}'
+
+
+def ratio(baseline: Optional[float], new: Optional[float]) -> str:
+    """Format the ratio of two values."""
+    if baseline is None or new is None or baseline == 0.0:
+        return '-'
+    return f'{new / baseline:.2f}x'
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+
+    baseline_runs = load_runs(sys.argv[1])
+    new_runs = load_runs(sys.argv[2])
+
+    for key, new in new_runs.items():
+        baseline = baseline_runs.get(key)
+        if baseline is None:
+            continue
+
+        print()
+        print(', '.join(f'{p}={v}' for p, v in zip(PARAMS, key)))
+        for stat in STATISTICS:
+            old_value, new_value = baseline[stat], new[stat]
+            print(
+                    f'    {stat:24} {fmt(old_value):>12} {fmt(new_value):>12}'
+                    f' {ratio(old_value, new_value)}')
+        if new['failed_jobs'] or baseline['failed_jobs']:
+            print(
+                    f'    failed jobs: {baseline["failed_jobs"]} in baseline,'
+                    f' {new["failed_jobs"]} in new')
@@ -13,6 +13,7 @@ from mahiru.definitions.assets import DataAsset
 from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.registry import RegisteredObject
 from mahiru.replication import ReplicaUpdate
+from mahiru.rest import site_client
 from mahiru.rest.site_client import SiteRestClient
 from mahiru.rest.ddm_site import AssetImageAccessHandler, ThreadingWSGIServer
 
@@ -78,3 +79,52 @@ def test_asset_download(
         image_data = f.read()
 
     assert image_data == 'testing'
+
+
+def test_asset_download_parallel(
+        temp_path, asset_id, image_server, mock_empty_registry_client,
+        monkeypatch):
+
+    monkeypatch.setattr(site_client, '_DOWNLOAD_PART_SIZE', 2)
+    client = SiteRestClient(
+            'site:ns:site', mock_empty_registry_client,
+            download_connections=3)
+
+    download_path = temp_path / 'retrieved_image.tar.gz'
+    client.retrieve_asset_image(
+            f'{image_server}/assets/{asset_id}/image', download_path)
+
+    assert download_path.read_text() == 'testing'
+
+
+def test_asset_image_range(asset_id, image_server):
+    url = f'{image_server}/assets/{asset_id}/image'
+    params = {'requester': 'site:ns:site'}
+
+    r = requests.get(url, params=params)
+    assert r.status_code == 200
+    assert r.headers['Accept-Ranges'] == 'bytes'
+    assert r.content == b'testing'
+    etag = r.headers['ETag']
+
+    r = requests.get(url, params=params, headers={'Range': 'bytes=1-3'})
+    assert r.status_code == 206
+    assert r.headers['Content-Range'] == 'bytes 1-3/7'
+    assert r.content == b'est'
+
+    r = requests.get(url, params=params, headers={'Range': 'bytes=-2'})
+    assert r.status_code == 206
+    assert r.content == b'ng'
+
+    r = requests.get(url, params=params, headers={
+        'Range': 'bytes=4-', 'If-Range': etag})
+    assert r.status_code == 206
+    assert r.content == b'ing'
+
+    r = requests.get(url, params=params, headers={
+        'Range': 'bytes=4-', 'If-Range': '"outdated"'})
+    assert r.status_code == 200
+    assert r.content == b'testing'
+
+    r = requests.get(url, params=params, headers={'Range': 'bytes=7-'})
+    assert r.status_code == 416
@@ -1,4 +1,7 @@
+from hashlib import sha256
 from pathlib import Path
+from threading import Timer
+import time
 from unittest.mock import MagicMock
 
 import pytest
@@ -39,3 +42,53 @@ def test_asset_store_store_move(image_dir, test_image_file) -> None:
     assert not test_image_file.exists()
     with (image_dir / 'asset:ns:test_asset:ns:site.tar.gz').open('r') as f:
         assert f.read() == 'testing'
+
+
+def test_asset_store_image_digest(
+        image_dir, test_image_file, temp_path) -> None:
+    store = AssetStore(MagicMock(), MagicMock(), image_dir)
+
+    asset_id = Identifier('asset:ns:test_asset:ns:site')
+    with pytest.raises(KeyError):
+        store.image_digest(asset_id)
+
+    store.store(DataAsset(asset_id, None, str(test_image_file)))
+    assert store.image_digest(asset_id) == sha256(b'testing').digest()
+
+    new_image = temp_path / 'new_image.tar.gz'
+    new_image.write_text('testing again')
+    store.store_image(asset_id, new_image)
+    assert store.image_digest(asset_id) == sha256(b'testing again').digest()
+
+
+def test_asset_store_serve_digest(image_dir, test_image_file) -> None:
+    mock_domain_administrator = MagicMock()
+    store = AssetStore(MagicMock(), mock_domain_administrator, image_dir)
+
+    asset_id = Identifier('asset:ns:test_asset:ns:site')
+    store.store(DataAsset(asset_id, None, str(test_image_file)))
+    request = MagicMock()
+    store.serve(asset_id, request, MagicMock())
+
+    # so that the domain administrator can cache the image
+    mock_domain_administrator.serve_asset.assert_called_once()
+    _, _, digest = mock_domain_administrator.serve_asset.call_args[0]
+    assert digest == sha256(b'testing').digest()
+
+
+def test_asset_store_wait() -> None:
+    mock_policy_evaluator = MagicMock()
+    mock_domain_administrator = MagicMock()
+    store = AssetStore(mock_policy_evaluator, mock_domain_administrator)
+
+    asset_id = Identifier('asset:ns:test_asset:ns:site')
+    with pytest.raises(KeyError):
+        store.retrieve(asset_id, MagicMock(), 0.01)
+
+    asset = DataAsset(asset_id, 'data', None)
+    Timer(0.05, store.store, [asset]).start()
+    start = time.monotonic()
+    asset2 = store.retrieve(asset_id, MagicMock(), 10.0)
+    assert time.monotonic() - start < 5.0
+    assert asset2.data == 'data'
+    store.close()
@@ -0,0 +1,307 @@
+from hashlib import sha256
+import importlib.util
+import json
+from pathlib import Path
+from time import sleep
+from unittest.mock import MagicMock, patch
+
+import docker
+import pytest
+
+from mahiru.components.domain_administrator import PlainDockerDA
+from mahiru.definitions.assets import DataAsset
+
+
+_LIBMAHIRU_FILE = (
+        Path(__file__).parents[1] / 'docker' / 'assets' / 'libmahiru.py')
+
+
+class FakeImages:
+    """Imitates DockerClient.images, with images of 100 bytes."""
+    def __init__(self):
+        self.images = dict()
+        self.loads = 0
+        self.removed = list()
+
+    def load(self, data):
+        data = data.read()
+        self.loads += 1
+        image = MagicMock()
+        image.id = f'sha256:{data.decode()}'
+        image.attrs = {'Size': 100}
+        self.images[image.id] = image
+        return [image]
+
+    def get(self, image_id):
+        if image_id not in self.images:
+            raise docker.errors.ImageNotFound('Not found')
+        return self.images[image_id]
+
+    def list(self, name=None):
+        return list()
+
+    def remove(self, image, force=False):
+        self.removed.append(image)
+        self.images.pop(image, None)
+
+
+@pytest.fixture
+def domain_administrator(tmp_path):
+    with patch('docker.from_env') as from_env:
+        images = FakeImages()
+        from_env.return_value.images = images
+        da = PlainDockerDA(MagicMock(), MagicMock(), 250)
+
+    assets = list()
+    for i in range(3):
+        image_file = tmp_path / f'image{i}.tar.gz'
+        image_file.write_bytes(f'image{i}'.encode())
+        assets.append(DataAsset(
+                f'asset:party1.mahiru.example.org:data{i}'
+                ':party1.mahiru.example.org:site1', None, str(image_file)))
+
+    return da, images, assets
+
+
+def _ensure_local_image(da, asset):
+    """Ensures an image, passing the digest the asset store keeps."""
+    digest = sha256(Path(asset.image_location).read_bytes()).digest()
+    return da._ensure_image_available(asset, image_digest=digest)
+
+
+def test_image_cache(domain_administrator):
+    da, images, assets = domain_administrator
+
+    _ensure_local_image(da, assets[0])
+    da._free_image(assets[0].id)
+    assert images.loads == 1
+    assert 'sha256:image0' in images.images
+
+    # cache hit
+    image = _ensure_local_image(da, assets[0])
+    assert image.id == 'sha256:image0'
+    assert images.loads == 1
+    da._free_image(assets[0].id)
+
+    # fill the cache, 0 is least recently used and goes first
+    _ensure_local_image(da, assets[1])
+    da._free_image(assets[1].id)
+    _ensure_local_image(da, assets[2])
+    da._free_image(assets[2].id)
+    assert images.loads == 3
+    assert 'sha256:image0' not in images.images
+    assert 'sha256:image1' in images.images
+    assert 'sha256:image2' in images.images
+
+
+def test_image_cache_replaced_image(domain_administrator):
+    da, images, assets = domain_administrator
+
+    _ensure_local_image(da, assets[0])
+    da._free_image(assets[0].id)
+
+    # same asset id, different image
+    Path(assets[0].image_location).write_bytes(b'image0b')
+    image = _ensure_local_image(da, assets[0])
+    assert image.id == 'sha256:image0b'
+    assert images.loads == 2
+    da._free_image(assets[0].id)
+
+
+def test_image_cache_no_digest(tmp_path):
+    with patch('docker.from_env') as from_env:
+        images = FakeImages()
+        from_env.return_value.images = images
+        site_rest_client = MagicMock()
+        da = PlainDockerDA(MagicMock(), site_rest_client, 250)
+
+    def retrieve_image(location, target):
+        target.write_bytes(b'image')
+
+    site_rest_client.retrieve_asset_image_digest.return_value = None
+    site_rest_client.retrieve_asset_image.side_effect = retrieve_image
+    asset = DataAsset(
+            'asset:party1.mahiru.example.org:data'
+            ':party1.mahiru.example.org:site1', None,
+            'https://site1.example.org/assets/data/image')
+
+    # without a digest, we can't tell whether it changed
+    da._ensure_image_available(asset, tmp_path)
+    da._free_image(asset.id)
+    assert images.removed == ['sha256:image']
+
+    # and we don't read local files to find out
+    image_file = tmp_path / 'local.tar.gz'
+    image_file.write_bytes(b'local')
+    local_asset = DataAsset(
+            'asset:party1.mahiru.example.org:local'
+            ':party1.mahiru.example.org:site1', None, str(image_file))
+    da._ensure_image_available(local_asset)
+    da._free_image(local_asset.id)
+    assert images.removed == ['sha256:image', 'sha256:local']
+
+
+def test_stream_image(domain_administrator):
+    da, images, assets = domain_administrator
+    images.load = MagicMock(wraps=images.load)
+    da._ensure_image_available(assets[0])
+    # we pass a file, not its contents
+    assert hasattr(images.load.call_args[0][0], 'read')
+
+
+def test_image_cache_disabled(tmp_path):
+    with patch('docker.from_env') as from_env:
+        images = FakeImages()
+        from_env.return_value.images = images
+        da = PlainDockerDA(MagicMock(), MagicMock(), 0)
+
+    image_file = tmp_path / 'image.tar.gz'
+    image_file.write_bytes(b'image')
+    asset = DataAsset(
+            'asset:party1.mahiru.example.org:data'
+            ':party1.mahiru.example.org:site1', None, str(image_file))
+
+    da._ensure_image_available(asset)
+    da._free_image(asset.id)
+    assert images.removed == ['sha256:image']
+
+
+def _fake_container(name):
+    container = MagicMock()
+    container.id = f'id-{name}'
+    container.name = name
+    return container
+
+
+def test_pilot_pool():
+    with patch('docker.from_env') as from_env:
+        dcli = from_env.return_value
+        dcli.containers.run.side_effect = (
+                lambda image, name, **kwargs: _fake_container(name))
+        da = PlainDockerDA(MagicMock(), MagicMock(), pilot_pool_size=2)
+
+        for _ in range(100):
+            with da._pilot_pool_cond:
+                if len(da._pilot_pool) == 2:
+                    break
+            sleep(0.01)
+        assert dcli.containers.run.call_count == 2
+
+        pilot = da._take_pilot_container(100)
+        assert pilot.name in ('mahiru-1-pilot', 'mahiru-2-pilot')
+
+        for _ in range(100):
+            with da._pilot_pool_cond:
+                if len(da._pilot_pool) == 2:
+                    break
+            sleep(0.01)
+        assert dcli.containers.run.call_count == 3
+
+        da.close()
+        assert not da._pilot_pool_thread.is_alive()
+        assert not da._pilot_pool
+
+
+def test_pilot_pool_disabled():
+    with patch('docker.from_env') as from_env:
+        dcli = from_env.return_value
+        dcli.containers.run.side_effect = (
+                lambda image, name, **kwargs: _fake_container(name))
+        da = PlainDockerDA(MagicMock(), MagicMock())
+
+        pilot = da._take_pilot_container(100)
+        assert pilot.name == 'mahiru-100-pilot'
+        assert dcli.containers.run.call_count == 1
+        da.close()
+
+
+def test_start_data_containers():
+    with patch('docker.from_env') as from_env:
+        dcli = from_env.return_value
+        dcli.containers.run.side_effect = (
+                lambda image, name, **kwargs: _fake_container(name))
+        da = PlainDockerDA(MagicMock(), MagicMock())
+
+    images = {name: MagicMock() for name in ('x', 'y', 'z')}
+    containers = da._start_data_containers(3, images, ['x', 'y', 'z'])
+    assert sorted(containers) == ['x', 'y', 'z']
+    assert containers['y'].name == 'mahiru-3-data-asset-y'
+
+    def fail_on_y(image, name, **kwargs):
+        if name.endswith('-y'):
+            raise RuntimeError('Failed to start')
+        return _fake_container(name)
+
+    dcli.containers.run.side_effect = fail_on_y
+    with pytest.raises(RuntimeError):
+        da._start_data_containers(4, images, ['x', 'y', 'z'])
+
+
+def test_create_config_string(tmp_path):
+    with patch('docker.from_env') as from_env:
+        dcli = from_env.return_value
+        da = PlainDockerDA(MagicMock(), MagicMock())
+
+    containers = {name: _fake_container(name) for name in ('x', 'y')}
+
+    def summary(name, addr, state='running'):
+        return {
+                'Id': f'id-{name}', 'State': state,
+                'NetworkSettings': {
+                    'Networks': {'bridge': {'IPAddress': addr}}}}
+
+    dcli.api.containers.return_value = [
+            summary('x', '172.17.0.2'), summary('y', '172.17.0.3')]
+
+    config = json.loads(da._create_config_string(
+            tmp_path, {'x': MagicMock()}, {'r': '10.0.0.2'}, ['y'],
+            containers))
+    assert config['inputs'] == {
+            'r': 'http://10.0.0.2', 'x': 'http://172.17.0.2'}
+    assert config['outputs'] == {'y': 'http://172.17.0.3'}
+
+    # one request for all containers
+    assert dcli.api.containers.call_count == 1
+    filters = dcli.api.containers.call_args[1]['filters']
+    assert sorted(filters['id']) == ['id-x', 'id-y']
+
+    dcli.api.containers.return_value = [
+            summary('x', '172.17.0.2'), summary('y', '', 'exited')]
+    with pytest.raises(RuntimeError):
+        da._create_config_string(
+                tmp_path, {'x': MagicMock()}, dict(), ['y'], containers)
+
+
+def test_config_string_read_by_libmahiru(tmp_path):
+    with patch('docker.from_env') as from_env:
+        dcli = from_env.return_value
+        da = PlainDockerDA(MagicMock(), MagicMock())
+
+    containers = {name: _fake_container(name) for name in ('x', 'y')}
+    dcli.api.containers.return_value = [
+            {
+                'Id': f'id-{name}', 'State': 'running',
+                'NetworkSettings': {
+                    'Networks': {'bridge': {'IPAddress': addr}}}}
+            for name, addr in (('x', '172.17.0.2'), ('y', '172.17.0.3'))]
+
+    config = da._create_config_string(
+            tmp_path, {'x': MagicMock()}, {'r': '10.0.0.2'}, ['y'],
+            containers)
+
+    # the compute container must see y as an output to upload, not as
+    # an input to download
+    spec = importlib.util.spec_from_file_location(
+            'libmahiru', _LIBMAHIRU_FILE)
+    libmahiru = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(libmahiru)
+
+    step = MagicMock()
+    libmahiru.register_streaming_step(step)
+    with patch.dict('os.environ', {'MAHIRU_STEP_CONFIG': config}):
+        libmahiru.run()
+
+    inputs, outputs = step.call_args[0]
+    assert sorted(inputs) == ['r', 'x']
+    assert sorted(outputs) == ['y']
+    assert outputs['y']._url == 'http://172.17.0.3/data.json'
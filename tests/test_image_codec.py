@@ -0,0 +1,28 @@
+import gzip
+import os
+
+from mahiru.components.image_codec import GzipCodec, ParallelGzipCodec
+
+
+def test_parallel_gzip(tmp_path):
+    data = os.urandom(10000) + b'mahiru' * 10000
+    chunks = [data[i:i + 3000] for i in range(0, len(data), 3000)]
+
+    out_path = tmp_path / 'image.tar.gz'
+    codec = ParallelGzipCodec(threads=3, block_size=4096)
+    codec.compress(chunks, out_path)
+
+    with gzip.open(str(out_path), 'rb') as f:
+        assert f.read() == data
+
+
+def test_parallel_gzip_empty(tmp_path):
+    out_path = tmp_path / 'image.tar.gz'
+    ParallelGzipCodec(threads=2).compress([], out_path)
+    assert gzip.decompress(out_path.read_bytes()) == b''
+
+
+def test_gzip(tmp_path):
+    out_path = tmp_path / 'image.tar.gz'
+    GzipCodec().compress([b'mahiru', b'data'], out_path)
+    assert gzip.decompress(out_path.read_bytes()) == b'mahirudata'
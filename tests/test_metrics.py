@@ -0,0 +1,116 @@
+from unittest.mock import MagicMock
+
+import pytest
+
+from mahiru.metrics import CONTENT_TYPE, REGISTRY, Registry
+from mahiru.rest.ddm_site import MetricsHandler
+
+
+def test_counter():
+    registry = Registry()
+    counter = registry.counter('test_total', 'Test counter', ['kind'])
+    counter.inc(kind='a')
+    counter.inc(2.0, kind='a')
+    counter.inc(kind='b')
+
+    assert counter.value(kind='a') == 3.0
+    assert counter.samples() == [(('a',), 3.0), (('b',), 1.0)]
+    assert registry.counter('test_total', 'Test counter', ['kind']) is counter
+
+    with pytest.raises(RuntimeError):
+        counter.inc(-1.0, kind='a')
+
+    with pytest.raises(RuntimeError):
+        counter.inc(other='a')
+
+
+def test_histogram():
+    registry = Registry()
+    histogram = registry.histogram(
+            'test_seconds', 'Test histogram', buckets=[0.1, 1.0])
+    histogram.observe(0.05)
+    histogram.observe(0.1)
+    histogram.observe(0.5)
+    histogram.observe(2.0)
+
+    assert histogram.count() == 4
+    (labels, data), = histogram.samples()
+    assert labels == ()
+    assert data.buckets == [2, 1, 1]
+    assert data.sum == pytest.approx(2.65)
+
+    with pytest.raises(RuntimeError):
+        registry.counter('test_seconds', 'Not a counter')
+
+
+def test_gauge():
+    registry = Registry()
+    gauge = registry.gauge('test_bytes', 'Test gauge', ['conn'])
+    gauge.set(10.0, conn='a')
+    gauge.set(5.0, conn='a')
+    gauge.set(1.0, conn='b')
+    assert gauge.value(conn='a') == 5.0
+
+    gauge.remove(conn='a')
+    assert gauge.samples() == [(('b',), 1.0)]
+
+
+def test_gauge_inc_dec():
+    registry = Registry()
+    gauge = registry.gauge('test_jobs', 'Test gauge')
+    gauge.inc()
+    gauge.inc(2.0)
+    gauge.dec()
+    assert gauge.value() == 2.0
+
+
+def test_histogram_time():
+    registry = Registry()
+    histogram = registry.histogram('test_seconds', 'Test histogram', ['op'])
+    with histogram.time(op='a'):
+        pass
+
+    with pytest.raises(ValueError):
+        with histogram.time(op='b'):
+            raise ValueError()
+
+    assert histogram.count(op='a') == 1
+    assert histogram.count(op='b') == 1
+
+
+def test_render():
+    registry = Registry()
+    counter = registry.counter('test_total', 'Test "counter"\nhelp', ['kind'])
+    counter.inc(kind='a\\"b')
+    registry.gauge('test_bytes', 'Test gauge').set(5)
+    histogram = registry.histogram(
+            'test_seconds', 'Test histogram', ['op'], [0.1, 1.0])
+    histogram.observe(0.05, op='x')
+    histogram.observe(0.5, op='x')
+
+    assert registry.render() == (
+            '# HELP test_bytes Test gauge\n'
+            '# TYPE test_bytes gauge\n'
+            'test_bytes 5.0\n'
+            '# HELP test_seconds Test histogram\n'
+            '# TYPE test_seconds histogram\n'
+            'test_seconds_bucket{op="x",le="0.1"} 1.0\n'
+            'test_seconds_bucket{op="x",le="1.0"} 2.0\n'
+            'test_seconds_bucket{op="x",le="+Inf"} 2.0\n'
+            'test_seconds_sum{op="x"} 0.55\n'
+            'test_seconds_count{op="x"} 2.0\n'
+            '# HELP test_total Test "counter"\\nhelp\n'
+            '# TYPE test_total counter\n'
+            'test_total{kind="a\\\\\\"b"} 1.0\n')
+
+
+def test_metrics_handler():
+    REGISTRY.counter('test_handler_total', 'Test counter').inc()
+
+    request = MagicMock()
+    request.get_header.return_value = None
+    response = MagicMock()
+    MetricsHandler(MagicMock()).on_get(request, response)
+
+    assert response.content_type == CONTENT_TYPE
+    assert 'test_handler_total 1.0\n' in response.body
@@ -0,0 +1,195 @@
+from pathlib import Path
+import socket
+from threading import Thread
+from unittest.mock import MagicMock
+
+import pytest
+
+from mahiru.components.net_admin_helper import (
+        DaemonNetAdminHelper, parse_device_stats, parse_timing_record)
+
+
+class FakeDaemon:
+    """Imitates the net-admin-helper daemon on a Unix socket."""
+    def __init__(self, socket_path, responses):
+        self.commands = list()
+        self._responses = responses
+        self._socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._socket.bind(str(socket_path))
+        self._socket.listen(1)
+        self._thread = Thread(target=self._serve, daemon=True)
+        self._thread.start()
+
+    def _serve(self):
+        conn, _ = self._socket.accept()
+        with conn, conn.makefile('rwb') as f:
+            for line in f:
+                command = line.decode('ascii').rstrip('\n')
+                self.commands.append(command)
+                response = self._responses[command]
+                if isinstance(response, list):
+                    response = response.pop(0)
+                if response is None:
+                    # simulate a crash
+                    break
+                f.write(response)
+                f.flush()
+
+    def close(self):
+        self._socket.close()
+
+
+@pytest.fixture
+def daemon_env(tmp_path):
+    responses = {
+            'cwg_create 100 0 1 10000': b'ok 1\nPUBKEY=\n',
+            'cwg_destroy 100 0 1': b'ok 0\n',
+            'cwg_destroy 100 1 1': b'error Device not found\n',
+            'capabilities': b'ok 2\nns_pin\nns_release\n',
+            'ns_pin 100': b'ok 1\n100.4242\n',
+            'cwg_destroy 100.4242 0 1': b'ok 0\n',
+            'ns_release 100.4242': b'ok 0\n',
+            'cwg_create 100 1 1 10001': (
+                b'timing cwg_create ns_enter=1000 total=5000\n'
+                b'ok 1\nPUBKEY2=\n'),
+            'cwg_create 100 2 1 10002': [None, b'ok 1\nPUBKEY3=\n'],
+            'cwg_stats 100': [None, b'ok 1\n0:1 10 20 - -\n'],
+            'cwg_stats 200': [None, None]}
+    daemons = list()
+
+    def start_fake_daemon(*args, **kwargs):
+        daemons.append(FakeDaemon(
+                tmp_path / 'net-admin-helper.sock', responses))
+        container = MagicMock()
+        container.status = 'running'
+        return container
+
+    dcli = MagicMock()
+    dcli.containers.run.side_effect = start_fake_daemon
+
+    yield dcli, tmp_path, daemons
+
+    for daemon in daemons:
+        daemon.close()
+
+
+def test_daemon_run(daemon_env):
+    dcli, socket_dir, daemons = daemon_env
+    nah = DaemonNetAdminHelper(dcli, socket_dir)
+
+    assert nah.run('cwg_create 100 0 1 10000') == 'PUBKEY='
+    assert nah.run('cwg_destroy 100 0 1') == ''
+    with pytest.raises(RuntimeError):
+        nah.run('cwg_destroy 100 1 1')
+
+    # one container for all commands
+    assert dcli.containers.run.call_count == 1
+    assert daemons[0].commands == [
+            'cwg_create 100 0 1 10000', 'cwg_destroy 100 0 1',
+            'cwg_destroy 100 1 1']
+
+    volumes = dcli.containers.run.call_args[1]['volumes']
+    assert volumes[str(socket_dir)]['bind'] == '/run/net-admin-helper'
+
+    nah.close()
+    assert socket_dir.exists()
+
+
+def test_daemon_invalid_command(daemon_env):
+    dcli, socket_dir, _ = daemon_env
+    nah = DaemonNetAdminHelper(dcli, socket_dir)
+    with pytest.raises(RuntimeError):
+        nah.run('cwg_destroy 100 0 1\ncwg_destroy 100 1 1')
+    nah.close()
+
+
+def test_daemon_pin_namespace(daemon_env):
+    dcli, socket_dir, daemons = daemon_env
+    nah = DaemonNetAdminHelper(dcli, socket_dir)
+
+    handle = nah.pin_namespace(100)
+    assert handle == '100.4242'
+    nah.run(f'cwg_destroy {handle} 0 1')
+    nah.release_namespace(handle)
+
+    assert daemons[0].commands == [
+            'capabilities', 'ns_pin 100', 'cwg_destroy 100.4242 0 1',
+            'ns_release 100.4242']
+    nah.close()
+
+
+def test_daemon_pin_namespace_unsupported(daemon_env):
+    dcli, socket_dir, daemons = daemon_env
+    nah = DaemonNetAdminHelper(dcli, socket_dir)
+    nah.run('cwg_destroy 100 0 1')
+    daemons[0]._responses['capabilities'] = b'error Unknown command\n'
+
+    handle = nah.pin_namespace(100)
+    assert handle == '100'
+    nah.release_namespace(handle)
+
+    assert daemons[0].commands == ['cwg_destroy 100 0 1', 'capabilities']
+    nah.close()
+
+
+def test_daemon_lost_connection(daemon_env):
+    dcli, socket_dir, daemons = daemon_env
+    nah = DaemonNetAdminHelper(dcli, socket_dir)
+
+    # the daemon may have created the device, so don't try again
+    with pytest.raises(RuntimeError):
+        nah.run('cwg_create 100 2 1 10002')
+    assert dcli.containers.run.call_count == 1
+
+    # but this is harmless
+    assert nah.run('cwg_stats 100') == '0:1 10 20 - -'
+    assert dcli.containers.run.call_count == 3
+    assert daemons[1].commands == ['cwg_stats 100']
+    assert daemons[2].commands == ['cwg_stats 100']
+
+    # if the retry fails too, we give up
+    with pytest.raises(RuntimeError):
+        nah.run('cwg_stats 200')
+    assert dcli.containers.run.call_count == 4
+    nah.close()
+
+
+def test_daemon_timing(daemon_env):
+    dcli, socket_dir, daemons = daemon_env
+    nah = DaemonNetAdminHelper(dcli, socket_dir)
+
+    output, timings = nah.run_timed('cwg_create 100 1 1 10001')
+    assert output == 'PUBKEY2='
+    assert timings == ['timing cwg_create ns_enter=1000 total=5000']
+    nah.close()
+
+
+def test_parse_timing_record():
+    command, phases = parse_timing_record(
+            'timing cwg_connect ns_enter=120 peer=4500 total=5100')
+    assert command == 'cwg_connect'
+    assert phases == {'ns_enter': 120, 'peer': 4500, 'total': 5100}
+
+    with pytest.raises(RuntimeError):
+        parse_timing_record('timing cwg_connect peer')
+
+    with pytest.raises(RuntimeError):
+        parse_timing_record('cwg_connect peer=10')
+
+
+def test_parse_device_stats():
+    stats = parse_device_stats(
+            '3:0 100 200 1600000000 192.0.2.1:10000\n'
+            '4:0 300 400 - -\n')
+    assert len(stats) == 2
+    assert stats[0].net == 3
+    assert stats[0].host == 0
+    assert stats[0].rx_bytes == 100
+    assert stats[0].tx_bytes == 200
+    assert stats[0].last_handshake == 1600000000
+    assert stats[0].endpoint == '192.0.2.1:10000'
+    assert stats[1].last_handshake is None
+    assert stats[1].endpoint is None
+
+    with pytest.raises(RuntimeError):
+        parse_device_stats('3:0 100')
@@ -0,0 +1,381 @@
+from threading import Barrier
+from unittest.mock import MagicMock, patch
+
+import pytest
+
+from mahiru.components.net_admin_helper import NetAdminHelper
+from mahiru.components.network_administrator import (
+        WireGuardNA, _connection_bytes, _connection_throughput)
+from mahiru.components.settings import NetworkSettings
+from mahiru.definitions.assets import DataAsset
+from mahiru.definitions.connections import (
+        WireGuardConnectionInfo, WireGuardConnectionRequest,
+        WireGuardEndpoint)
+
+
+ALL_COMMANDS = [
+        'cwg_create_batch', 'cwg_connect_batch', 'cwg_create_connect',
+        'cwg_destroy_all', 'cwg_hub_create', 'cwg_hub_attach',
+        'cwg_hub_detach', 'cwg_hub_destroy', 'cwg_stats']
+
+
+class FakeHelper(NetAdminHelper):
+    """Pretends to be net-admin-helper, keeping track of devices.
+
+    If capabilities is None, it behaves like a helper without the
+    capabilities command, which only has the basic commands. If
+    batch_limit is set, cwg_create_batch fails after creating that
+    many devices.
+    """
+    def __init__(self, capabilities=ALL_COMMANDS):
+        super().__init__()
+        self.capabilities = capabilities
+        self.batch_limit = None
+        self.commands = list()
+        self.devices = dict()
+        self.stats = dict()
+
+    def run_timed(self, command):
+        self.commands.append(command)
+        args = command.split()
+        if args[0] == 'capabilities':
+            if self.capabilities is None:
+                raise RuntimeError('net-admin-helper: Unknown command')
+            return '\n'.join(self.capabilities), []
+        elif args[0] == 'cwg_create_batch':
+            devices = [net.split(':') for net in args[2:]]
+            for i, (net, _, port) in enumerate(devices):
+                if i == self.batch_limit:
+                    raise RuntimeError('net-admin-helper: Out of memory')
+                self.devices.setdefault(args[1], dict())[net] = int(port)
+            return '\n'.join(f'key{port}' for _, _, port in devices), []
+        elif args[0] in ('cwg_create', 'cwg_create_connect'):
+            self.devices.setdefault(args[1], dict())[args[2]] = int(args[4])
+            return f'key{args[4]}', []
+        elif args[0] == 'cwg_stats':
+            return self.stats.get(args[1], ''), []
+        elif args[0] == 'cwg_destroy':
+            del self.devices[args[1]][args[2]]
+        elif args[0] == 'cwg_destroy_all':
+            ports = self.devices.pop(args[1], dict()).values()
+            return '\n'.join(map(str, ports)), []
+        return '', []
+
+
+@pytest.fixture
+def network_administrator(request):
+    settings = NetworkSettings(
+            True, '192.0.2.1', [10000, 10003], stats_interval=0.0)
+    site_rest_client = MagicMock()
+    with patch('docker.from_env'):
+        na = WireGuardNA(settings, site_rest_client)
+    helper = FakeHelper(getattr(request, 'param', ALL_COMMANDS))
+    na._nah = helper
+    return na, helper, site_rest_client
+
+
+def make_inputs(count):
+    return {
+            f'input{i}': DataAsset(
+                f'asset:party1.mahiru.example.org:data{i}'
+                ':party1.mahiru.example.org:site1', None, None)
+            for i in range(count)}
+
+
+def test_connect_disconnect_inputs(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 20000, 'remotekey')
+    site_rest_client.connect_to_asset.side_effect = [
+            WireGuardConnectionInfo('c1', remote),
+            WireGuardConnectionInfo('c2', remote)]
+
+    inputs = make_inputs(2)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert sorted(nets) == ['input0', 'input1']
+    assert remaining == {}
+    assert len(na._available_ports) == 2
+
+    na.disconnect_inputs(1, inputs)
+    assert helper.commands[-1] == 'cwg_destroy_all 100'
+    assert len(na._available_ports) == 4
+    assert site_rest_client.disconnect_asset.call_count == 2
+
+
+def test_connect_inputs_batch(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 20000, 'remotekey')
+    site_rest_client.connect_to_asset.side_effect = [
+            WireGuardConnectionInfo(f'c{i}', remote) for i in range(3)]
+
+    nets, remaining = na.connect_to_inputs(1, make_inputs(3), 100)
+    assert len(nets) == 3
+    subcommands = [command.split()[0] for command in helper.commands]
+    assert subcommands == [
+            'capabilities', 'cwg_create_batch', 'cwg_connect_batch']
+    assert len(helper.devices['100']) == 3
+
+
+def test_connect_inputs_batch_failure(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    helper.batch_limit = 1
+
+    inputs = make_inputs(3)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert nets == {}
+    assert remaining == inputs
+    assert site_rest_client.connect_to_asset.call_count == 0
+
+    # the device that was created has been removed
+    assert helper.devices['100'] == {}
+    assert len(na._available_ports) == 4
+
+
+@pytest.mark.parametrize('network_administrator', [None], indirect=True)
+def test_connect_inputs_basic_helper(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 20000, 'remotekey')
+    site_rest_client.connect_to_asset.side_effect = [
+            WireGuardConnectionInfo(f'c{i}', remote) for i in range(3)]
+
+    inputs = make_inputs(3)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert len(nets) == 3
+    assert remaining == {}
+    subcommands = [command.split()[0] for command in helper.commands]
+    assert subcommands == ['capabilities'] + ['cwg_create'] * 3 + [
+            'cwg_connect'] * 3
+    requests = [
+            call[0][1]
+            for call in site_rest_client.connect_to_asset.call_args_list]
+    assert sorted(
+            f'key{request.endpoint.port}' for request in requests) == sorted(
+            request.endpoint.key for request in requests)
+    assert len(na._available_ports) == 1
+
+    na.disconnect_inputs(1, inputs)
+    assert sorted(helper.commands[-3:]) == [
+            'cwg_destroy 100 0 0', 'cwg_destroy 100 1 0',
+            'cwg_destroy 100 2 0']
+    assert helper.devices['100'] == {}
+    assert len(na._available_ports) == 4
+
+
+def test_connect_inputs_concurrently(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 20000, 'remotekey')
+
+    # each request only completes when all three are in flight
+    barrier = Barrier(3, timeout=5.0)
+
+    def connect_to_asset(asset_id, request):
+        barrier.wait()
+        return WireGuardConnectionInfo(f'c{request.net}', remote)
+
+    site_rest_client.connect_to_asset.side_effect = connect_to_asset
+
+    inputs = make_inputs(3)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert len(nets) == 3
+    assert remaining == {}
+
+
+def test_connect_inputs_failure(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    site_rest_client.connect_to_asset.side_effect = RuntimeError('Offline')
+
+    inputs = make_inputs(2)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert nets == {}
+    assert remaining == inputs
+    assert helper.commands[-1] == 'cwg_destroy_all 100'
+    assert len(na._available_ports) == 4
+
+
+def test_insufficient_ports(network_administrator):
+    na, helper, _ = network_administrator
+    nets, remaining = na.connect_to_inputs(1, make_inputs(5), 100)
+    assert nets == {}
+    assert len(remaining) == 5
+    assert len(na._available_ports) == 4
+
+
+def test_serve_asset(network_administrator):
+    na, helper, _ = network_administrator
+    request = WireGuardConnectionRequest(
+            3, WireGuardEndpoint('192.0.2.2', 20000, 'remotekey'))
+
+    conn_info = na.serve_asset('c1', 200, request)
+    assert conn_info.endpoint.address == '192.0.2.1'
+    assert conn_info.endpoint.key == f'key{conn_info.endpoint.port}'
+    assert len(na._available_ports) == 3
+
+    na.stop_serving_asset('c1', 200)
+    assert helper.commands[-1] == 'cwg_destroy_all 200'
+    assert len(na._available_ports) == 4
+
+
+def test_serve_asset_create_connect(network_administrator):
+    na, helper, _ = network_administrator
+    request = WireGuardConnectionRequest(
+            3, WireGuardEndpoint('192.0.2.2', 20000, 'remotekey'))
+
+    na.serve_asset('c1', 200, request)
+    subcommands = [command.split()[0] for command in helper.commands]
+    assert subcommands == ['capabilities', 'cwg_create_connect']
+
+
+@pytest.mark.parametrize('network_administrator', [None], indirect=True)
+def test_serve_asset_basic_helper(network_administrator):
+    na, helper, _ = network_administrator
+    request = WireGuardConnectionRequest(
+            3, WireGuardEndpoint('192.0.2.2', 20000, 'remotekey'))
+
+    conn_info = na.serve_asset('c1', 200, request)
+    assert conn_info.endpoint.key == f'key{conn_info.endpoint.port}'
+    assert helper.commands[1:] == [
+            f'cwg_create 200 3 1 {conn_info.endpoint.port}',
+            'cwg_connect 200 3 1 192.0.2.2:20000 remotekey']
+    assert helper.devices['200'] == {'3': conn_info.endpoint.port}
+    assert len(na._available_ports) == 3
+
+    na.stop_serving_asset('c1', 200)
+    assert helper.commands[-1] == 'cwg_destroy 200 3 1'
+    assert len(na._available_ports) == 4
+
+
+@pytest.fixture
+def multiplexing_administrator():
+    settings = NetworkSettings(
+            True, '192.0.2.1', [10000, 10003], multiplex=True,
+            stats_interval=0.0)
+    site_rest_client = MagicMock()
+    with patch('docker.from_env'):
+        na = WireGuardNA(settings, site_rest_client)
+    helper = FakeHelper()
+    na._nah = helper
+    return na, helper, site_rest_client
+
+
+def test_multiplex_connect_inputs(multiplexing_administrator):
+    na, helper, site_rest_client = multiplexing_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 20000, 'remotekey')
+    site_rest_client.connect_to_asset.side_effect = [
+            WireGuardConnectionInfo(f'c{i}', remote) for i in range(10)]
+
+    # more inputs than ports
+    inputs = make_inputs(10)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert len(nets) == 10
+    assert remaining == {}
+    assert len(set(nets.values())) == 10
+
+    requests = [
+            call[0][1]
+            for call in site_rest_client.connect_to_asset.call_args_list]
+    assert len({request.endpoint.port for request in requests}) == 1
+    assert len({request.net for request in requests}) == 10
+
+    assert helper.commands[0] == 'capabilities'
+    assert helper.commands[1] == 'cwg_hub_create 10000'
+    assert helper.commands[2].startswith('cwg_hub_attach')
+
+    na.disconnect_inputs(1, inputs)
+    assert helper.commands[-1].startswith('cwg_hub_detach')
+    assert na._used_nets == set()
+
+    na.close()
+    assert helper.commands[-1] == 'cwg_hub_destroy 10000'
+    assert 10000 not in na._available_ports
+    assert len(na._available_ports) == 3
+
+
+def test_multiplex_serve_asset(multiplexing_administrator):
+    na, helper, _ = multiplexing_administrator
+    request = WireGuardConnectionRequest(
+            3, WireGuardEndpoint('192.0.2.2', 20000, 'remotekey'))
+
+    info1 = na.serve_asset('c1', 200, request)
+    assert info1.net == 3
+    assert info1.endpoint.port == 10000
+
+    # net 3 is taken, so the hub assigns another one
+    info2 = na.serve_asset('c2', 201, request)
+    assert info2.net != 3
+    assert info1.endpoint.port == info2.endpoint.port
+    assert helper.commands[-1].startswith(
+            f'cwg_hub_attach 10000 201 {info2.net}:')
+
+    na.stop_serving_asset('c1', 200)
+    assert helper.commands[-1].endswith(' 3')
+    assert na._used_nets == {info2.net}
+
+
+def test_assigned_net(network_administrator):
+    na, helper, site_rest_client = network_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 10000, 'hubkey')
+    site_rest_client.connect_to_asset.side_effect = [
+            WireGuardConnectionInfo('c1', remote, 1000),
+            WireGuardConnectionInfo('c2', remote, 1000)]
+
+    inputs = make_inputs(1)
+    nets, remaining = na.connect_to_inputs(1, inputs, 100)
+    assert nets == {'input0': na._net_to_addr(1000, 1)}
+    assert remaining == {}
+
+    site_rest_client.disconnect_asset.assert_called_once_with(
+            inputs['input0'].id, 'c1')
+    request = site_rest_client.connect_to_asset.call_args[0][1]
+    assert request.net == 1000
+    assert list(helper.devices['100']) == ['1000']
+    assert helper.commands[-1].startswith('cwg_connect_batch 100 1000:0:')
+    assert len(na._available_ports) == 3
+
+
+def test_multiplex_assigned_net(multiplexing_administrator):
+    na, helper, site_rest_client = multiplexing_administrator
+    remote = WireGuardEndpoint('192.0.2.2', 10000, 'hubkey')
+    site_rest_client.connect_to_asset.side_effect = [
+            WireGuardConnectionInfo('c1', remote, 1000)]
+
+    nets, remaining = na.connect_to_inputs(1, make_inputs(1), 100)
+    assert nets == {'input0': na._net_to_addr(1000, 1)}
+    assert na._used_nets == {1000}
+    assert helper.commands[-1].startswith('cwg_hub_attach 10000 100 1000:0:')
+    site_rest_client.disconnect_asset.assert_not_called()
+
+
+def test_stats_disabled(network_administrator):
+    na, helper, _ = network_administrator
+    request = WireGuardConnectionRequest(
+            3, WireGuardEndpoint('192.0.2.2', 20000, 'remotekey'))
+    na.serve_asset('s1', 200, request)
+    na.stop_serving_asset('s1', 200)
+    assert not any(
+            command.startswith('cwg_stats') for command in helper.commands)
+
+
+def test_stats_interval_default():
+    assert NetworkSettings().helper_mode == 'container'
+    assert NetworkSettings().stats_interval == 0.0
+    assert NetworkSettings(helper_mode='daemon').stats_interval == 10.0
+    assert NetworkSettings(helper_mode='container').stats_interval == 0.0
+
+
+def test_connection_stats(network_administrator):
+    na, helper, _ = network_administrator
+    request = WireGuardConnectionRequest(
+            3, WireGuardEndpoint('192.0.2.2', 20000, 'remotekey'))
+    na.serve_asset('s1', 200, request)
+
+    labels = {'role': 'server', 'conn_id': 's1'}
+    helper.stats['200'] = '3:1 1000 200000 1600000000 192.0.2.2:20000\n'
+    na._sample_stats('200')
+    assert _connection_bytes.value(direction='rx', **labels) == 1000
+    assert _connection_bytes.value(direction='tx', **labels) == 200000
+
+    helper.stats['200'] = '3:1 2000 400000 1600000000 192.0.2.2:20000\n'
+    na._sample_stats('200')
+    assert _connection_throughput.value(direction='tx', **labels) > 0.0
+
+    na.stop_serving_asset('s1', 200)
+    assert ('server', 's1', 'rx') not in dict(_connection_bytes.samples())
@@ -0,0 +1,242 @@
+"""Benchmark for the WireGuard connection life cycle.
+
+This measures how long WireGuardNA takes to connect a job to its
+inputs and disconnect it again, which is the whole path of
+connect_to_inputs, serve_asset, disconnect_inputs and
+stop_serving_asset. Both sides run on the local machine, with one
+container per job and one per input to provide network namespaces.
+
+It needs root (or the capabilities net-admin-helper needs), Docker and
+the net-admin-helper and pilot images, so it's skipped unless
+MAHIRU_BENCHMARK is set. Use net-admin-helper/benchmark.sh to run it.
+The sweep can be configured using the environment variables below,
+and the results are written as JSON to the file named by
+MAHIRU_BENCHMARK_REPORT, if set.
+"""
+from concurrent.futures import ThreadPoolExecutor
+import json
+import logging
+import os
+from pathlib import Path
+from threading import Lock
+import time
+
+import docker
+import pytest
+
+from mahiru.components.network_administrator import WireGuardNA
+from mahiru.components.settings import NetworkSettings
+from mahiru.definitions.assets import DataAsset
+
+
+logger = logging.getLogger(__file__)
+
+
+# Comma-separated lists of values to sweep over
+CONCURRENCY = os.environ.get('MAHIRU_BENCHMARK_CONCURRENCY', '1,10,100')
+INPUTS = os.environ.get('MAHIRU_BENCHMARK_INPUTS', '1,4')
+HELPER_MODES = os.environ.get(
+        'MAHIRU_BENCHMARK_HELPER_MODES', 'container,daemon')
+# Number of jobs per worker in each run
+JOBS_PER_WORKER = int(os.environ.get('MAHIRU_BENCHMARK_JOBS_PER_WORKER', '3'))
+
+EXTERNAL_IP = '127.0.0.1'
+SERVER_PORTS = 20000
+CLIENT_PORTS = 40000
+
+DEVICE_PREFIX = 'mahiru'    # CWG_PREFIX in net-admin-helper/config.h
+
+
+def asset_id(job, i):
+    return (
+            f'asset:party1.mahiru.example.org:bench-{job}-{i}'
+            ':party1.mahiru.example.org:site1')
+
+
+def count_devices(pid):
+    """Count net-admin-helper devices in the namespace of a process."""
+    dev_file = Path('/proc') / str(pid) / 'net' / 'dev'
+    lines = dev_file.read_text().splitlines()[2:]
+    return len([
+            line for line in lines
+            if line.strip().startswith(DEVICE_PREFIX)])
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    index = min(len(values) - 1, int(round(fraction * (len(values) - 1))))
+    return values[index]
+
+
+class LoopbackSiteClient:
+    """Stands in for SiteRestClient, serving assets on this machine.
+
+    Each asset is served from a container made in advance by the
+    benchmark, so that starting containers isn't part of the timing.
+    """
+    def __init__(self, server_na, containers):
+        self._server_na = server_na
+        self._containers = containers
+        self._lock = Lock()
+        self.leaked_devices = 0
+
+    def connect_to_asset(self, asset_id, request):
+        pid = self._containers[asset_id].attrs['State']['Pid']
+        return self._server_na.serve_asset(asset_id, pid, request)
+
+    def disconnect_asset(self, asset_id, conn_id):
+        pid = self._containers[asset_id].attrs['State']['Pid']
+        self._server_na.stop_serving_asset(conn_id, pid)
+        leaked = count_devices(pid)
+        with self._lock:
+            self.leaked_devices += leaked
+
+
+@pytest.fixture
+def benchmark_docker():
+    if not os.environ.get('MAHIRU_BENCHMARK'):
+        pytest.skip(
+                'Benchmark not enabled, use net-admin-helper/benchmark.sh')
+
+    dcli = docker.from_env()
+    try:
+        dcli.images.get('mahiru-pilot:latest')
+    except docker.errors.ImageNotFound:
+        image_file = Path(__file__).parents[1] / 'mahiru' / 'data'
+        with (image_file / 'pilot.tar.gz').open('rb') as f:
+            dcli.images.load(f.read())
+
+    yield dcli
+
+    dcli.close()
+
+
+def start_containers(dcli, names):
+    def start(name):
+        container = dcli.containers.run(
+                'mahiru-pilot:latest', name=name, detach=True,
+                network_mode='none')
+        container.reload()
+        return container
+
+    with ThreadPoolExecutor(16) as pool:
+        return list(pool.map(start, names))
+
+
+def remove_containers(dcli, containers):
+    def remove(container):
+        container.remove(force=True)
+
+    with ThreadPoolExecutor(16) as pool:
+        list(pool.map(remove, containers))
+
+
+def run_benchmark(dcli, helper_mode, concurrency, num_inputs):
+    """Run connect/disconnect cycles and return statistics."""
+    num_jobs = concurrency * JOBS_PER_WORKER
+    # enough for every connection, so that leaks don't affect timing
+    num_ports = num_jobs * num_inputs
+
+    server_settings = NetworkSettings(
+            True, EXTERNAL_IP, [SERVER_PORTS, SERVER_PORTS + num_ports - 1],
+            helper_mode)
+    client_settings = NetworkSettings(
+            True, EXTERNAL_IP, [CLIENT_PORTS, CLIENT_PORTS + num_ports - 1],
+            helper_mode)
+
+    pilots = start_containers(
+            dcli, [f'mahiru-bench-{job}-pilot' for job in range(num_jobs)])
+    data = start_containers(dcli, [
+            f'mahiru-bench-{job}-data-{i}'
+            for job in range(num_jobs) for i in range(num_inputs)])
+
+    server_containers = {
+            asset_id(job, i): data[job * num_inputs + i]
+            for job in range(num_jobs) for i in range(num_inputs)}
+
+    server_na = WireGuardNA(server_settings, None)
+    site_client = LoopbackSiteClient(server_na, server_containers)
+    client_na = WireGuardNA(client_settings, site_client)
+
+    setup_times = list()
+    cycle_times = list()
+    failed_inputs = 0
+    leaked_client_devices = 0
+    lock = Lock()
+
+    def run_job(job):
+        nonlocal failed_inputs, leaked_client_devices
+        inputs = {
+                f'input{i}': DataAsset(asset_id(job, i), None, None)
+                for i in range(num_inputs)}
+        pid = pilots[job].attrs['State']['Pid']
+
+        start = time.perf_counter()
+        nets, remaining = client_na.connect_to_inputs(job, inputs, pid)
+        connected = time.perf_counter()
+        if nets:
+            client_na.disconnect_inputs(job, inputs)
+        done = time.perf_counter()
+
+        leaked = count_devices(pid)
+        with lock:
+            setup_times.append(connected - start)
+            cycle_times.append(done - start)
+            failed_inputs += len(remaining)
+            leaked_client_devices += leaked
+
+    try:
+        # warm up, e.g. to start the daemon
+        run_job(0)
+        setup_times.clear()
+        cycle_times.clear()
+
+        start = time.perf_counter()
+        with ThreadPoolExecutor(concurrency) as pool:
+            list(pool.map(run_job, range(1, num_jobs)))
+        duration = time.perf_counter() - start
+
+        leaked_server_ports = num_ports - len(server_na._available_ports)
+        leaked_client_ports = num_ports - len(client_na._available_ports)
+
+    finally:
+        client_na.close()
+        server_na.close()
+        remove_containers(dcli, pilots + data)
+
+    return {
+            'helper_mode': helper_mode,
+            'concurrency': concurrency,
+            'inputs': num_inputs,
+            'jobs': len(cycle_times),
+            'setup_p50': percentile(setup_times, 0.5),
+            'setup_p99': percentile(setup_times, 0.99),
+            'cycle_p50': percentile(cycle_times, 0.5),
+            'cycle_p99': percentile(cycle_times, 0.99),
+            'connections_per_second': (
+                len(cycle_times) * num_inputs / duration),
+            'failed_inputs': failed_inputs,
+            'leaked_server_devices': site_client.leaked_devices,
+            'leaked_client_devices': leaked_client_devices,
+            'leaked_server_ports': leaked_server_ports,
+            'leaked_client_ports': leaked_client_ports}
+
+
+def test_wireguard_connection_benchmark(benchmark_docker):
+    results = list()
+    for helper_mode in HELPER_MODES.split(','):
+        for num_inputs in map(int, INPUTS.split(',')):
+            for concurrency in map(int, CONCURRENCY.split(',')):
+                result = run_benchmark(
+                        benchmark_docker, helper_mode, concurrency,
+                        num_inputs)
+                logger.info(f'Benchmark result: {result}')
+                results.append(result)
+
+    report_file = os.environ.get('MAHIRU_BENCHMARK_REPORT')
+    if report_file:
+        with open(report_file, 'w') as f:
+            json.dump(results, f, indent=4)
+
+    for result in results:
+        assert result['failed_inputs'] == 0
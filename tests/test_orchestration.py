@@ -0,0 +1,97 @@
+from unittest.mock import MagicMock
+
+import pytest
+
+from mahiru.components.orchestration import (
+        DataTransferCost, PlanCostModel, WorkflowPlanner)
+from mahiru.definitions.identifier import Identifier
+from mahiru.definitions.workflows import Job, Workflow, WorkflowStep
+
+
+S1 = Identifier('site:ns1:s1')
+S2 = Identifier('site:ns2:s2')
+S3 = Identifier('site:ns3:s3')
+
+
+def make_planner(permitted_sites, **kwargs):
+    policy_evaluator = MagicMock()
+    policy_evaluator.may_access.return_value = True
+    policy_evaluator.may_use.return_value = True
+    planner = WorkflowPlanner(MagicMock(), policy_evaluator, **kwargs)
+    planner._permission_calculator = MagicMock()
+    planner._permission_calculator.permitted_sites.return_value = (
+            permitted_sites)
+    return planner
+
+
+def chain_job(length):
+    steps = [
+            WorkflowStep(
+                name=f'step{i}',
+                inputs={'x': f'step{i - 1}.y' if i > 0 else 'x'},
+                outputs={'y': None},
+                compute_asset_id='asset:ns:compute:ns:s')
+            for i in reversed(range(length))]
+    workflow = Workflow(['x'], {'y': f'step{length - 1}.y'}, steps)
+    return Job(
+            Identifier('party:ns1:party1'), workflow,
+            {'x': 'asset:ns2:dataset:ns2:s2'})
+
+
+def test_sort_workflow():
+    job = chain_job(50)
+    planner = make_planner({})
+    steps = planner._sort_workflow(job.workflow)
+    assert [step.name for step in steps] == [f'step{i}' for i in range(50)]
+
+
+def test_cheapest_first():
+    job = chain_job(3)
+    permitted = {f'step{i}': [S1, S2, S3] for i in range(3)}
+    planner = make_planner(permitted, max_plans=5)
+    plans = planner.make_plans('party:ns1:party1', S1, job)
+
+    assert len(plans) == 5
+    # data is at s2, the result has to go to s1, so one transfer is
+    # the best we can do, and there are four plans that do that
+    costs = [
+            sum(DataTransferCost().step_cost(
+                job, job.workflow.steps[name], site, plan.step_sites, S1)
+                for name, site in plan.step_sites.items())
+            for plan in plans]
+    assert costs == [1.0, 1.0, 1.0, 1.0, 2.0]
+    assert all(S3 not in plan.step_sites.values() for plan in plans[:4])
+
+
+def test_large_workflow():
+    # 5^15 plans, far too many to enumerate
+    job = chain_job(15)
+    sites = [Identifier(f'site:ns{i}:s{i}') for i in range(4)] + [S2]
+    permitted = {f'step{i}': sites for i in range(15)}
+    planner = make_planner(permitted, max_plans=3, time_budget=10.0)
+    plans = planner.make_plans('party:ns2:party2', S2, job)
+
+    assert len(plans) == 3
+    assert all(site == S2 for site in plans[0].step_sites.values())
+
+
+def test_time_budget():
+    class SlowCost(PlanCostModel):
+        def step_cost(self, job, step, site, step_sites, submitting_site):
+            return 1.0
+
+    job = chain_job(15)
+    sites = [Identifier(f'site:ns{i}:s{i}') for i in range(5)]
+    permitted = {f'step{i}': sites for i in range(15)}
+    planner = make_planner(
+            permitted, cost_model=SlowCost(), max_plans=1000000,
+            time_budget=0.1)
+    plans = planner.make_plans('party:ns2:party2', S2, job)
+    assert 0 < len(plans) < 1000000
+
+
+def test_no_permitted_sites():
+    job = chain_job(3)
+    permitted = {'step0': [S1], 'step1': [], 'step2': [S1]}
+    planner = make_planner(permitted)
+    assert planner.make_plans('party:ns1:party1', S1, job) == []
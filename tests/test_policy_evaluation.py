@@ -4,7 +4,11 @@ import pytest
 
 from mahiru.definitions.identifier import Identifier
 from mahiru.definitions.interfaces import IPolicyCollection
-from mahiru.policy.evaluation import Permissions, PolicyEvaluator
+from mahiru.definitions.workflows import Job
+from mahiru.metrics import REGISTRY
+from mahiru.policy.evaluation import (
+        PermissionCalculator, Permissions, PolicyEvaluator)
+from mahiru.policy.index import RuleIndex
 from mahiru.policy.rules import (
         InAssetCategory, InAssetCollection, InSiteCategory, MayAccess,
         ResultOfComputeIn, ResultOfDataIn, Rule)
@@ -126,6 +130,17 @@ class MockPolicies(IPolicyCollection):
         return self._policies
 
 
+class MockIndexedPolicies(IPolicyCollection):
+    def __init__(self, policies: List[Rule]) -> None:
+        self.index = RuleIndex(policies)
+
+    def policies(self) -> Iterable[Rule]:
+        return self.index.rules()
+
+    def rule_index(self) -> RuleIndex:
+        return self.index
+
+
 # MayAccess tests
 
 
@@ -460,3 +475,47 @@ def test_propagate_output_wildcards(
     input_perms = [Permissions([{asset1}])]
     perms = evaluator.propagate_permissions(input_perms, asset2, 'output1')
     assert perms._sets == [{asset_collection1a}, {asset_collection2a}]
+
+
+# Permission cache tests
+
+
+def test_permission_cache(asset1, asset_collection1a, site1):
+    policies = MockIndexedPolicies([])
+    evaluator = PolicyEvaluator(policies)
+    calculator = PermissionCalculator(evaluator)
+    job = Job.niljob(asset1)
+
+    requests = REGISTRY.counter(
+            'mahiru_permission_cache_requests_total', '', ['result'])
+    hits = requests.value(result='hit')
+
+    perms = calculator.calculate_permissions(job)
+    assert not evaluator.may_access(perms['dataset'], site1)
+    assert requests.value(result='hit') == hits
+
+    perms = calculator.calculate_permissions(job)
+    assert requests.value(result='hit') == hits + 1
+
+    # a policy change invalidates the cache
+    policies.index.update({
+        InAssetCollection(asset1, asset_collection1a),
+        MayAccess(site1, asset_collection1a)}, set())
+    perms = calculator.calculate_permissions(job)
+    assert requests.value(result='hit') == hits + 1
+    assert evaluator.may_access(perms['dataset'], site1)
+
+
+def test_default_rule_index(asset1, asset_collection1a, site1):
+    rules = [InAssetCollection(asset1, asset_collection1a)]
+    policies = MockPolicies(rules)
+
+    # kept while the rules stay the same, so caches keyed on it work
+    index = policies.rule_index()
+    assert policies.rule_index() is index
+
+    rules.append(MayAccess(site1, asset_collection1a))
+    new_index = policies.rule_index()
+    assert new_index is not index
+    assert new_index.version() != index.version()
+    assert set(new_index.rules()) == set(rules)
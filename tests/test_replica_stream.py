@@ -0,0 +1,72 @@
+from datetime import datetime
+import gzip
+import json
+
+import pytest
+
+from mahiru.definitions.errors import ValidationError
+from mahiru.policy.definitions import PolicyUpdate
+from mahiru.policy.rules import InAssetCollection, MayAccess
+from mahiru.registry.replication import RegistryUpdate
+from mahiru.rest.replica_stream import decode_update, encode_update
+
+
+def make_rules():
+    rules = [
+            MayAccess('site:party1_ns:site1', 'asset:party1_ns:data1:ns:s'),
+            MayAccess('site:party1_ns:site2', 'asset:party1_ns:data1:ns:s'),
+            InAssetCollection(
+                'asset:party1_ns:data1:ns:s',
+                'asset_collection:party1_ns:collection1')]
+    for rule in rules:
+        rule.signature = b'signature'
+    return rules
+
+
+def test_round_trip():
+    rules = make_rules()
+    update = PolicyUpdate(
+            3, 6, datetime(2021, 1, 1, 12, 0, 0), set(rules[:2]), {rules[2]},
+            True)
+
+    lines = list(encode_update(update))
+    assert len(lines) == 5
+
+    # strings are sent once
+    assert lines[1].count(b'asset:party1_ns:data1:ns:s') == 1
+    assert b'asset:party1_ns:data1:ns:s' not in lines[2]
+
+    decoded = decode_update(PolicyUpdate, lines)
+    assert decoded.from_version == 3
+    assert decoded.to_version == 6
+    assert decoded.valid_until == update.valid_until
+    assert decoded.created == update.created
+    assert decoded.deleted == update.deleted
+    assert decoded.partial
+
+    # works through gzip too, as sent over HTTP
+    data = gzip.decompress(gzip.compress(b''.join(lines)))
+    decoded = decode_update(PolicyUpdate, data.splitlines())
+    assert decoded.created == update.created
+
+
+def test_invalid_streams():
+    update = PolicyUpdate(
+            0, 3, datetime(2021, 1, 1), set(make_rules()), set())
+    lines = list(encode_update(update))
+
+    with pytest.raises(ValidationError):
+        decode_update(PolicyUpdate, lines[:-1])
+
+    with pytest.raises(ValidationError):
+        decode_update(PolicyUpdate, lines[:2] + lines[3:])
+
+    with pytest.raises(ValidationError):
+        decode_update(RegistryUpdate, lines)
+
+    bad_ref = json.dumps(['+', [], {'type': 100}]).encode()
+    with pytest.raises(ValidationError):
+        decode_update(PolicyUpdate, [lines[0], bad_ref, lines[-1]])
+
+    with pytest.raises(ValidationError):
+        decode_update(PolicyUpdate, [lines[0], b'{not json'])
@@ -1,9 +1,13 @@
 from datetime import datetime, timedelta
-from unittest.mock import MagicMock
+from threading import Event, Thread, Timer
+from unittest.mock import MagicMock, patch
 import time
 
+import pytest
+
 from mahiru.replication import (
         CanonicalStore, Replica, Replicable, ReplicableArchive, ReplicaUpdate)
+from mahiru.rest.replication import LongPollLimiter, ReplicationHandler
 
 
 class A:
@@ -82,4 +86,209 @@ def test_validation():
     assert not replica.is_valid()
 
 
+def test_updates_since():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 0.0)
+
+    a1, a2, a3 = A('a1'), A('a2'), A('a3')
+    store.insert(a1)
+    store.insert(a2)
+    store.delete(a1)
+    store.insert(a3)
+    store.insert(a1)
+
+    update = store.get_updates_since(0)
+    assert update.to_version == 5
+    assert update.created == {a1, a2, a3}
+    assert update.deleted == set()
+
+    update = store.get_updates_since(2)
+    assert update.created == {a3}
+    assert update.deleted == set()
+
+    update = store.get_updates_since(3)
+    assert update.created == {a3, a1}
+    assert update.deleted == set()
+
+    store.delete(a2)
+    update = store.get_updates_since(5)
+    assert update.created == set()
+    assert update.deleted == {a2}
+
+    assert archive.created_since(4) == [archive.records[-1]]
+    assert archive.deleted_since(3) == [archive.deletions[-1]]
+    assert store.objects() == {a1, a3}
+
+    with pytest.raises(ValueError):
+        store.delete(a2)
+
+
+def test_partial_updates():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 1000.0)
+
+    a1, a2, a3 = A('a1'), A('a2'), A('a3')
+    store.insert(a1)
+    store.insert(a2)
+    store.delete(a1)
+    store.insert(a3)
+
+    update = store.get_updates_since(0, limit=2)
+    assert update.to_version == 2
+    assert update.created == {a1, a2}
+    assert update.partial
+    assert update.valid_until <= datetime.now()
+
+    update = store.get_updates_since(2, limit=2)
+    assert update.to_version == 4
+    assert update.created == {a3}
+    assert update.deleted == {a1}
+    assert not update.partial
+
+    source = MagicMock()
+    source.get_updates_since.side_effect = (
+            lambda version: store.get_updates_since(version, limit=1))
+    on_update = MagicMock()
+    replica = Replica(source, on_update=on_update)
+    replica.update()
+    assert replica.objects == {a2, a3}
+    assert replica.is_valid()
+    assert source.get_updates_since.call_count == 4
+    assert on_update.call_count == 4
+
+
+def test_readers_wait_for_changes():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 0.0)
+    store.insert(A('a1'))
+
+    # readers must not see the archive while it's being changed
+    for read in (store.objects, lambda: store.get_updates_since(0)):
+        with store._changed:
+            reader = Thread(target=read)
+            reader.start()
+            reader.join(0.05)
+            assert reader.is_alive()
+        reader.join()
+
+
+def test_long_poll():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 0.0)
+    a1 = A('a1')
+
+    start = time.monotonic()
+    update = store.get_updates_since(0, 0.05)
+    assert time.monotonic() - start >= 0.05
+    assert update.to_version == 0
+
+    Timer(0.05, store.insert, [a1]).start()
+    update = store.get_updates_since(0, 10.0)
+    assert time.monotonic() - start < 5.0
+    assert update.created == {a1}
+
+
+def wait_for(condition):
+    for _ in range(500):
+        if condition():
+            return True
+        time.sleep(0.01)
+    return False
+
+
+def test_replica_watch():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 1000.0)
+    on_update = MagicMock()
+    replica = Replica(store, on_update=on_update)
+
+    a1 = A('a1')
+    store.insert(a1)
+    replica.watch(10.0)
+    assert wait_for(lambda: replica.objects == {a1})
+
+    # no polling needed, changes arrive by themselves
+    a2 = A('a2')
+    store.insert(a2)
+    assert wait_for(lambda: replica.objects == {a1, a2})
+    on_update.assert_called_with({a2}, set())
+
+    replica.stop_watching()
+    store.delete(a1)
+    time.sleep(0.05)
+    assert replica.objects == {a1, a2}
+
+
+def test_replica_stopped_watcher():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 0.0)
+    replica = Replica(store)
+
+    # a watcher that finishes an update after being stopped
+    stop = Event()
+    stop.set()
+    replica._set_watching(stop, True)
+
+    # must not stop update() from polling
+    a1 = A('a1')
+    store.insert(a1)
+    replica.update()
+    assert replica.objects == {a1}
+
+
+def test_long_poll_limiter():
+    limiter = LongPollLimiter(1)
+    with limiter.wait(10.0) as wait1:
+        with limiter.wait(10.0) as wait2:
+            with limiter.wait(0.0) as wait3:
+                assert (wait1, wait2, wait3) == (10.0, 0.0, 0.0)
+
+    with limiter.wait(5.0) as wait4:
+        assert wait4 == 5.0
+
+    with LongPollLimiter(0).wait(10.0) as wait5:
+        assert wait5 == 0.0
+
+
+def test_replication_handler_limited():
+    service = MagicMock()
+    handler = ReplicationHandler(service, LongPollLimiter(0))
+
+    request = MagicMock()
+    request.get_param_as_int.side_effect = lambda name, **kwargs: {
+            'from_version': 3, 'limit': None}[name]
+    request.get_param_as_float.return_value = 10.0
+    request.get_header.return_value = None
+    response = MagicMock()
+
+    # answered straight away rather than refused
+    with patch('mahiru.rest.replication.serialize') as serialize:
+        handler.on_get(request, response)
+    service.get_updates_since.assert_called_once_with(3, 0.0, None)
+    serialize.assert_called_once_with(
+            service.get_updates_since.return_value)
+    assert response.media is serialize.return_value
+
+
+def test_replica_watch_unsupported():
+    archive = ReplicableArchive()
+    store = CanonicalStore(archive, 0.0)
+    source = MagicMock()
+    # ignores the wait argument, like an old server would
+    source.get_updates_since.side_effect = (
+            lambda version, wait=0.0: store.get_updates_since(version))
+    replica = Replica(source)
+
+    replica.watch(10.0)
+    assert wait_for(lambda: source.get_updates_since.call_count >= 2)
+    time.sleep(0.05)
+    assert source.get_updates_since.call_count == 2
+
+    # falls back to polling
+    a1 = A('a1')
+    store.insert(a1)
+    replica.update()
+    assert replica.objects == {a1}
+
+
 # This could do with some unit testing of store, server and replica
@@ -0,0 +1,61 @@
+from mahiru.definitions.identifier import Identifier
+from mahiru.policy.index import RuleIndex
+from mahiru.policy.rules import (
+        InAssetCollection, MayAccess, ResultOfComputeIn, ResultOfDataIn)
+
+
+asset = Identifier('asset:ns:dataset:ns:site')
+coll1 = Identifier('asset_collection:ns:coll1')
+coll2 = Identifier('asset_collection:ns:coll2')
+site = Identifier('site:ns:site')
+compute = Identifier('asset:ns:compute:ns:site')
+
+
+def test_closures():
+    rule1 = InAssetCollection(asset, coll1)
+    rule2 = InAssetCollection(coll1, coll2)
+    index = RuleIndex([rule1])
+
+    up = index.equivalent_objects(InAssetCollection, 'up', [asset])
+    assert up == {asset, coll1}
+
+    index.update({rule2}, set())
+    up = index.equivalent_objects(InAssetCollection, 'up', [asset])
+    assert up == {asset, coll1, coll2}
+
+    down = index.equivalent_objects(InAssetCollection, 'down', [coll2])
+    assert down == {asset, coll1, coll2}
+
+    index.update(set(), {rule1})
+    up = index.equivalent_objects(InAssetCollection, 'up', [asset])
+    assert up == {asset}
+    down = index.equivalent_objects(InAssetCollection, 'down', [coll2])
+    assert down == {coll1, coll2}
+
+
+def test_lookup():
+    may_access = MayAccess(site, coll1)
+    data_in = ResultOfDataIn(asset, '*', '*', coll1)
+    compute_in = ResultOfComputeIn('*', compute, '*', coll2)
+    index = RuleIndex([may_access, data_in, compute_in])
+
+    assert index.may_access(coll1) == {may_access}
+    assert index.may_access(asset) == set()
+    assert index.may_use(coll1) == set()
+    assert index.result_of_data_in(asset) == {data_in}
+    assert index.result_of_compute_in(compute) == {compute_in}
+    assert len(index.rules()) == 3
+
+
+def test_duplicates():
+    rule = MayAccess(site, asset)
+    index = RuleIndex()
+    index.update({rule}, set())
+    index.update({rule}, set())
+
+    index.update(set(), {rule})
+    assert index.may_access(asset) == {rule}
+
+    index.update(set(), {rule})
+    assert index.may_access(asset) == set()
+    assert index.rules() == []
@@ -1,3 +1,7 @@
+from unittest.mock import MagicMock
+
+from mahiru.definitions.signable import SignatureCache
+from mahiru.policy.replication import RuleValidator
 from mahiru.policy.rules import (
         InAssetCollection, InPartyCategory, MayAccess, ResultOfDataIn)
 
@@ -67,3 +71,41 @@ def test_result_of_in_signatures(party1_main_key):
 
     rule.collection = 'asset_collection:ns2:collection.coll'
     assert not rule.has_valid_signature(party1_main_key.public_key())
+
+
+def test_signature_cache(party1_main_key):
+    key = MagicMock(wraps=party1_main_key.public_key())
+    cache = SignatureCache()
+
+    rule = MayAccess('site:ns1:site1', 'asset:ns2:dataset.asset1:ns2:site2')
+    rule.sign(party1_main_key)
+    assert rule.has_valid_signature(key, cache)
+    assert rule.has_valid_signature(key, cache)
+    assert key.verify.call_count == 1
+
+    # a changed rule is checked again, and isn't valid
+    rule.site = 'site:ns1:site'
+    assert not rule.has_valid_signature(key, cache)
+    assert not rule.has_valid_signature(key, cache)
+    assert key.verify.call_count == 3
+
+
+def test_rule_validator_cache(party1_main_key):
+    rules = [
+            MayAccess(
+                'site:ns1:site1', f'asset:party1:dataset.a{i}:party1:site1')
+            for i in range(1000)]
+    for rule in rules:
+        rule.sign(party1_main_key)
+    rules[500].site = 'site:ns1:site2'
+
+    key = MagicMock(wraps=party1_main_key.public_key())
+    validator = RuleValidator('party1', key, SignatureCache())
+    assert [r for r in rules if not validator.is_valid(r)] == [rules[500]]
+    assert key.verify.call_count == 1000
+
+    # only new and previously invalid rules are verified again
+    rules[500].site = 'site:ns1:site1'
+    rules[500].sign(party1_main_key)
+    assert all(validator.is_valid(r) for r in rules)
+    assert key.verify.call_count == 1001
@@ -0,0 +1,615 @@
+"""Benchmark for complete workflows across a set of sites.
+
+This sets up a number of sites in this process, like the scenario
+tests do, and has several clients submit jobs to them at the same time.
+Each job runs a workflow of a given width and depth: the first layer
+of steps each process a data set from a different site, and the steps
+in each next layer combine two outputs of the layer before. Each job
+also gets a small parameter data set of its own, so that no two jobs
+produce the same results.
+
+Steps can be run in two ways. In plain mode, the built-in addition
+step is used, so that only the REST APIs, policy evaluation and
+orchestration are measured. In container mode, the steps are run in
+Docker by the passthrough compute asset, which copies its input to its
+output, so that container and image handling and data transfers are
+included as well, and data sets of a given size are used. Extra rules
+can be added to each site, to see how the size of the policy affects
+things.
+
+The report has for each run the throughput and latency as seen by the
+clients, and the differences in the sites' metrics from before to
+after the run, which give the amount of data moved and a breakdown of
+where the time went. Since all sites run in this process, they share a
+metrics registry, so these are totals for all sites.
+
+It needs Docker and the test images, so it's skipped unless
+MAHIRU_BENCHMARK is set. Use scenarios/benchmark/benchmark.sh to run
+it. The sweep and the site configuration can be set using the
+environment variables below, and the results are written as JSON to
+the file named by MAHIRU_BENCHMARK_REPORT, if set.
+"""
+from concurrent.futures import ThreadPoolExecutor
+from datetime import datetime, timedelta
+from io import BytesIO
+from itertools import count
+import json
+import logging
+import os
+from pathlib import Path
+from threading import Lock
+import time
+
+from cryptography import x509
+from cryptography.hazmat.primitives.asymmetric.ed25519 import (
+        Ed25519PrivateKey)
+from cryptography.x509.oid import NameOID
+import docker
+import pytest
+import requests
+
+from mahiru.__version__ import __version__
+from mahiru.components.ddm_site import Site
+from mahiru.components.image_codec import GzipCodec
+from mahiru.components.settings import NetworkSettings, SiteConfiguration
+from mahiru.definitions.assets import ComputeAsset, ComputeMetadata, DataAsset
+from mahiru.definitions.identifier import Identifier
+from mahiru.definitions.workflows import Job, Workflow, WorkflowStep
+from mahiru.policy.rules import (
+        InAssetCollection, MayAccess, MayUse, ResultOfComputeIn,
+        ResultOfDataIn)
+from tests.test_scenarios import (
+        add_rules, create_clients, create_servers, deregister_parties,
+        deregister_sites, register_parties, register_sites, sign_rules,
+        stop_servers, upload_assets)
+
+
+logger = logging.getLogger(__file__)
+
+
+# Comma-separated lists of values to sweep over
+STEP_MODES = os.environ.get('MAHIRU_BENCHMARK_STEP_MODES', 'plain,container')
+SITES = os.environ.get('MAHIRU_BENCHMARK_SITES', '2,4')
+SUBMITTERS = os.environ.get('MAHIRU_BENCHMARK_SUBMITTERS', '1,4')
+WIDTHS = os.environ.get('MAHIRU_BENCHMARK_WIDTHS', '2')
+DEPTHS = os.environ.get('MAHIRU_BENCHMARK_DEPTHS', '2')
+# In MiB, only used in container mode
+DATA_SIZES = os.environ.get('MAHIRU_BENCHMARK_DATA_SIZES', '1,64')
+RULES = os.environ.get('MAHIRU_BENCHMARK_RULES', '0,1000')
+
+# Number of jobs per submitter in each run
+JOBS_PER_SUBMITTER = int(os.environ.get(
+        'MAHIRU_BENCHMARK_JOBS_PER_SUBMITTER', '3'))
+# Seconds after which a job is considered to have failed
+JOB_TIMEOUT = float(os.environ.get('MAHIRU_BENCHMARK_JOB_TIMEOUT', '600'))
+
+# Site configuration, to compare against a baseline
+PILOT_POOL_SIZE = int(os.environ.get('MAHIRU_BENCHMARK_PILOT_POOL_SIZE', '0'))
+STEP_SLOTS = os.environ.get('MAHIRU_BENCHMARK_STEP_SLOTS')
+if STEP_SLOTS is not None:
+    STEP_SLOTS = int(STEP_SLOTS)
+IMAGE_CACHE_SIZE = os.environ.get('MAHIRU_BENCHMARK_IMAGE_CACHE_SIZE')
+if IMAGE_CACHE_SIZE is not None:
+    IMAGE_CACHE_SIZE = int(IMAGE_CACHE_SIZE)
+STATE = os.environ.get('MAHIRU_BENCHMARK_STATE', 'memory')
+
+# Time between checks for a job being done
+POLL_INTERVAL = 0.1
+
+IMAGES_DIR = Path(__file__).parents[1] / 'build' / 'images'
+
+PAYLOAD_DOCKERFILE = """
+FROM mahiru-test/data-asset-base:latest
+RUN head -c {size} /dev/urandom >/var/www/data.json && \\
+    chown www-data:www-data /var/www/data.json
+"""
+
+# Parameter data sets don't contain anything, so we use a small image
+PARAM_DOCKERFILE = """
+FROM busybox:latest
+RUN mkdir /var/www && echo '{}' >/var/www/data.json
+CMD ["sh", "-c", "httpd -p 80 -h /var/www; trap 'exit 0' TERM; \\
+     while true ; do sleep 1 ; done"]
+"""
+
+# Serial numbers for runs, to give each its own namespaces
+_runs = count()
+
+
+def percentile(values, fraction):
+    if not values:
+        return None
+    values = sorted(values)
+    index = min(len(values) - 1, int(round(fraction * (len(values) - 1))))
+    return values[index]
+
+
+def namespace(run, i):
+    return f'party{i}.run{run}.mahiru.example.org'
+
+
+def party_id(run, i):
+    return f'party:{namespace(run, i)}:party{i}'
+
+
+def site_id(run, i):
+    return f'site:{namespace(run, i)}:site{i}'
+
+
+def asset_id(run, i, name):
+    return f'asset:{namespace(run, i)}:{name}:{namespace(run, i)}:site{i}'
+
+
+def collection_id(run, i, name):
+    return f'asset_collection:{namespace(run, i)}:{name}'
+
+
+def make_certificate(key, name, dns_name=None):
+    """Make a self-signed certificate for a key."""
+    subject = x509.Name([x509.NameAttribute(NameOID.COMMON_NAME, name)])
+    now = datetime.utcnow()
+    builder = x509.CertificateBuilder()
+    builder = builder.subject_name(subject).issuer_name(subject)
+    builder = builder.public_key(key.public_key())
+    builder = builder.serial_number(x509.random_serial_number())
+    builder = builder.not_valid_before(now - timedelta(days=1))
+    builder = builder.not_valid_after(now + timedelta(days=1))
+    if dns_name is not None:
+        builder = builder.add_extension(x509.SubjectAlternativeName(
+                [x509.DNSName(dns_name)]), critical=False)
+    return builder.sign(key, None)
+
+
+def make_party(run, i):
+    """Make keys and certificates for a party."""
+    main_key = Ed25519PrivateKey.generate()
+    user_ca_key = Ed25519PrivateKey.generate()
+    return {
+            'namespace': namespace(run, i),
+            'main_certificate': make_certificate(main_key, f'party{i}'),
+            'main_key': main_key,
+            'user_ca_certificate': make_certificate(
+                user_ca_key, f'party{i} users'),
+            'user_certificates': []}
+
+
+def filler_rules(run, i, num_rules):
+    """Make rules about assets that don't take part in the jobs.
+
+    These don't change how jobs are planned, but they are replicated,
+    checked and indexed like any other rules.
+    """
+    collection = collection_id(run, i, 'bench.filler')
+    rules = list()
+    for k in range(num_rules):
+        asset = asset_id(run, i, f'bench.filler.{k}')
+        if k % 2 == 0:
+            rules.append(InAssetCollection(asset, collection))
+        else:
+            rules.append(MayAccess(site_id(run, i), asset))
+    return rules
+
+
+def make_scenario(run, params, images, job_tags):
+    """Describe parties and sites, with their assets and rules.
+
+    Site i has a data set which only it may access, and parameter data
+    sets for the jobs submitted to it. Results of all of these may go
+    anywhere. Site 1 also has the compute asset, which anyone may use.
+    """
+    num_sites = params['sites']
+    container = params['step_mode'] == 'container'
+    compute_id = compute_asset_id(run, params['step_mode'])
+    output_base_id = asset_id(run, 1, 'bench.data.output_base')
+
+    scenario = dict()
+    scenario['parties'] = {
+            party_id(run, i): make_party(run, i)
+            for i in range(1, num_sites + 1)}
+
+    scenario['sites'] = dict()
+    for i in range(1, num_sites + 1):
+        https_certificate = make_certificate(
+                Ed25519PrivateKey.generate(), f'site{i}',
+                f'site{i}.{namespace(run, i)}')
+        data = collection_id(run, i, 'bench.data')
+        results = collection_id(run, i, 'bench.results')
+
+        payload_id = asset_id(run, i, 'bench.data.payload')
+        param_ids = [
+                asset_id(run, i, f'bench.data.param.{tag}')
+                for tag, submitter_site in job_tags
+                if submitter_site == i]
+
+        if container:
+            assets = [DataAsset(payload_id, None, str(images['payload']))]
+            assets.extend(
+                    DataAsset(param_id, None, str(images['param']))
+                    for param_id in param_ids)
+        else:
+            assets = [DataAsset(payload_id, i, None)]
+            assets.extend(
+                    DataAsset(param_id, j, None)
+                    for j, param_id in enumerate(param_ids))
+
+        rules = [
+                InAssetCollection(payload_id, data),
+                MayAccess(site_id(run, i), data),
+                ResultOfDataIn(data, '*', '*', results),
+                ResultOfDataIn(results, '*', '*', results),
+                MayAccess('*', results),
+                MayUse('*', results, 'Any use')]
+        rules.extend(
+                InAssetCollection(param_id, results)
+                for param_id in param_ids)
+
+        if i == 1:
+            if container:
+                assets.append(ComputeAsset(
+                        compute_id, None, str(images['compute']),
+                        ComputeMetadata({'y': output_base_id})))
+                assets.append(DataAsset(
+                        output_base_id, None, str(images['output_base'])))
+            else:
+                assets.append(ComputeAsset(compute_id, None, None))
+
+            rules.extend([
+                    MayAccess('*', compute_id),
+                    ResultOfComputeIn('*', compute_id, '*', results),
+                    InAssetCollection(output_base_id, results)])
+
+        rules.extend(filler_rules(run, i, params['rules']))
+
+        scenario['sites'][site_id(run, i)] = {
+                'owner': party_id(run, i),
+                'namespace': namespace(run, i),
+                'https_certificate': https_certificate,
+                'assets': assets,
+                'rules': rules}
+
+    return scenario
+
+
+def compute_asset_id(run, step_mode):
+    if step_mode == 'container':
+        return asset_id(run, 1, 'bench.software.passthrough')
+    # ComputeAsset.run() picks the algorithm using the id
+    return asset_id(run, 1, 'bench.software.addition')
+
+
+def make_job(run, params, tag, submitter_site):
+    """Make a job with a layered workflow.
+
+    Step i in the first layer processes the data set at site i, modulo
+    the number of sites, and the job's parameter set. Step i in each
+    next layer processes the outputs of steps i and i + 1 of the layer
+    before it, wrapping around.
+    """
+    width, depth = params['width'], params['depth']
+    compute_id = compute_asset_id(run, params['step_mode'])
+    if params['step_mode'] == 'container':
+        outputs = {'y': asset_id(run, 1, 'bench.data.output_base')}
+    else:
+        outputs = {'y': None}
+
+    steps = list()
+    for layer in range(depth):
+        for i in range(width):
+            if layer == 0:
+                inputs = {'x1': f'data{i}', 'x2': 'param'}
+            else:
+                inputs = {
+                        'x1': f's{layer - 1}_{i}.y',
+                        'x2': f's{layer - 1}_{(i + 1) % width}.y'}
+            steps.append(WorkflowStep(
+                    name=f's{layer}_{i}', inputs=inputs, outputs=outputs,
+                    compute_asset_id=compute_id))
+
+    workflow = Workflow(
+            ['param'] + [f'data{i}' for i in range(width)],
+            {f'result{i}': f's{depth - 1}_{i}.y' for i in range(width)},
+            steps)
+
+    inputs = {
+            f'data{i}': asset_id(
+                run, i % params['sites'] + 1, 'bench.data.payload')
+            for i in range(width)}
+    inputs['param'] = asset_id(
+            run, submitter_site, f'bench.data.param.{tag}')
+
+    return Job(party_id(run, submitter_site), workflow, inputs)
+
+
+def create_sites(registry_client, site_descriptions, state_dir):
+    """Create sites configured for the benchmark."""
+    sites = dict()
+    for n, (site_id, desc) in enumerate(site_descriptions.items()):
+        kwargs = {'pilot_pool_size': PILOT_POOL_SIZE}
+        if STEP_SLOTS is not None:
+            kwargs['step_slots'] = STEP_SLOTS
+        if IMAGE_CACHE_SIZE is not None:
+            kwargs['image_cache_size'] = IMAGE_CACHE_SIZE
+        if STATE == 'sqlite':
+            kwargs['state_dir'] = state_dir / f'site{n + 1}'
+
+        config = SiteConfiguration(
+                site_id, desc['namespace'], Identifier(desc['owner']),
+                NetworkSettings(), '', **kwargs)
+        sites[site_id] = Site(config, [], [], registry_client)
+    return sites
+
+
+def scrape_metrics(server):
+    """Get a site's metrics.
+
+    Return:
+        A dict mapping series to values, and a set of histogram names.
+    """
+    r = requests.get(f'{server.internal_endpoint}/metrics')
+    r.raise_for_status()
+
+    samples = dict()
+    histograms = set()
+    for line in r.text.splitlines():
+        if line.startswith('# TYPE '):
+            _, _, name, kind = line.split(' ')
+            if kind == 'histogram':
+                histograms.add(name)
+        elif line and not line.startswith('#'):
+            series, value = line.rsplit(' ', 1)
+            samples[series] = float(value)
+    return samples, histograms
+
+
+def metrics_delta(before, after):
+    """Summarise how the metrics changed during a run.
+
+    Return:
+        A dict with the seconds spent and the number of observations
+        for each histogram series, and the increase of each counter,
+        leaving out anything that didn't change.
+    """
+    samples, histograms = after
+    delta = {
+            series: value - before[0].get(series, 0.0)
+            for series, value in samples.items()}
+
+    components = dict()
+    counters = dict()
+    for series, value in delta.items():
+        name, _, labels = series.partition('{')
+        labels = '{' + labels if labels else ''
+        if name.endswith('_sum') and name[:-4] in histograms:
+            observations = delta[f'{name[:-4]}_count{labels}']
+            if observations:
+                components[name[:-4] + labels] = {
+                        'seconds': value, 'count': observations}
+        elif name.endswith('_total') and value:
+            counters[series] = value
+
+    return {'components': components, 'counters': counters}
+
+
+def histogram_mean(metrics, series):
+    component = metrics['components'].get(series)
+    if not component:
+        return 0.0
+    return component['seconds'] / component['count']
+
+
+class BenchmarkImages:
+    """Makes and keeps track of asset images for the benchmark."""
+    def __init__(self, dcli, image_dir):
+        self._dcli = dcli
+        self._image_dir = image_dir
+        self._tags = list()
+        self._images = {
+                'compute': IMAGES_DIR / 'compute-asset-passthrough.tar.gz',
+                'output_base': IMAGES_DIR / 'data-asset-base.tar.gz'}
+
+        for path in self._images.values():
+            if not path.exists():
+                pytest.skip(f'{path} not found, use make assets')
+
+        self._images['param'] = self._build(
+                'param', PARAM_DOCKERFILE)
+
+    def get(self, data_size):
+        """Return paths of image files for a given data size in MiB."""
+        key = f'payload-{data_size}'
+        if key not in self._images:
+            self._images[key] = self._build(
+                    key, PAYLOAD_DOCKERFILE.format(size=data_size * 2**20))
+        images = dict(self._images)
+        images['payload'] = images[key]
+        return images
+
+    def close(self):
+        for tag in self._tags:
+            self._dcli.images.remove(tag, force=True)
+
+    def _build(self, name, dockerfile):
+        tag = f'mahiru-test/bench-{name}:latest'
+        logger.info(f'Building image {tag}')
+        image, _ = self._dcli.images.build(
+                fileobj=BytesIO(dockerfile.encode('utf-8')), tag=tag, rm=True)
+        self._tags.append(tag)
+
+        image_file = self._image_dir / f'bench-{name}.tar.gz'
+        GzipCodec().compress(image.save(named=True), image_file)
+        return image_file
+
+
+@pytest.fixture
+def benchmark_images(tmp_path):
+    if not os.environ.get('MAHIRU_BENCHMARK'):
+        pytest.skip(
+                'Benchmark not enabled, use scenarios/benchmark/benchmark.sh')
+
+    dcli = docker.from_env()
+    images = None
+    if 'container' in STEP_MODES.split(','):
+        images = BenchmarkImages(dcli, tmp_path)
+
+    yield images
+
+    if images is not None:
+        images.close()
+    dcli.close()
+
+
+def run_benchmark(
+        registry_client, registration_client, images, state_dir, params):
+    """Run jobs on a fresh set of sites and return statistics."""
+    run = next(_runs)
+    num_sites = params['sites']
+    num_submitters = params['submitters']
+
+    def submitter_site(submitter):
+        return submitter % num_sites + 1
+
+    job_tags = [('warmup', 1)] + [
+            (f'{m}.{j}', submitter_site(m))
+            for m in range(num_submitters)
+            for j in range(JOBS_PER_SUBMITTER)]
+
+    scenario = make_scenario(run, params, images, job_tags)
+    register_parties(registration_client, scenario['parties'])
+    sign_rules(scenario['sites'], scenario['parties'])
+    sites = create_sites(
+            registry_client, scenario['sites'], state_dir / f'run{run}')
+    servers = dict()
+
+    latencies = list()
+    failed_jobs = 0
+    lock = Lock()
+
+    def run_job(client, tag, site):
+        nonlocal failed_jobs
+        job = make_job(run, params, tag, site)
+        start = time.perf_counter()
+        job_id = client.submit_job(job)
+        while not client.is_job_done(job_id):
+            if time.perf_counter() - start > JOB_TIMEOUT:
+                logger.error(f'Job {job_id} timed out')
+                with lock:
+                    failed_jobs += 1
+                return
+            time.sleep(POLL_INTERVAL)
+
+        with lock:
+            latencies.append(time.perf_counter() - start)
+
+    def submit(submitter):
+        site = submitter_site(submitter)
+        client = clients[site_id(run, site)]
+        for j in range(JOBS_PER_SUBMITTER):
+            run_job(client, f'{submitter}.{j}', site)
+
+    try:
+        servers = create_servers(registry_client, sites)
+        clients = create_clients(servers, sites)
+        upload_assets(scenario['sites'], clients)
+        add_rules(scenario['sites'], clients)
+        register_sites(
+                scenario['sites'], registration_client, scenario['parties'],
+                sites, servers)
+
+        # warm up, e.g. to replicate the rules
+        run_job(clients[site_id(run, 1)], 'warmup', 1)
+        latencies.clear()
+
+        metrics_server = servers[site_id(run, 1)]
+        before = scrape_metrics(metrics_server)
+        start = time.perf_counter()
+        with ThreadPoolExecutor(num_submitters) as pool:
+            list(pool.map(submit, range(num_submitters)))
+        duration = time.perf_counter() - start
+        metrics = metrics_delta(before, scrape_metrics(metrics_server))
+
+    finally:
+        stop_servers(servers)
+        deregister_sites(registration_client, sites)
+        deregister_parties(registration_client, scenario['parties'])
+        for site in sites.values():
+            site.close()
+
+    steps = len(latencies) * params['width'] * params['depth']
+    input_wait = histogram_mean(
+            metrics, 'mahiru_step_wait_seconds{reason="inputs"}')
+    slot_wait = histogram_mean(
+            metrics, 'mahiru_step_wait_seconds{reason="slot"}')
+
+    result = dict(params)
+    result.update({
+            'jobs': len(latencies),
+            'failed_jobs': failed_jobs,
+            'duration': duration,
+            'jobs_per_second': len(latencies) / duration,
+            'steps_per_second': steps / duration,
+            'job_latency_p50': percentile(latencies, 0.5),
+            'job_latency_p99': percentile(latencies, 0.99),
+            # from arrival of the job at the site, so for later layers
+            # this includes waiting for the steps before
+            'step_start_latency_mean': input_wait + slot_wait,
+            'step_input_wait_mean': input_wait,
+            'step_slot_wait_mean': slot_wait,
+            'bytes_transferred': metrics['counters'].get(
+                'mahiru_image_download_bytes_total', 0.0)})
+    result.update(metrics)
+    return result
+
+
+def sweep():
+    """Return the parameters of the runs to do."""
+    for step_mode in STEP_MODES.split(','):
+        data_sizes = [None]
+        if step_mode == 'container':
+            data_sizes = list(map(int, DATA_SIZES.split(',')))
+        for num_sites in map(int, SITES.split(',')):
+            for submitters in map(int, SUBMITTERS.split(',')):
+                for width in map(int, WIDTHS.split(',')):
+                    for depth in map(int, DEPTHS.split(',')):
+                        for data_size in data_sizes:
+                            for rules in map(int, RULES.split(',')):
+                                yield {
+                                        'step_mode': step_mode,
+                                        'sites': num_sites,
+                                        'submitters': submitters,
+                                        'width': width,
+                                        'depth': depth,
+                                        'data_size': data_size,
+                                        'rules': rules}
+
+
+def test_scenario_benchmark(
+        benchmark_images, registry_server, registry_client,
+        registration_client, tmp_path):
+    results = list()
+    for params in sweep():
+        images = None
+        if params['step_mode'] == 'container':
+            images = benchmark_images.get(params['data_size'])
+        result = run_benchmark(
+                registry_client, registration_client, images, tmp_path,
+                params)
+        logger.info(f'Benchmark result: {result}')
+        results.append(result)
+
+    report_file = os.environ.get('MAHIRU_BENCHMARK_REPORT')
+    if report_file:
+        report = {
+                'label': os.environ.get('MAHIRU_BENCHMARK_LABEL'),
+                'version': __version__,
+                'settings': {
+                    'jobs_per_submitter': JOBS_PER_SUBMITTER,
+                    'pilot_pool_size': PILOT_POOL_SIZE,
+                    'step_slots': STEP_SLOTS,
+                    'image_cache_size': IMAGE_CACHE_SIZE,
+                    'state': STATE},
+                'runs': results}
+        with open(report_file, 'w') as f:
+            json.dump(report, f, indent=4)
+
+    for result in results:
+        assert result['failed_jobs'] == 0
@@ -2,6 +2,7 @@ from unittest.mock import MagicMock
 
 from mahiru.definitions.assets import ComputeAsset
 from mahiru.definitions.identifier import Identifier
+from mahiru.definitions.interfaces import IPolicyCollection
 from mahiru.definitions.workflows import Job, Workflow, WorkflowStep
 from mahiru.policy.evaluation import PolicyEvaluator
 from mahiru.components.orchestration import WorkflowPlanner
@@ -9,7 +10,7 @@ from mahiru.policy.rules import (
         MayAccess, MayUse, ResultOfDataIn, ResultOfComputeIn)
 
 
-class MockPolicySource:
+class MockPolicySource(IPolicyCollection):
     def __init__(self, rules):
         self._rules = rules
 
@@ -0,0 +1,113 @@
+from threading import Thread
+from unittest.mock import MagicMock
+
+import pytest
+
+from mahiru.components.asset_store import AssetStore
+from mahiru.components.state_store import MemoryStateStore, SQLiteStateStore
+from mahiru.definitions.assets import Asset, DataAsset
+from mahiru.definitions.identifier import Identifier
+
+
+@pytest.fixture(params=['memory', 'sqlite'])
+def state_store(request, temp_path):
+    if request.param == 'memory':
+        store = MemoryStateStore()
+    else:
+        store = SQLiteStateStore(temp_path / 'state.db')
+    yield store
+    store.close()
+
+
+def test_table(state_store):
+    table = state_store.table('owners', Identifier)
+    owner = Identifier('site:ns:site1')
+
+    assert table.get('1') is None
+    assert table.insert('1', owner)
+    assert not table.insert('1', Identifier('site:ns:site2'))
+    assert table.get('1') == owner
+    assert isinstance(table.get('1'), Identifier)
+
+    table.put('2', owner)
+    assert sorted(table.keys()) == ['1', '2']
+    assert state_store.table('other', Identifier).keys() == []
+
+    assert table.delete('1') == owner
+    assert table.delete('1') is None
+    assert table.keys() == ['2']
+
+
+def test_table_objects(state_store):
+    table = state_store.table('assets', Asset)
+    asset = DataAsset(
+            'asset:ns:data:ns:site', None, '/tmp/image.tar.gz')
+    table.put(asset.id, asset)
+
+    asset2 = table.get(asset.id)
+    assert asset2.id == asset.id
+    assert asset2.image_location == asset.image_location
+    assert asset2.metadata.item == asset.metadata.item
+
+
+def test_next_serial(state_store):
+    assert state_store.next_serial('jobs') == 1
+    assert state_store.next_serial('jobs') == 2
+    assert state_store.next_serial('steps') == 1
+
+
+def test_sqlite_shared(temp_path):
+    store1 = SQLiteStateStore(temp_path / 'state.db')
+    store2 = SQLiteStateStore(temp_path / 'state.db')
+
+    owner = Identifier('site:ns:site1')
+    store1.table('owners', Identifier).put('1', owner)
+    assert store2.table('owners', Identifier).get('1') == owner
+
+    serials = list()
+
+    def take_serials(store):
+        for _ in range(50):
+            serials.append(store.next_serial('jobs'))
+
+    threads = [
+            Thread(target=take_serials, args=(store,))
+            for store in (store1, store2, store1, store2)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    assert sorted(serials) == list(range(1, 201))
+
+    store1.close()
+    store2.close()
+
+    # state survives a restart
+    store3 = SQLiteStateStore(temp_path / 'state.db')
+    assert store3.table('owners', Identifier).get('1') == owner
+    assert store3.next_serial('jobs') == 201
+    store3.close()
+
+
+def test_asset_store_shared(temp_path, test_image_file):
+    image_dir = temp_path / 'images'
+    image_dir.mkdir()
+    state1 = SQLiteStateStore(temp_path / 'state.db')
+    state2 = SQLiteStateStore(temp_path / 'state.db')
+    store1 = AssetStore(MagicMock(), MagicMock(), image_dir, state1)
+    store2 = AssetStore(MagicMock(), MagicMock(), image_dir, state2)
+
+    asset_id = Identifier('asset:ns:test_asset:ns:site')
+    store1.store(DataAsset(asset_id, None, str(test_image_file)))
+    with pytest.raises(KeyError):
+        store2.store(DataAsset(asset_id, None, str(test_image_file)))
+
+    asset = store2.retrieve(asset_id, MagicMock(), 1.0)
+    assert asset.image_location == str(image_dir / f'{asset_id}.tar.gz')
+
+    store1.close()
+    store2.close()
+    assert image_dir.exists()
+    state1.close()
+    state2.close()
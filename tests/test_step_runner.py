@@ -0,0 +1,121 @@
+from threading import Barrier, BoundedSemaphore, Lock
+import time
+from unittest.mock import MagicMock
+
+import pytest
+
+from mahiru.components.step_runner import JobRun
+from mahiru.definitions.identifier import Identifier
+
+
+class RecordingJobRun(JobRun):
+    """A JobRun that records step executions instead of running them."""
+    def __init__(self, request, site_rest_client, slots=None, hold=None):
+        permission_calculator = MagicMock()
+        permission_calculator.is_legal.return_value = True
+        super().__init__(
+                site_rest_client, permission_calculator, MagicMock(),
+                Identifier('site:ns:site1'), request, MagicMock(), slots)
+        self.events = list()
+        self.max_active = 0
+        self._active = 0
+        self._hold = hold
+        self._record_lock = Lock()
+
+    def _execute_step(self, step, inputs, id_hashes):
+        with self._record_lock:
+            self.events.append(('start', step.name))
+            self._active += 1
+            self.max_active = max(self.max_active, self._active)
+        if self._hold is not None:
+            self._hold(step)
+        with self._record_lock:
+            self._active -= 1
+            self.events.append(('end', step.name))
+
+
+def make_step(name, inputs):
+    step = MagicMock()
+    step.name = name
+    step.inputs = inputs
+    return step
+
+
+def make_request(steps, step_sites):
+    request = MagicMock()
+    request.job.workflow.steps = {step.name: step for step in steps}
+    dataset = MagicMock()
+    dataset.location.return_value = Identifier('site:ns:site2')
+    request.job.inputs = {'x': dataset}
+    request.job.id_hashes.return_value = {
+            f'{step.name}.y': f'hash_{step.name}' for step in steps}
+    request.plan.step_sites = step_sites
+    return request
+
+
+def test_parallel_steps():
+    # a and b are independent, c needs both
+    steps = [
+            make_step('a', {'x': 'x'}),
+            make_step('b', {'x': 'x'}),
+            make_step('c', {'a': 'a.y', 'b': 'b.y'})]
+    request = make_request(steps, {s.name: 'site:ns:site1' for s in steps})
+
+    barrier = Barrier(2, timeout=5.0)
+
+    def hold(step):
+        if step.name in ('a', 'b'):
+            barrier.wait()
+
+    client = MagicMock()
+    run = RecordingJobRun(request, client, BoundedSemaphore(2), hold)
+    run.run()
+
+    assert run.max_active == 2
+    assert run.events[-2:] == [('start', 'c'), ('end', 'c')]
+
+
+def test_slot_limit():
+    steps = [make_step(name, {'x': 'x'}) for name in 'abcd']
+    request = make_request(steps, {s.name: 'site:ns:site1' for s in steps})
+
+    run = RecordingJobRun(
+            request, MagicMock(), BoundedSemaphore(1),
+            lambda step: time.sleep(0.01))
+    run.run()
+    assert run.max_active == 1
+    assert len(run.events) == 8
+
+
+def test_remote_input():
+    # a runs elsewhere, b here
+    steps = [make_step('a', {'x': 'x'}), make_step('b', {'a': 'a.y'})]
+    request = make_request(
+            steps, {'a': 'site:ns:site2', 'b': 'site:ns:site1'})
+
+    client = MagicMock()
+    client.retrieve_asset.side_effect = [KeyError(), MagicMock()]
+
+    run = RecordingJobRun(request, client)
+    run.run()
+
+    assert run.events == [('start', 'b'), ('end', 'b')]
+    assert client.retrieve_asset.call_count == 2
+    args = client.retrieve_asset.call_args[0]
+    assert args[0] == 'site:ns:site2'
+    assert args[1] == 'result:hash_a'
+    assert args[2] > 0.0
+
+
+def test_failed_step():
+    steps = [make_step('a', {'x': 'x'}), make_step('b', {'a': 'a.y'})]
+    request = make_request(steps, {s.name: 'site:ns:site1' for s in steps})
+
+    def hold(step):
+        raise RuntimeError('Step failed')
+
+    client = MagicMock()
+    run = RecordingJobRun(request, client, hold=hold)
+    with pytest.raises(RuntimeError):
+        run.run()
+    assert run.events == [('start', 'a')]